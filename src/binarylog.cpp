@@ -0,0 +1,324 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "binarylog.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QVector>
+
+#include <algorithm>
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestBinaryLog, "xdp-test-binary-log")
+
+// Has to be a power of two, 64 bytes a record
+#define RING_SIZE (1 << 14)
+#define TEXT_LENGTH 16
+#define LOG_MAGIC "XDPBLOG1"
+// Sequence of a record somebody is writing right now
+#define RECORD_WRITING (~quint64(0))
+// Records copied at once while dumping, 4 KB on the stack
+#define DUMP_CHUNK 64
+
+struct LogRecord {
+    // Sequence number plus one once the record is complete, 0 for records
+    // never written and RECORD_WRITING while it's written. Works like a
+    // seqlock, readers only trust what they copied when it didn't change.
+    QAtomicInteger<quint64> sequence;
+    quint64 timestamp;
+    quint32 thread;
+    quint16 event;
+    quint16 textLength;
+    quint64 args[3];
+    char text[TEXT_LENGTH];
+};
+
+struct LogHeader {
+    char magic[8];
+    quint32 recordSize;
+    quint32 capacity;
+    quint64 monotonicTime;
+    quint64 realTime;
+};
+
+struct EventDescription {
+    const char *name;
+    const char *text;
+    const char *args[3];
+};
+
+static const EventDescription events[BinaryLog::EventCount] = {
+    { nullptr, nullptr, { nullptr, nullptr, nullptr } },
+    { "session-message", "member", { "interface", nullptr, nullptr } },
+    { "session-introspect", nullptr, { "length", nullptr, nullptr } },
+    { "stream-state", "state", { "direction", nullptr, nullptr } },
+    { "remote-state", "state", { nullptr, nullptr, nullptr } },
+    { "stream-format", nullptr, { "width", "height", "format" } },
+    { "stream-renegotiated", nullptr, { "latency-us", nullptr, nullptr } },
+    { "buffer-count-adapted", nullptr, { "from", "to", "round-trip-us" } },
+    { "first-frame-resumed", nullptr, { "latency-us", nullptr, nullptr } },
+    { "frames-skipped", nullptr, { "job", "frames", nullptr } },
+};
+
+static const char *const interfaceNames[] = { "other", "Session", "Properties", "ScreenCastControl", "Introspectable" };
+
+static LogRecord records[RING_SIZE];
+static QAtomicInteger<quint64> nextSequence;
+static char logFileName[PATH_MAX];
+static thread_local quint32 threadId = 0;
+
+static quint64 clockTime(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return quint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void writeRecord(BinaryLog::Event event, const char *text, int textLength, const QChar *unicode, quint64 arg0, quint64 arg1, quint64 arg2)
+{
+    if (Q_UNLIKELY(!threadId))
+        threadId = syscall(SYS_gettid);
+
+    const quint64 sequence = nextSequence.fetchAndAddRelaxed(1);
+    LogRecord &record = records[sequence & (RING_SIZE - 1)];
+
+    // Once the ring wrapped, a writer from a full round earlier may still be
+    // in the slot, rather lose this record than mix the two
+    const quint64 previous = record.sequence.load();
+    if (previous == RECORD_WRITING || !record.sequence.testAndSetAcquire(previous, RECORD_WRITING))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.timestamp = clockTime(CLOCK_MONOTONIC);
+    record.thread = threadId;
+    record.event = event;
+    record.args[0] = arg0;
+    record.args[1] = arg1;
+    record.args[2] = arg2;
+
+    textLength = qMin(textLength, TEXT_LENGTH);
+    for (int i = 0; i < textLength; i++)
+        record.text[i] = unicode ? unicode[i].toLatin1() : text[i];
+    record.textLength = textLength;
+
+    record.sequence.storeRelease(sequence + 1);
+}
+
+// Copies a record, or leaves it empty when it was written in the meantime
+static void readRecord(const LogRecord &record, LogRecord &copy)
+{
+    const quint64 before = record.sequence.loadAcquire();
+
+    copy.timestamp = record.timestamp;
+    copy.thread = record.thread;
+    copy.event = record.event;
+    copy.textLength = record.textLength;
+    memcpy(copy.args, record.args, sizeof(copy.args));
+    memcpy(copy.text, record.text, sizeof(copy.text));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const quint64 after = record.sequence.load();
+
+    copy.sequence.store(before == after && before != RECORD_WRITING ? before : 0);
+}
+
+static void dumpAtExit()
+{
+    BinaryLog::dump(logFileName);
+}
+
+static void dumpOnSignal(int signal)
+{
+    BinaryLog::dump(logFileName);
+
+    // The handler was reset already, let the default action happen
+    raise(signal);
+}
+
+void BinaryLog::initialize()
+{
+    static bool initialized = false;
+    if (initialized || !qEnvironmentVariableIsSet("XDP_TEST_BINARY_LOG"))
+        return;
+
+    const QByteArray fileName = qgetenv("XDP_TEST_BINARY_LOG");
+    if (fileName.size() >= PATH_MAX) {
+        qCWarning(XdgDesktopPortalTestBinaryLog) << "Binary log file name is too long";
+        return;
+    }
+
+    strcpy(logFileName, fileName.constData());
+    initialized = true;
+
+    qAddPostRoutine(dumpAtExit);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpOnSignal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (int signal : { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM })
+        sigaction(signal, &action, nullptr);
+}
+
+void BinaryLog::log(Event event, quint64 arg0, quint64 arg1, quint64 arg2)
+{
+    writeRecord(event, nullptr, 0, nullptr, arg0, arg1, arg2);
+}
+
+void BinaryLog::log(Event event, const char *text, quint64 arg0, quint64 arg1, quint64 arg2)
+{
+    writeRecord(event, text, text ? strnlen(text, TEXT_LENGTH) : 0, nullptr, arg0, arg1, arg2);
+}
+
+void BinaryLog::log(Event event, const QString &text, quint64 arg0, quint64 arg1, quint64 arg2)
+{
+    // Converted while copying, there is no temporary QByteArray
+    writeRecord(event, nullptr, text.size(), text.constData(), arg0, arg1, arg2);
+}
+
+static bool writeAll(int fd, const void *data, size_t size)
+{
+    const char *bytes = static_cast<const char *>(data);
+
+    while (size) {
+        const ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool BinaryLog::dump(const char *fileName)
+{
+    // Only async signal safe calls from here on, we may be in a crash handler
+    const int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.recordSize = sizeof(LogRecord);
+    header.capacity = RING_SIZE;
+    header.monotonicTime = clockTime(CLOCK_MONOTONIC);
+    header.realTime = clockTime(CLOCK_REALTIME);
+
+    // Other threads keep logging, records are checked one by one
+    bool written = writeAll(fd, &header, sizeof(header));
+    LogRecord chunk[DUMP_CHUNK];
+    for (int i = 0; written && i < RING_SIZE; i += DUMP_CHUNK) {
+        for (int j = 0; j < DUMP_CHUNK; j++)
+            readRecord(records[i + j], chunk[j]);
+        written = writeAll(fd, chunk, sizeof(chunk));
+    }
+    close(fd);
+
+    return written;
+}
+
+bool BinaryLog::decode(const QString &fileName, FILE *out)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(XdgDesktopPortalTestBinaryLog) << "Failed to open binary log" << fileName << file.errorString();
+        return false;
+    }
+
+    LogHeader header;
+    if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) || header.recordSize != sizeof(LogRecord)) {
+        qCWarning(XdgDesktopPortalTestBinaryLog) << fileName << "is not a binary log of this version";
+        return false;
+    }
+
+    const QByteArray data = file.read(qint64(header.capacity) * sizeof(LogRecord));
+    if (data.size() != qint64(header.capacity) * sizeof(LogRecord)) {
+        qCWarning(XdgDesktopPortalTestBinaryLog) << "Binary log" << fileName << "is truncated";
+        return false;
+    }
+
+    // Records still being written when the log was dumped have no sequence number
+    const LogRecord *logged = reinterpret_cast<const LogRecord *>(data.constData());
+    QVector<const LogRecord *> ordered;
+    for (quint32 i = 0; i < header.capacity; i++) {
+        const quint64 sequence = logged[i].sequence.load();
+        if (sequence && sequence != RECORD_WRITING && logged[i].event > 0 && logged[i].event < EventCount)
+            ordered << &logged[i];
+    }
+    std::sort(ordered.begin(), ordered.end(), [] (const LogRecord *a, const LogRecord *b) {
+        return a->sequence.load() < b->sequence.load();
+    });
+
+    // Wall clock time of the records, relative to when the ring was dumped
+    const qint64 realOffset = qint64(header.realTime) - qint64(header.monotonicTime);
+
+    for (const LogRecord *record : qAsConst(ordered)) {
+        const EventDescription &description = events[record->event];
+        const quint64 realTime = record->timestamp + realOffset;
+        const time_t seconds = realTime / 1000000000;
+        struct tm local;
+        char timeString[32];
+        localtime_r(&seconds, &local);
+        strftime(timeString, sizeof(timeString), "%H:%M:%S", &local);
+
+        fprintf(out, "%s.%06llu [%u] %s", timeString, (unsigned long long) (realTime % 1000000000) / 1000, record->thread, description.name);
+
+        if (description.text)
+            fprintf(out, " %s=%.*s", description.text, qMin<int>(record->textLength, TEXT_LENGTH), record->text);
+
+        for (int i = 0; i < 3; i++) {
+            if (!description.args[i])
+                continue;
+
+            if (record->event == SessionMessage && i == 0 && record->args[0] < sizeof(interfaceNames) / sizeof(interfaceNames[0]))
+                fprintf(out, " %s=%s", description.args[i], interfaceNames[record->args[0]]);
+            else
+                fprintf(out, " %s=%llu", description.args[i], (unsigned long long) record->args[i]);
+        }
+
+        fputc('\n', out);
+    }
+
+    // The ring wrapped around when more than its size was ever logged
+    if (!ordered.isEmpty() && ordered.first()->sequence.load() > 1)
+        fprintf(out, "(%llu earlier records were overwritten)\n", (unsigned long long) ordered.first()->sequence.load() - 1);
+
+    return true;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_BINARY_LOG_H
+#define XDG_DESKTOP_PORTAL_TEST_BINARY_LOG_H
+
+#include <QString>
+
+#include <stdio.h>
+
+// Fixed size records in a preallocated ring shared by all threads, for
+// events on paths where qCDebug() would cost too much, like D-Bus dispatch
+// or the PipeWire loop. Logging never allocates or locks, old records get
+// overwritten. The ring is written as it is to XDP_TEST_BINARY_LOG when the
+// portal quits or crashes and decoded offline with xdp-test-logdecode.
+class BinaryLog
+{
+public:
+    enum Event {
+        SessionMessage = 1, // member, interface
+        SessionIntrospect,  // length of the XML
+        StreamState,        // state, stream direction
+        RemoteState,        // state
+        StreamFormat,       // width, height, video format
+        StreamRenegotiated, // latency in us
+        BufferCountAdapted, // previous count, new count, round trip in us
+        FirstFrameResumed,  // latency in us
+        FramesSkipped,      // scheduler job, frames
+        EventCount
+    };
+
+    enum Interface {
+        OtherInterface = 0,
+        SessionInterface,
+        PropertiesInterface,
+        ControlInterface,
+        IntrospectableInterface
+    };
+
+    // Installs the dump at exit and on fatal signals, has to be called once
+    // the application object exists
+    static void initialize();
+
+    static void log(Event event, quint64 arg0 = 0, quint64 arg1 = 0, quint64 arg2 = 0);
+    // Only the first 16 characters of @text are kept
+    static void log(Event event, const char *text, quint64 arg0 = 0, quint64 arg1 = 0, quint64 arg2 = 0);
+    static void log(Event event, const QString &text, quint64 arg0 = 0, quint64 arg1 = 0, quint64 arg2 = 0);
+
+    // Async signal safe
+    static bool dump(const char *fileName);
+
+    // Prints the records of a dump in the order they were logged
+    static bool decode(const QString &fileName, FILE *out);
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_BINARY_LOG_H
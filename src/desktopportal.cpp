@@ -30,6 +30,9 @@ Q_LOGGING_CATEGORY(XdgDesktopPortalTestDesktopPortal, "xdp-test-desktop-portal")
 DesktopPortal::DesktopPortal(QObject *parent)
     : QObject(parent)
     , m_screenCast(new ScreenCastPortal(this))
+    , m_screenCastControl(new ScreenCastPortalControl(m_screenCast, this))
+    , m_screenshot(new ScreenshotPortal(this))
+    , m_screenshotControl(new ScreenshotControl(m_screenshot, this))
 {
 }
 
@@ -26,6 +26,7 @@
 #include <QDBusContext>
 
 #include "screencast.h"
+#include "screenshot.h"
 
 class DesktopPortal : public QObject, public QDBusContext
 {
@@ -36,6 +37,9 @@ public:
 
 private:
     ScreenCastPortal *m_screenCast;
+    ScreenCastPortalControl *m_screenCastControl;
+    ScreenshotPortal *m_screenshot;
+    ScreenshotControl *m_screenshotControl;
 
 };
 
@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "framebufferpool.h"
+#include "framescaler.h"
+#include "threadtuning.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <QLoggingCategory>
+#include <QMutexLocker>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestFramebufferPool, "xdp-test-framebuffer-pool")
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Free buffers we keep around before handing memory back to the system
+#define MAX_FREE_BUFFERS 8
+
+Q_GLOBAL_STATIC(FramebufferPool, framebufferPool)
+
+FramebufferPool *FramebufferPool::instance()
+{
+    return framebufferPool();
+}
+
+FramebufferPool::FramebufferPool()
+{
+    const QByteArray alignment = qgetenv("XDP_TEST_FB_ALIGN");
+    if (alignment == "page")
+        m_alignment = AlignPage;
+
+    const QByteArray hugePages = qgetenv("XDP_TEST_FB_HUGEPAGES");
+    if (hugePages == "thp")
+        m_hugePages = HugePagesTransparent;
+    else if (hugePages == "1")
+        m_hugePages = HugePagesExplicit;
+
+    // Huge pages only make sense for page aligned mappings
+    if (m_hugePages != HugePagesNone)
+        m_alignment = AlignPage;
+
+    m_numaLocal = ThreadTuning::numaLocal();
+}
+
+FramebufferPool::~FramebufferPool()
+{
+    trim();
+}
+
+QImage FramebufferPool::acquireImage(const QSize &size, QImage::Format format)
+{
+    if (size.isEmpty())
+        return QImage();
+
+    // All formats we get from PipeWire are 32 bits per pixel
+    const int bytesPerLine = (size.width() * FrameScaler::BytesPerPixel + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    const size_t needed = (size_t) bytesPerLine * size.height();
+
+    const int node = m_numaLocal ? ThreadTuning::currentNode() : -1;
+
+    QMutexLocker locker(&m_mutex);
+
+    // Best fit, but don't waste a buffer more than twice as large
+    int bestFit = -1;
+    for (int i = 0; i < m_free.count(); i++) {
+        const size_t available = m_free.at(i).size;
+        if (m_numaLocal && m_free.at(i).node != node)
+            continue;
+        if (available >= needed && available <= needed * 2 &&
+            (bestFit < 0 || available < m_free.at(bestFit).size))
+            bestFit = i;
+    }
+
+    Block block;
+    if (bestFit >= 0) {
+        block = m_free.takeAt(bestFit);
+        m_reuses++;
+    } else {
+        block = allocate(needed);
+        if (!block.data)
+            return QImage();
+        // Pages are placed when first touched, by the thread filling the image
+        block.node = node;
+        m_allocations++;
+    }
+
+    m_used.insert(block.data, block);
+
+    return QImage(block.data, size.width(), size.height(), bytesPerLine, format, releaseImage, block.data);
+}
+
+FramebufferPool::Alignment FramebufferPool::alignment() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_alignment;
+}
+
+void FramebufferPool::setAlignment(Alignment alignment)
+{
+    QMutexLocker locker(&m_mutex);
+    m_alignment = alignment;
+}
+
+FramebufferPool::HugePages FramebufferPool::hugePages() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_hugePages;
+}
+
+void FramebufferPool::setHugePages(HugePages hugePages)
+{
+    QMutexLocker locker(&m_mutex);
+    m_hugePages = hugePages;
+    if (hugePages != HugePagesNone)
+        m_alignment = AlignPage;
+}
+
+void FramebufferPool::trim()
+{
+    QMutexLocker locker(&m_mutex);
+
+    for (const Block &block : qAsConst(m_free))
+        free(block);
+
+    m_free.clear();
+}
+
+FramebufferPool::Statistics FramebufferPool::statistics() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    Statistics statistics;
+    statistics.allocations = m_allocations;
+    statistics.reuses = m_reuses;
+    statistics.buffersInUse = m_used.count();
+    statistics.buffersFree = m_free.count();
+
+    for (const Block &block : m_used)
+        statistics.bytesInUse += block.size;
+    for (const Block &block : m_free)
+        statistics.bytesFree += block.size;
+
+    return statistics;
+}
+
+FramebufferPool::Block FramebufferPool::allocate(size_t size)
+{
+    Block block;
+
+    // The heap may hand out memory another node already touched, mappings are fresh
+    if (m_alignment == AlignCacheLine && !m_numaLocal) {
+        void *data = nullptr;
+        if (posix_memalign(&data, CACHE_LINE_SIZE, size) != 0) {
+            qCWarning(XdgDesktopPortalTestFramebufferPool) << "Failed to allocate framebuffer of" << size << "bytes";
+            return block;
+        }
+
+        block.data = static_cast<uint8_t *>(data);
+        block.size = size;
+        return block;
+    }
+
+    void *data = MAP_FAILED;
+
+    if (m_hugePages == HugePagesExplicit) {
+        const size_t hugeSize = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+        data = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) {
+            size = hugeSize;
+        } else {
+            qCDebug(XdgDesktopPortalTestFramebufferPool) << "No huge pages reserved, falling back to transparent huge pages";
+        }
+    }
+
+    if (data == MAP_FAILED) {
+        const size_t pageSize = (size_t) getpagesize();
+        size = (size + pageSize - 1) & ~(pageSize - 1);
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (data == MAP_FAILED) {
+            qCWarning(XdgDesktopPortalTestFramebufferPool) << "Failed to map framebuffer of" << size << "bytes";
+            return block;
+        }
+
+        if (m_hugePages != HugePagesNone)
+            madvise(data, size, MADV_HUGEPAGE);
+    }
+
+    block.data = static_cast<uint8_t *>(data);
+    block.size = size;
+    block.mapped = true;
+
+    return block;
+}
+
+void FramebufferPool::free(const Block &block)
+{
+    if (block.mapped)
+        munmap(block.data, block.size);
+    else
+        ::free(block.data);
+}
+
+void FramebufferPool::release(uint8_t *data)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const Block block = m_used.take(data);
+    if (!block.data)
+        return;
+
+    m_free.append(block);
+
+    // Keep the most recently released buffers, those are the likeliest to fit again
+    while (m_free.count() > MAX_FREE_BUFFERS)
+        free(m_free.takeFirst());
+}
+
+void FramebufferPool::releaseImage(void *data)
+{
+    // Images outliving the pool at exit just leave their memory to the system
+    if (framebufferPool.isDestroyed())
+        return;
+
+    instance()->release(static_cast<uint8_t *>(data));
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_FRAMEBUFFER_POOL_H
+#define XDG_DESKTOP_PORTAL_TEST_FRAMEBUFFER_POOL_H
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QVector>
+
+#include <stdint.h>
+
+// Process wide pool of consumer framebuffers. Memory is 64-byte or page
+// aligned, optionally backed by huge pages, and every line starts on a cache
+// line. Released images give their memory back to the pool, so it is reused
+// across streams and format changes instead of being reallocated.
+class FramebufferPool
+{
+public:
+    enum Alignment {
+        AlignCacheLine = 0,
+        AlignPage
+    };
+
+    enum HugePages {
+        HugePagesNone = 0,
+        // madvise(MADV_HUGEPAGE), only for page aligned buffers
+        HugePagesTransparent,
+        // MAP_HUGETLB, falls back to transparent huge pages
+        HugePagesExplicit
+    };
+
+    struct Statistics {
+        quint64 allocations = 0;
+        quint64 reuses = 0;
+        int buffersInUse = 0;
+        int buffersFree = 0;
+        qint64 bytesInUse = 0;
+        qint64 bytesFree = 0;
+    };
+
+    static FramebufferPool *instance();
+
+    FramebufferPool();
+    ~FramebufferPool();
+
+    // The image stays valid after the pool handed it out, its memory goes back
+    // to the pool once the last copy of the image is destroyed
+    QImage acquireImage(const QSize &size, QImage::Format format);
+
+    Alignment alignment() const;
+    void setAlignment(Alignment alignment);
+    HugePages hugePages() const;
+    void setHugePages(HugePages hugePages);
+
+    // Frees all buffers which are currently not in use
+    void trim();
+
+    Statistics statistics() const;
+
+private:
+    struct Block {
+        uint8_t *data = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+        // NUMA node of the thread which allocated it
+        int node = -1;
+    };
+
+    Block allocate(size_t size);
+    void free(const Block &block);
+    void release(uint8_t *data);
+    static void releaseImage(void *data);
+
+    mutable QMutex m_mutex;
+    QVector<Block> m_free;
+    QHash<uint8_t *, Block> m_used;
+
+    Alignment m_alignment = AlignCacheLine;
+    HugePages m_hugePages = HugePagesNone;
+    // Only reuse buffers allocated on the node of the acquiring thread
+    bool m_numaLocal = false;
+    quint64 m_allocations = 0;
+    quint64 m_reuses = 0;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_FRAMEBUFFER_POOL_H
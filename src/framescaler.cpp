@@ -0,0 +1,294 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "framescaler.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestFrameScaler, "xdp-test-frame-scaler")
+
+// Weights are 7 bits so that (a - b) * weight still fits into 16 bits
+#define WEIGHT_BITS 7
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+FrameScaler::FrameScaler()
+{
+}
+
+bool FrameScaler::configure(const QSize &sourceSize, const QSize &targetSize)
+{
+    if (sourceSize.isEmpty() || targetSize.isEmpty()) {
+        m_method = MethodNone;
+        return false;
+    }
+
+    if (sourceSize == m_sourceSize && targetSize == m_targetSize && m_method != MethodNone)
+        return true;
+
+    m_sourceSize = sourceSize;
+    m_targetSize = targetSize;
+
+    if (sourceSize == targetSize) {
+        m_method = MethodCopy;
+    } else if (sourceSize.width() == targetSize.width() * 2 && sourceSize.height() == targetSize.height() * 2) {
+        m_method = MethodBox;
+    } else {
+        m_method = MethodBilinear;
+
+        // Sample at pixel centers, like QImage::scaled() with smooth transformation does
+        auto buildTable = [] (int sourceLength, int targetLength, QVector<int> &offsets, QVector<int16_t> &weights) {
+            offsets.resize(targetLength);
+            weights.resize(targetLength);
+
+            const double ratio = double(sourceLength) / targetLength;
+            for (int i = 0; i < targetLength; i++) {
+                double position = (i + 0.5) * ratio - 0.5;
+                if (position < 0)
+                    position = 0;
+
+                int offset = int(position);
+                int weight = qRound((position - offset) * WEIGHT_ONE);
+
+                // Never look past the last pixel, SIMD kernels always load two
+                if (offset >= sourceLength - 1) {
+                    offset = qMax(0, sourceLength - 2);
+                    weight = sourceLength > 1 ? WEIGHT_ONE : 0;
+                }
+
+                offsets[i] = offset;
+                weights[i] = int16_t(weight);
+            }
+        };
+
+        buildTable(sourceSize.width(), targetSize.width(), m_xOffsets, m_xWeights);
+        buildTable(sourceSize.height(), targetSize.height(), m_yOffsets, m_yWeights);
+    }
+
+    qCDebug(XdgDesktopPortalTestFrameScaler) << "Scaling frames from" << sourceSize << "to" << targetSize << "using method" << m_method;
+
+    return true;
+}
+
+FrameScaler::Method FrameScaler::method() const
+{
+    return m_method;
+}
+
+QSize FrameScaler::sourceSize() const
+{
+    return m_sourceSize;
+}
+
+QSize FrameScaler::targetSize() const
+{
+    return m_targetSize;
+}
+
+void FrameScaler::setVectorized(bool vectorized)
+{
+    m_vectorized = vectorized;
+}
+
+void FrameScaler::scale(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const
+{
+    switch (m_method) {
+    case MethodNone:
+        break;
+    case MethodCopy:
+        copy(src, srcStride, dst, dstStride);
+        break;
+    case MethodBox:
+        scaleBox(src, srcStride, dst, dstStride);
+        break;
+    case MethodBilinear:
+        scaleBilinear(src, srcStride, dst, dstStride);
+        break;
+    }
+}
+
+void FrameScaler::copy(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const
+{
+    const int lineBytes = m_targetSize.width() * BytesPerPixel;
+
+    if (srcStride == lineBytes && dstStride == lineBytes) {
+        memcpy(dst, src, (size_t) lineBytes * m_targetSize.height());
+        return;
+    }
+
+    for (int y = 0; y < m_targetSize.height(); y++)
+        memcpy(dst + (size_t) y * dstStride, src + (size_t) y * srcStride, lineBytes);
+}
+
+void FrameScaler::scaleBox(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const
+{
+    const int width = m_targetSize.width();
+
+    for (int y = 0; y < m_targetSize.height(); y++) {
+        const uint8_t *row0 = src + (size_t) (2 * y) * srcStride;
+        const uint8_t *row1 = row0 + srcStride;
+        uint8_t *out = dst + (size_t) y * dstStride;
+        int x = 0;
+
+#if defined(__SSE2__)
+        // Four target pixels from two lines of eight source pixels per iteration,
+        // summed up in 16 bits so that we round once, like the loop below
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16(2);
+
+        for (; m_vectorized && x + 4 <= width; x += 4) {
+            const __m128i top0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8));
+            const __m128i top1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8 + 16));
+            const __m128i bottom0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8));
+            const __m128i bottom1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8 + 16));
+
+            // Vertical sums, [p0 p1] [p2 p3] [p4 p5] [p6 p7]
+            const __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(top0, zero), _mm_unpacklo_epi8(bottom0, zero));
+            const __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(top0, zero), _mm_unpackhi_epi8(bottom0, zero));
+            const __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(top1, zero), _mm_unpacklo_epi8(bottom1, zero));
+            const __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(top1, zero), _mm_unpackhi_epi8(bottom1, zero));
+
+            // Plus the horizontal neighbour, [p0+p1 p2+p3] [p4+p5 p6+p7]
+            const __m128i first = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+            const __m128i second = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x * BytesPerPixel),
+                             _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(first, two), 2),
+                                              _mm_srli_epi16(_mm_add_epi16(second, two), 2)));
+        }
+#endif
+
+        for (; x < width; x++) {
+            const uint8_t *p0 = row0 + x * 8;
+            const uint8_t *p1 = row1 + x * 8;
+            for (int c = 0; c < BytesPerPixel; c++)
+                out[x * BytesPerPixel + c] = (p0[c] + p0[c + BytesPerPixel] + p1[c] + p1[c + BytesPerPixel] + 2) >> 2;
+        }
+    }
+}
+
+void FrameScaler::scaleBilinear(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const
+{
+    const int width = m_targetSize.width();
+    const bool singleColumn = m_sourceSize.width() == 1;
+
+    for (int y = 0; y < m_targetSize.height(); y++) {
+        const int sourceLine = m_yOffsets.at(y);
+        const int fy = m_yWeights.at(y);
+        const uint8_t *row0 = src + (size_t) sourceLine * srcStride;
+        const uint8_t *row1 = sourceLine + 1 < m_sourceSize.height() ? row0 + srcStride : row0;
+        uint8_t *out = dst + (size_t) y * dstStride;
+        int x = 0;
+
+#if defined(__SSE2__)
+        if (m_vectorized && !singleColumn) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i vfy = _mm_set1_epi16(fy);
+            const int *xOffsets = m_xOffsets.constData();
+            const int16_t *xWeights = m_xWeights.constData();
+
+            // Both neighbours of two target pixels in one register, [a0 a1 b0 b1],
+            // interpolated vertically in 16 bits per channel
+            auto interpolate = [&] (int first) {
+                const __m128i top = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row0 + xOffsets[first] * BytesPerPixel)),
+                                                       _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row0 + xOffsets[first + 1] * BytesPerPixel)));
+                const __m128i bottom = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row1 + xOffsets[first] * BytesPerPixel)),
+                                                          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row1 + xOffsets[first + 1] * BytesPerPixel)));
+
+                const __m128i topA = _mm_unpacklo_epi8(top, zero);
+                const __m128i topB = _mm_unpackhi_epi8(top, zero);
+                const __m128i verticalA = _mm_add_epi16(topA, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(bottom, zero), topA), vfy), WEIGHT_BITS));
+                const __m128i verticalB = _mm_add_epi16(topB, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(bottom, zero), topB), vfy), WEIGHT_BITS));
+
+                // Then horizontally between the left [a0 b0] and right [a1 b1] neighbours
+                const __m128i left = _mm_unpacklo_epi64(verticalA, verticalB);
+                const __m128i right = _mm_unpackhi_epi64(verticalA, verticalB);
+                const __m128i vfx = _mm_unpacklo_epi64(_mm_set1_epi16(xWeights[first]), _mm_set1_epi16(xWeights[first + 1]));
+
+                return _mm_add_epi16(left, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(right, left), vfx), WEIGHT_BITS));
+            };
+
+            for (; x + 4 <= width; x += 4)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x * BytesPerPixel), _mm_packus_epi16(interpolate(x), interpolate(x + 2)));
+        }
+#endif
+
+        // Same order as the kernel, vertically first, so both give the same frames
+        for (; x < width; x++) {
+            const int offset = m_xOffsets.at(x) * BytesPerPixel;
+            const int next = singleColumn ? 0 : BytesPerPixel;
+            const int fx = m_xWeights.at(x);
+
+            for (int c = 0; c < BytesPerPixel; c++) {
+                const int left = row0[offset + c] + (((row1[offset + c] - row0[offset + c]) * fy) >> WEIGHT_BITS);
+                const int right = row0[offset + next + c] + (((row1[offset + next + c] - row0[offset + next + c]) * fy) >> WEIGHT_BITS);
+                out[x * BytesPerPixel + c] = uint8_t(left + (((right - left) * fx) >> WEIGHT_BITS));
+            }
+        }
+    }
+}
+
+void FrameScaler::swapRedBlue(uint8_t *data, int stride, const QSize &size)
+{
+    for (int y = 0; y < size.height(); y++) {
+        uint8_t *line = data + (size_t) y * stride;
+        int x = 0;
+
+#if defined(__SSE2__)
+        const __m128i greenAlpha = _mm_set1_epi32(0xff00ff00);
+        const __m128i lowByte = _mm_set1_epi32(0x000000ff);
+
+        for (; x + 4 <= size.width(); x += 4) {
+            __m128i *pixels = reinterpret_cast<__m128i *>(line + x * BytesPerPixel);
+            const __m128i value = _mm_loadu_si128(pixels);
+            const __m128i first = _mm_slli_epi32(_mm_and_si128(value, lowByte), 16);
+            const __m128i third = _mm_and_si128(_mm_srli_epi32(value, 16), lowByte);
+            _mm_storeu_si128(pixels, _mm_or_si128(_mm_and_si128(value, greenAlpha), _mm_or_si128(first, third)));
+        }
+#endif
+
+        for (; x < size.width(); x++) {
+            uint8_t *pixel = line + x * BytesPerPixel;
+            const uint8_t first = pixel[0];
+            pixel[0] = pixel[2];
+            pixel[2] = first;
+        }
+    }
+}
+
+void FrameScaler::copyRect(const uint8_t *src, int srcStride, const QRect &rect, uint8_t *dst, int dstStride)
+{
+    const uint8_t *first = src + (size_t) rect.y() * srcStride + rect.x() * BytesPerPixel;
+    const size_t lineBytes = (size_t) rect.width() * BytesPerPixel;
+
+    // Whole lines of matching layout go in one piece
+    if (rect.x() == 0 && srcStride == dstStride && lineBytes == (size_t) srcStride) {
+        memcpy(dst, first, lineBytes * rect.height());
+        return;
+    }
+
+    for (int y = 0; y < rect.height(); y++)
+        memcpy(dst + (size_t) y * dstStride, first + (size_t) y * srcStride, lineBytes);
+}
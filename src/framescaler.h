@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_FRAME_SCALER_H
+#define XDG_DESKTOP_PORTAL_TEST_FRAME_SCALER_H
+
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+#include <stdint.h>
+
+// Scales 32 bits per pixel frames to the size negotiated with the consumer.
+// Exact halving uses a box filter, everything else is bilinear, both with SSE2
+// kernels handling four target pixels at a time. Lookup tables are only rebuilt
+// in configure(), so scaling itself doesn't allocate.
+class FrameScaler
+{
+public:
+    // RGBx and BGRx, the only formats streams offer. Everything walking
+    // frames pixel by pixel uses this rather than a constant of its own.
+    enum { BytesPerPixel = 4 };
+
+    enum Method {
+        MethodNone = 0,
+        MethodCopy,
+        MethodBox,
+        MethodBilinear
+    };
+
+    FrameScaler();
+
+    // Returns false if the sizes are invalid
+    bool configure(const QSize &sourceSize, const QSize &targetSize);
+
+    Method method() const;
+    QSize sourceSize() const;
+    QSize targetSize() const;
+
+    // Scalar loops only when false, to compare the kernels against them
+    void setVectorized(bool vectorized);
+
+    void scale(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const;
+
+    // Converts between RGBx and BGRx in place
+    static void swapRedBlue(uint8_t *data, int stride, const QSize &size);
+    // Copies the @rect part of @src to the top left corner of @dst
+    static void copyRect(const uint8_t *src, int srcStride, const QRect &rect, uint8_t *dst, int dstStride);
+
+private:
+    void copy(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const;
+    void scaleBox(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const;
+    void scaleBilinear(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride) const;
+
+    Method m_method = MethodNone;
+    bool m_vectorized = true;
+    QSize m_sourceSize;
+    QSize m_targetSize;
+
+    // Source column/line and 7-bit weight of the next one for each target pixel
+    QVector<int> m_xOffsets;
+    QVector<int16_t> m_xWeights;
+    QVector<int> m_yOffsets;
+    QVector<int16_t> m_yWeights;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_FRAME_SCALER_H
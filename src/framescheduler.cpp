@@ -0,0 +1,249 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "framescheduler.h"
+#include "binarylog.h"
+#include "tracer.h"
+
+#include <QElapsedTimer>
+#include <QMap>
+#include <QMutex>
+#include <QThreadStorage>
+#include <QTimer>
+
+#include <algorithm>
+
+static QThreadStorage<FrameScheduler *> schedulers;
+static QAtomicInt nextJob;
+
+// Shared by all threads, so that phases line up between them
+static qint64 now()
+{
+    static const QElapsedTimer clock = [] () {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+
+    return clock.nsecsElapsed();
+}
+
+// Phases of all started jobs in the process
+static QMutex phaseMutex;
+static QMap<int, double> phases;
+
+// Middle of the largest gap between the phases already taken
+static double allocatePhase(int job)
+{
+    QMutexLocker locker(&phaseMutex);
+
+    double phase = 0;
+    if (!phases.isEmpty()) {
+        QList<double> taken = phases.values();
+        std::sort(taken.begin(), taken.end());
+
+        // The gap wrapping around from the last phase to the first one
+        double largestGap = taken.first() + 1.0 - taken.last();
+        phase = taken.last() + largestGap / 2;
+        for (int i = 1; i < taken.count(); i++) {
+            const double gap = taken.at(i) - taken.at(i - 1);
+            if (gap > largestGap) {
+                largestGap = gap;
+                phase = taken.at(i - 1) + gap / 2;
+            }
+        }
+        if (phase >= 1.0)
+            phase -= 1.0;
+    }
+
+    phases.insert(job, phase);
+    return phase;
+}
+
+static void releasePhase(int job)
+{
+    QMutexLocker locker(&phaseMutex);
+    phases.remove(job);
+}
+
+// First release at or after @time on the grid of @interval shifted by @phase
+static qint64 alignRelease(qint64 time, qint64 interval, double phase)
+{
+    const qint64 offset = qint64(phase * interval);
+    const qint64 periods = (time - offset + interval - 1) / interval;
+    return qMax(offset, offset + periods * interval);
+}
+
+FrameScheduler *FrameScheduler::instance()
+{
+    if (!schedulers.hasLocalData())
+        schedulers.setLocalData(new FrameScheduler());
+
+    return schedulers.localData();
+}
+
+FrameScheduler::FrameScheduler()
+{
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer, &QTimer::timeout, this, &FrameScheduler::runNext);
+}
+
+FrameScheduler::~FrameScheduler()
+{
+    for (auto it = m_jobs.constBegin(); it != m_jobs.constEnd(); ++it) {
+        if (it->active)
+            releasePhase(it.key());
+    }
+}
+
+int FrameScheduler::addJob(const std::function<void()> &produce)
+{
+    const int job = nextJob.fetchAndAddRelaxed(1);
+
+    Job &added = m_jobs[job];
+    added.produce = produce;
+
+    return job;
+}
+
+void FrameScheduler::removeJob(int job)
+{
+    stop(job);
+    m_jobs.remove(job);
+}
+
+void FrameScheduler::setInterval(int job, qint64 interval)
+{
+    auto it = m_jobs.find(job);
+    if (it == m_jobs.end() || interval <= 0)
+        return;
+
+    if (it->interval == interval)
+        return;
+
+    it->interval = interval;
+    if (it->active) {
+        it->release = alignRelease(now(), interval, it->phase);
+        schedule();
+    }
+}
+
+void FrameScheduler::start(int job)
+{
+    auto it = m_jobs.find(job);
+    if (it == m_jobs.end() || it->active)
+        return;
+
+    it->active = true;
+    it->phase = allocatePhase(job);
+    it->release = alignRelease(now(), it->interval, it->phase);
+
+    schedule();
+}
+
+void FrameScheduler::stop(int job)
+{
+    auto it = m_jobs.find(job);
+    if (it == m_jobs.end() || !it->active)
+        return;
+
+    it->active = false;
+    releasePhase(job);
+
+    schedule();
+}
+
+FrameScheduler::Statistics FrameScheduler::statistics(int job) const
+{
+    return m_jobs.value(job).statistics;
+}
+
+void FrameScheduler::runNext()
+{
+    // Of the released frames the one due first, with implicit deadlines at
+    // the end of the interval
+    const qint64 time = now();
+    int next = -1;
+    qint64 nextDeadline = 0;
+    for (auto it = m_jobs.constBegin(); it != m_jobs.constEnd(); ++it) {
+        if (!it->active || it->release > time)
+            continue;
+
+        const qint64 deadline = it->release + it->interval;
+        if (next < 0 || deadline < nextDeadline) {
+            next = it.key();
+            nextDeadline = deadline;
+        }
+    }
+
+    if (next >= 0) {
+        TraceScope trace("scheduleFrame");
+        trace.setArgument(next);
+
+        // Copied, the job may remove itself while producing
+        const std::function<void()> produce = m_jobs.value(next).produce;
+        produce();
+
+        const qint64 done = now();
+        auto it = m_jobs.find(next);
+        if (it != m_jobs.end() && it->active) {
+            Statistics &statistics = it->statistics;
+            statistics.frames++;
+            if (done > nextDeadline) {
+                statistics.missedDeadlines++;
+                statistics.maximumLateness = qMax(statistics.maximumLateness, (done - nextDeadline) / 1000);
+            }
+
+            // Frames whose deadline passed while this one was produced are
+            // dropped rather than produced late. We are behind already, so
+            // they are only counted, GetStatistics reports them.
+            qint64 release = it->release + it->interval;
+            if (release + it->interval <= done) {
+                const qint64 skipped = (done - release) / it->interval;
+                release += skipped * it->interval;
+                statistics.skippedFrames += skipped;
+                BinaryLog::log(BinaryLog::FramesSkipped, next, skipped);
+            }
+            it->release = release;
+        }
+    }
+
+    // One frame per timeout, so that other events of the thread get a turn
+    schedule();
+}
+
+void FrameScheduler::schedule()
+{
+    qint64 earliest = -1;
+    for (const Job &job : qAsConst(m_jobs)) {
+        if (job.active && (earliest < 0 || job.release < earliest))
+            earliest = job.release;
+    }
+
+    if (earliest < 0) {
+        m_timer->stop();
+        return;
+    }
+
+    const qint64 wait = earliest - now();
+    m_timer->start(wait > 0 ? int((wait + 999999) / 1000000) : 0);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_FRAME_SCHEDULER_H
+#define XDG_DESKTOP_PORTAL_TEST_FRAME_SCHEDULER_H
+
+#include <QHash>
+#include <QObject>
+
+#include <functional>
+
+class QTimer;
+
+// Produces the frames of all streams living in a thread, earliest deadline
+// first, from a single timer instead of one timer per stream. Every frame
+// is released at the start of its interval and due at its end. Release
+// times of all jobs in the process, on any thread, are spread over the
+// frame interval so that streams of the same rate don't fire together.
+class FrameScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    struct Statistics {
+        qint64 frames = 0;
+        // Frames which were done after their deadline
+        qint64 missedDeadlines = 0;
+        // Releases dropped because the previous frame overran them
+        qint64 skippedFrames = 0;
+        // Microseconds
+        qint64 maximumLateness = 0;
+    };
+
+    // Scheduler of the calling thread, created on first use and destroyed
+    // with the thread
+    static FrameScheduler *instance();
+
+    ~FrameScheduler();
+
+    // Jobs are stopped until start() is called, @produce renders one frame
+    int addJob(const std::function<void()> &produce);
+    void removeJob(int job);
+    // Nanoseconds between two frames, one second by default
+    void setInterval(int job, qint64 interval);
+    void start(int job);
+    void stop(int job);
+    Statistics statistics(int job) const;
+
+private Q_SLOTS:
+    void runNext();
+
+private:
+    struct Job {
+        std::function<void()> produce;
+        qint64 interval = 1000000000;
+        qint64 release = 0;
+        // Position in the interval the job is released at, 0 - 1
+        double phase = 0;
+        bool active = false;
+        Statistics statistics;
+    };
+
+    FrameScheduler();
+    void schedule();
+
+    QHash<int, Job> m_jobs;
+    QTimer *m_timer = nullptr;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_FRAME_SCHEDULER_H
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_FRAME_SOURCE_H
+#define XDG_DESKTOP_PORTAL_TEST_FRAME_SOURCE_H
+
+#include <QSize>
+
+#include <stdint.h>
+
+// Content producer for an output ScreenCastStream. Frames are rendered straight
+// into the memory of a dequeued PipeWire buffer, so implementations must not
+// allocate per frame.
+class FrameSource
+{
+public:
+    virtual ~FrameSource() = default;
+
+    // Size of the frames this source produces
+    virtual QSize size() const = 0;
+
+    // Renders the next frame as RGBx into @dst, which holds size().height() lines
+    // of @stride bytes. Returns false when there is no frame to publish.
+    virtual bool renderFrame(uint8_t *dst, int stride) = 0;
+
+    // Whether the source ran out of frames for good
+    virtual bool atEnd() const { return false; }
+
+    // Frames per second the content was recorded at, 0 for content that
+    // can be produced at any rate
+    virtual uint frameRate() const { return 0; }
+
+    // Sources writing BGRx themselves return true, the stream swaps the
+    // channels of RGBx frames otherwise
+    virtual bool setSwapRedBlue(bool swap) { return !swap; }
+
+    // Buffers rendered into before may have lost their contents, sources
+    // only redrawing what changed have to redraw everything
+    virtual void invalidate() {}
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_FRAME_SOURCE_H
@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "latencyhistogram.h"
+
+#include <math.h>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+
+    m_buckets[bucketForValue(value)].fetchAndAddRelaxed(1);
+
+    qint64 maximum = m_maximum.loadAcquire();
+    while (value > maximum && !m_maximum.testAndSetOrdered(maximum, value, maximum)) { }
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < Buckets; i++)
+        m_buckets[i].store(0);
+
+    m_maximum.storeRelease(0);
+}
+
+qint64 LatencyHistogram::count() const
+{
+    qint64 count = 0;
+    for (int i = 0; i < Buckets; i++)
+        count += m_buckets[i].load();
+
+    return count;
+}
+
+qint64 LatencyHistogram::maximum() const
+{
+    return m_maximum.loadAcquire();
+}
+
+qint64 LatencyHistogram::percentile(double percentile) const
+{
+    const qint64 total = count();
+    if (!total)
+        return 0;
+
+    const qint64 target = qMax<qint64>(1, ceil(total * qBound(0.0, percentile, 100.0) / 100.0));
+
+    qint64 seen = 0;
+    for (int i = 0; i < Buckets; i++) {
+        seen += m_buckets[i].load();
+        if (seen >= target)
+            return qMin(bucketUpperBound(i), maximum());
+    }
+
+    return maximum();
+}
+
+int LatencyHistogram::bucketForValue(quint64 value)
+{
+    if (value < LinearBuckets)
+        return int(value);
+
+    // Position of the highest bit picks the power of two, the three bits below it the sub bucket
+    const int msb = 63 - __builtin_clzll(value);
+    const int sub = int(value >> (msb - 3)) & (SubBuckets - 1);
+
+    return qMin(int(LinearBuckets + (msb - 4) * SubBuckets + sub), int(Buckets - 1));
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < LinearBuckets)
+        return bucket;
+
+    const int msb = (bucket - LinearBuckets) / SubBuckets + 4;
+    const int sub = (bucket - LinearBuckets) % SubBuckets;
+    const qint64 lowerBound = qint64(SubBuckets + sub) << (msb - 3);
+
+    return lowerBound + (qint64(1) << (msb - 3)) - 1;
+}
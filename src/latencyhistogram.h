@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_LATENCY_HISTOGRAM_H
+#define XDG_DESKTOP_PORTAL_TEST_LATENCY_HISTOGRAM_H
+
+#include <QAtomicInteger>
+
+// Fixed size log-linear histogram, eight buckets per power of two, so that
+// percentiles are within 12.5% of the real value. Recording never allocates
+// and may happen in a different thread than reading.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(qint64 value);
+    void reset();
+
+    qint64 count() const;
+    qint64 maximum() const;
+    // Upper bound of the bucket holding the given percentile (0 - 100)
+    qint64 percentile(double percentile) const;
+
+private:
+    static int bucketForValue(quint64 value);
+    static qint64 bucketUpperBound(int bucket);
+
+    enum {
+        LinearBuckets = 16,
+        SubBuckets = 8,
+        // Enough for values up to 2^40
+        Buckets = LinearBuckets + (40 - 4) * SubBuckets
+    };
+
+    QAtomicInteger<quint32> m_buckets[Buckets];
+    QAtomicInteger<qint64> m_maximum;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_LATENCY_HISTOGRAM_H
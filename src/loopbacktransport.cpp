@@ -0,0 +1,280 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "loopbacktransport.h"
+#include "pipewirecore.h"
+#include "screencaststream.h"
+
+#include <QLoggingCategory>
+#include <QMutexLocker>
+
+#include <spa/param/video/format-utils.h>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestLoopbackTransport, "xdp-test-loopback-transport")
+
+LoopbackTransport::LoopbackTransport()
+    : m_core(new PipeWireCore())
+{
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+    if (m_output || m_input)
+        qCWarning(XdgDesktopPortalTestLoopbackTransport) << "Destroying loopback transport with streams still connected";
+
+    freeBuffers();
+    delete m_core;
+}
+
+PipeWireCore *LoopbackTransport::core() const
+{
+    return m_core;
+}
+
+int LoopbackTransport::bufferCount() const
+{
+    return m_buffers.count();
+}
+
+int LoopbackTransport::allocations() const
+{
+    return m_allocations;
+}
+
+bool LoopbackTransport::connectStream(ScreenCastStream *stream, const spa_pod *format)
+{
+    // The offered format is read from the stream itself once we fixate it
+    Q_UNUSED(format)
+
+    ScreenCastStream *&slot = stream->streamDirection == ScreenCastStream::DirectionOutput ? m_output : m_input;
+    if (slot) {
+        qCWarning(XdgDesktopPortalTestLoopbackTransport) << "Loopback transport already has a stream of this direction";
+        return false;
+    }
+
+    slot = stream;
+    negotiate();
+
+    return true;
+}
+
+void LoopbackTransport::disconnectStream(ScreenCastStream *stream)
+{
+    // Both sides lose their buffers, like when a PipeWire link goes away
+    freeBuffers();
+
+    if (stream == m_output)
+        m_output = nullptr;
+    if (stream == m_input)
+        m_input = nullptr;
+
+    stream->loopback = nullptr;
+}
+
+int LoopbackTransport::updateFormat(ScreenCastStream *stream, const spa_pod *format)
+{
+    Q_UNUSED(format)
+
+    // Consumers take whatever the producer offers
+    if (stream == m_output)
+        negotiate();
+
+    return 0;
+}
+
+void LoopbackTransport::negotiate()
+{
+    if (!m_output || !m_input)
+        return;
+
+    // Pick the largest size and framerate of what the producer offers, as
+    // PipeWire does for a consumer accepting anything
+    const QSize size = m_output->requestedSize.isValid() ? m_output->requestedSize : m_output->resolution;
+    spa_rectangle resolution = SPA_RECTANGLE((uint32_t)size.width(), (uint32_t)size.height());
+    spa_fraction framerate = SPA_FRACTION(0, 1);
+    spa_fraction maxFramerate = SPA_FRACTION(m_output->requestedFramerate ? m_output->requestedFramerate : 25, 1);
+
+    uint8_t buffer[1024];
+    spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+#if PW_CHECK_VERSION(0, 2, 9)
+    const spa_pod *format = (spa_pod*)spa_pod_builder_add_object(&podBuilder,
+                                        SPA_TYPE_OBJECT_Format, SPA_PARAM_Format,
+                                        ":", SPA_FORMAT_mediaType, "I", SPA_MEDIA_TYPE_video,
+                                        ":", SPA_FORMAT_mediaSubtype, "I", SPA_MEDIA_SUBTYPE_raw,
+                                        ":", SPA_FORMAT_VIDEO_format, "I", m_output->pixelFormat == ScreenCastStream::FormatBGRx ? SPA_VIDEO_FORMAT_BGRx : SPA_VIDEO_FORMAT_RGBx,
+                                        ":", SPA_FORMAT_VIDEO_size, "R", &resolution,
+                                        ":", SPA_FORMAT_VIDEO_framerate, "F", &framerate,
+                                        ":", SPA_FORMAT_VIDEO_maxFramerate, "F", &maxFramerate);
+#else
+    const spa_pod *format = (spa_pod*)spa_pod_builder_object(&podBuilder,
+                                        m_core->pwCoreType->param.idFormat, m_core->pwCoreType->spa_format,
+                                        "I", m_core->pwType->media_type.video,
+                                        "I", m_core->pwType->media_subtype.raw,
+                                        ":", m_core->pwType->format_video.format, "I", m_output->pixelFormat == ScreenCastStream::FormatBGRx ? m_core->pwType->video_format.BGRx : m_core->pwType->video_format.RGBx,
+                                        ":", m_core->pwType->format_video.size, "R", &resolution,
+                                        ":", m_core->pwType->format_video.framerate, "F", &framerate,
+                                        ":", m_core->pwType->format_video.max_framerate, "F", &maxFramerate);
+#endif
+
+    // The producer's answer decides about the buffers, both sides get them then
+    m_output->formatChanged(format);
+    m_input->formatChanged(format);
+}
+
+void LoopbackTransport::finishFormat(ScreenCastStream *stream, const spa_pod **params, uint32_t count)
+{
+    if (stream != m_output)
+        return;
+
+    // Like PipeWire, keep the buffers unless the producer asks for new ones
+    bool buffersParam = false;
+    for (uint32_t i = 0; i < count; i++)
+        buffersParam |= isBuffersParam(params[i]);
+
+    if (!buffersParam && !m_buffers.isEmpty())
+        return;
+
+    // What the Buffers param says, PipeWire takes the preferred count of the range
+    QMutexLocker locker(&m_output->bufferMutex);
+    const ScreenCastStream::BufferSettings &settings = m_output->buffers;
+    const int buffers = settings.adaptive ? m_output->adaptiveBufferCount : settings.buffers;
+    const int size = m_output->bufferSize;
+    const int stride = m_output->bufferStride;
+    locker.unlock();
+
+    freeBuffers();
+    allocateBuffers(buffers, size, stride);
+}
+
+bool LoopbackTransport::isBuffersParam(const spa_pod *param) const
+{
+    if (!param)
+        return false;
+
+#if PW_CHECK_VERSION(0, 2, 9)
+    return SPA_POD_TYPE(param) == SPA_TYPE_Object &&
+           reinterpret_cast<const spa_pod_object *>(param)->body.type == SPA_TYPE_OBJECT_ParamBuffers;
+#else
+    return SPA_POD_TYPE(param) == SPA_POD_TYPE_OBJECT &&
+           reinterpret_cast<const spa_pod_object *>(param)->body.type == m_core->pwCoreType->param_buffers.Buffers;
+#endif
+}
+
+void LoopbackTransport::allocateBuffers(int count, int size, int stride)
+{
+    m_bufferSize = size;
+    m_bufferStride = stride;
+    m_allocations++;
+
+    for (int i = 0; i < count; i++) {
+        Buffer *buffer = new Buffer();
+        buffer->memory.resize(size);
+
+        buffer->chunk.offset = 0;
+        buffer->chunk.size = 0;
+        buffer->chunk.stride = stride;
+
+#if PW_CHECK_VERSION(0, 2, 9)
+        buffer->data.type = SPA_DATA_MemPtr;
+        buffer->metas[0].type = SPA_META_Header;
+        buffer->metas[1].type = SPA_META_VideoCrop;
+#else
+        buffer->data.type = m_core->pwCoreType->data.MemPtr;
+        buffer->metas[0].type = m_core->pwCoreType->meta.Header;
+        buffer->metas[1].type = m_core->pwCoreType->meta.VideoCrop;
+        buffer->buffer.id = i;
+#endif
+        buffer->data.flags = 0;
+        buffer->data.fd = -1;
+        buffer->data.mapoffset = 0;
+        buffer->data.maxsize = size;
+        buffer->data.data = buffer->memory.data();
+        buffer->data.chunk = &buffer->chunk;
+
+        buffer->metas[0].data = &buffer->header;
+        buffer->metas[0].size = sizeof(buffer->header);
+        buffer->metas[1].data = &buffer->crop;
+        buffer->metas[1].size = sizeof(buffer->crop);
+
+        buffer->buffer.n_metas = 2;
+        buffer->buffer.metas = buffer->metas;
+        buffer->buffer.n_datas = 1;
+        buffer->buffer.datas = &buffer->data;
+
+        buffer->output.buffer = &buffer->buffer;
+        buffer->output.user_data = nullptr;
+        buffer->input.buffer = &buffer->buffer;
+        buffer->input.user_data = nullptr;
+
+        m_output->addBuffer(&buffer->output);
+        m_input->addBuffer(&buffer->input);
+
+        m_buffers << buffer;
+        m_free.enqueue(buffer);
+    }
+}
+
+void LoopbackTransport::freeBuffers()
+{
+    for (Buffer *buffer : qAsConst(m_buffers)) {
+        if (m_output)
+            m_output->removeBuffer(&buffer->output);
+        if (m_input)
+            m_input->removeBuffer(&buffer->input);
+        delete buffer;
+    }
+
+    m_buffers.clear();
+    m_free.clear();
+    m_bufferSize = 0;
+    m_bufferStride = 0;
+}
+
+pw_buffer *LoopbackTransport::dequeueBuffer(ScreenCastStream *stream)
+{
+    if (stream != m_output || m_free.isEmpty())
+        return nullptr;
+
+    return &m_free.dequeue()->output;
+}
+
+void LoopbackTransport::queueBuffer(ScreenCastStream *stream, pw_buffer *buffer)
+{
+    if (stream != m_output)
+        return;
+
+    Buffer *loopbackBuffer = nullptr;
+    for (Buffer *candidate : qAsConst(m_buffers)) {
+        if (&candidate->output == buffer) {
+            loopbackBuffer = candidate;
+            break;
+        }
+    }
+
+    if (!loopbackBuffer)
+        return;
+
+    // What onStreamProcess() does for consumers, without a loop in between
+    if (m_input && loopbackBuffer->chunk.size)
+        m_input->readFrame(&loopbackBuffer->input);
+
+    m_free.enqueue(loopbackBuffer);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_LOOPBACK_TRANSPORT_H
+#define XDG_DESKTOP_PORTAL_TEST_LOOPBACK_TRANSPORT_H
+
+#include <QByteArray>
+#include <QQueue>
+#include <QVector>
+
+#include <pipewire/pipewire.h>
+#include <pipewire/stream.h>
+
+#include <spa/buffer/meta.h>
+
+class PipeWireCore;
+class ScreenCastStream;
+
+// Connects an output and an input ScreenCastStream within the process,
+// without a PipeWire daemon or D-Bus. The transport does what PipeWire
+// would: it fixates the format the producer offers, runs the format
+// negotiation of both streams, allocates buffers with header and crop
+// metadata whenever the producer sends a Buffers param, and hands every
+// queued buffer straight to the consumer's readFrame(). Everything happens
+// in the thread calling the streams.
+class LoopbackTransport
+{
+public:
+    LoopbackTransport();
+    ~LoopbackTransport();
+
+    // Never connected, streams only use it for the type map of old PipeWire
+    PipeWireCore *core() const;
+    int bufferCount() const;
+    // Number of times buffers were allocated
+    int allocations() const;
+
+    // Called by the streams
+    bool connectStream(ScreenCastStream *stream, const spa_pod *format);
+    void disconnectStream(ScreenCastStream *stream);
+    int updateFormat(ScreenCastStream *stream, const spa_pod *format);
+    void finishFormat(ScreenCastStream *stream, const spa_pod **params, uint32_t count);
+    pw_buffer *dequeueBuffer(ScreenCastStream *stream);
+    void queueBuffer(ScreenCastStream *stream, pw_buffer *buffer);
+
+private:
+    struct Buffer {
+        // Each side has a pw_buffer of its own sharing the same memory
+        pw_buffer output;
+        pw_buffer input;
+        spa_buffer buffer;
+        spa_meta metas[2];
+        spa_data data;
+        spa_chunk chunk;
+        spa_meta_header header;
+        spa_meta_video_crop crop;
+        QByteArray memory;
+    };
+
+    void negotiate();
+    bool isBuffersParam(const spa_pod *param) const;
+    void allocateBuffers(int count, int size, int stride);
+    void freeBuffers();
+
+    PipeWireCore *m_core;
+    ScreenCastStream *m_output = nullptr;
+    ScreenCastStream *m_input = nullptr;
+
+    QVector<Buffer *> m_buffers;
+    QQueue<Buffer *> m_free;
+    int m_bufferSize = 0;
+    int m_bufferStride = 0;
+    int m_allocations = 0;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_LOOPBACK_TRANSPORT_H
@@ -0,0 +1,271 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "pipewirecore.h"
+#include "binarylog.h"
+#include "screencaststream.h"
+#include "threadtuning.h"
+
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestPipeWireCore, "xdp-test-pipewire-core")
+
+static void onStateChanged(void *data, pw_remote_state old, pw_remote_state state, const char *error)
+{
+    Q_UNUSED(old);
+
+    PipeWireCore *core = static_cast<PipeWireCore*>(data);
+
+    switch (state) {
+    case PW_REMOTE_STATE_ERROR:
+        // TODO notify error
+        qCWarning(XdgDesktopPortalTestPipeWireCore) << "Remote error: " << error;
+        break;
+    case PW_REMOTE_STATE_CONNECTED:
+        BinaryLog::log(BinaryLog::RemoteState, pw_remote_state_as_string(state));
+        core->remoteConnected();
+        break;
+    default:
+        BinaryLog::log(BinaryLog::RemoteState, pw_remote_state_as_string(state));
+        break;
+    }
+}
+
+// Runs in the loop thread, pw_thread_loop doesn't give us a handle to tune it from outside
+static int onTuneLoopThread(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *userData)
+{
+    Q_UNUSED(loop);
+    Q_UNUSED(async);
+    Q_UNUSED(seq);
+    Q_UNUSED(size);
+    Q_UNUSED(userData);
+
+    ThreadTuning::apply(ThreadTuning::PipeWireLoop, *static_cast<const int *>(data));
+    return 0;
+}
+
+// Runs in the loop thread with the loop locked
+static int onCreateStreams(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *userData)
+{
+    Q_UNUSED(loop);
+    Q_UNUSED(async);
+    Q_UNUSED(seq);
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+
+    PipeWireCore *core = static_cast<PipeWireCore*>(userData);
+
+    // Until then remoteConnected() takes care of them
+    if (core->isConnected())
+        core->createStreams();
+
+    return 0;
+}
+
+static const struct pw_remote_events pwRemoteEvents = {
+    .version = PW_VERSION_REMOTE_EVENTS,
+    .destroy = nullptr,
+    .info_changed = nullptr,
+    .sync_reply = nullptr,
+    .state_changed = onStateChanged,
+};
+
+PipeWireCore::PipeWireCore(QObject *parent)
+    : PipeWireCore(QDBusUnixFileDescriptor(), parent)
+{
+}
+
+PipeWireCore::PipeWireCore(const QDBusUnixFileDescriptor &fd, QObject *parent)
+    : QObject(parent)
+    , pipewireFd(fd)
+{
+    pw_init(nullptr, nullptr);
+
+    pwLoop = pw_loop_new(nullptr);
+    pwMainLoop = pw_thread_loop_new(pwLoop, "pipewire-main-loop");
+
+    pwCore = pw_core_new(pwLoop, nullptr);
+#if !PW_CHECK_VERSION(0, 2, 9)
+    pwCoreType = pw_core_get_type(pwCore);
+#endif
+    pwRemote = pw_remote_new(pwCore, nullptr, 0);
+
+#if !PW_CHECK_VERSION(0, 2, 9)
+    initializePwTypes();
+#endif
+
+    pw_remote_add_listener(pwRemote, &remoteListener, &pwRemoteEvents, this);
+}
+
+PipeWireCore::~PipeWireCore()
+{
+    // Streams are destroyed together with the remote, their owners have to go first
+    if (!streams.isEmpty())
+        qCWarning(XdgDesktopPortalTestPipeWireCore) << "Destroying PipeWire core with" << streams.count() << "streams still attached";
+
+    if (pwMainLoop)
+        pw_thread_loop_stop(pwMainLoop);
+
+#if !PW_CHECK_VERSION(0, 2, 9)
+    if (pwType)
+        delete pwType;
+#endif
+
+    if (pwRemote)
+        pw_remote_destroy(pwRemote);
+
+    if (pwCore)
+        pw_core_destroy(pwCore);
+
+    if (pwMainLoop)
+        pw_thread_loop_destroy(pwMainLoop);
+
+    if (pwLoop)
+        pw_loop_destroy(pwLoop);
+}
+
+bool PipeWireCore::init()
+{
+    if (started)
+        return true;
+
+    if (pipewireFd.isValid())
+        pw_remote_connect_fd(pwRemote, pipewireFd.fileDescriptor());
+    else
+        pw_remote_connect(pwRemote);
+
+    if (pw_thread_loop_start(pwMainLoop) < 0) {
+        qCWarning(XdgDesktopPortalTestPipeWireCore) << "Failed to start main PipeWire loop";
+        return false;
+    }
+
+    // Every loop thread of the process gets the next of the configured CPUs
+    static QAtomicInt loopThreads;
+    if (!ThreadTuning::Settings::fromEnvironment(ThreadTuning::PipeWireLoop).isDefault()) {
+        const int index = loopThreads.fetchAndAddRelaxed(1);
+        pw_loop_invoke(pwLoop, onTuneLoopThread, 0, &index, sizeof(index), false, nullptr);
+    }
+
+    started = true;
+    return true;
+}
+
+bool PipeWireCore::isConnected() const
+{
+    return pw_remote_get_state(pwRemote, nullptr) == PW_REMOTE_STATE_CONNECTED;
+}
+
+void PipeWireCore::attach(ScreenCastStream *stream)
+{
+    lock();
+
+    if (!streams.contains(stream)) {
+        streams << stream;
+        pendingStreams << stream;
+
+        // pw_stream callbacks all run in the loop thread, so it creates the
+        // stream as well instead of whichever thread attached it
+        if (started)
+            pw_loop_invoke(pwLoop, onCreateStreams, 0, nullptr, 0, false, this);
+    }
+
+    unlock();
+}
+
+void PipeWireCore::detach(ScreenCastStream *stream)
+{
+    lock();
+    streams.removeAll(stream);
+    pendingStreams.removeAll(stream);
+    unlock();
+}
+
+int PipeWireCore::streamCount() const
+{
+    lock();
+    const int count = streams.count();
+    unlock();
+
+    return count;
+}
+
+bool PipeWireCore::waitForStreams(int seconds)
+{
+    if (!started)
+        return pendingStreams.isEmpty();
+
+    lock();
+    while (!pendingStreams.isEmpty()) {
+        // Signalled by createStreams()
+        if (pw_thread_loop_timed_wait(pwMainLoop, seconds) != 0)
+            break;
+    }
+    const bool created = pendingStreams.isEmpty();
+    unlock();
+
+    return created;
+}
+
+void PipeWireCore::lock() const
+{
+    // Before the loop thread runs there is nobody to race with
+    if (started)
+        pw_thread_loop_lock(pwMainLoop);
+}
+
+void PipeWireCore::unlock() const
+{
+    if (started)
+        pw_thread_loop_unlock(pwMainLoop);
+}
+
+void PipeWireCore::remoteConnected()
+{
+    createStreams();
+}
+
+void PipeWireCore::createStreams()
+{
+    // Called from the loop thread, which holds the loop lock already
+    for (ScreenCastStream *stream : qAsConst(pendingStreams)) {
+        if (!stream->createStream()) {
+            if (stream->streamDirection == ScreenCastStream::DirectionOutput)
+                Q_EMIT stream->stopStreaming();
+        }
+    }
+
+    pendingStreams.clear();
+    pw_thread_loop_signal(pwMainLoop, false);
+}
+
+#if !PW_CHECK_VERSION(0, 2, 9)
+void PipeWireCore::initializePwTypes()
+{
+    // raw C-like ScreenCastStream type map
+    auto map = pwCoreType->map;
+
+    pwType = new PwType();
+
+    spa_type_media_type_map(map, &pwType->media_type);
+    spa_type_media_subtype_map(map, &pwType->media_subtype);
+    spa_type_format_video_map (map, &pwType->format_video);
+    spa_type_video_format_map (map, &pwType->video_format);
+}
+#endif
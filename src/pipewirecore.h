@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_PIPEWIRE_CORE_H
+#define XDG_DESKTOP_PORTAL_TEST_PIPEWIRE_CORE_H
+
+#include <QDBusUnixFileDescriptor>
+#include <QObject>
+#include <QVector>
+
+#include <pipewire/version.h>
+
+#if !PW_CHECK_VERSION(0, 2, 9)
+#include <spa/support/type-map.h>
+#include <spa/param/format-utils.h>
+#include <spa/param/video/raw-utils.h>
+#endif
+
+#include <pipewire/pipewire.h>
+#include <pipewire/remote.h>
+
+#if !PW_CHECK_VERSION(0, 2, 9)
+class PwType {
+public:
+  spa_type_media_type media_type;
+  spa_type_media_subtype media_subtype;
+  spa_type_format_video format_video;
+  spa_type_video_format video_format;
+};
+#endif
+
+class ScreenCastStream;
+
+// One PipeWire loop, core and remote connection shared by any number of
+// streams. Consumers attach to nodes over the fd from OpenPipeWireRemote,
+// producers connect to the daemon directly.
+class PipeWireCore : public QObject
+{
+    Q_OBJECT
+public:
+    // Connects to the PipeWire daemon
+    explicit PipeWireCore(QObject *parent = nullptr);
+    // Connects over a remote fd we got from the portal
+    explicit PipeWireCore(const QDBusUnixFileDescriptor &fd, QObject *parent = nullptr);
+    ~PipeWireCore();
+
+    // Connects the remote and starts the loop thread, safe to call more than once
+    bool init();
+    bool isConnected() const;
+
+    // Streams get their pw_stream created on the loop thread once the remote
+    // is connected, or as soon as the loop gets to it when it already is
+    void attach(ScreenCastStream *stream);
+    void detach(ScreenCastStream *stream);
+    int streamCount() const;
+    // Waits up to @seconds until the loop thread got to all attached streams,
+    // after which their pw_stream may be used from the calling thread
+    bool waitForStreams(int seconds);
+
+    void lock() const;
+    void unlock() const;
+
+    // Public because we need access from static functions
+    void remoteConnected();
+    void createStreams();
+
+public:
+#if PW_CHECK_VERSION(0, 2, 9)
+    struct pw_core *pwCore = nullptr;
+    struct pw_loop *pwLoop = nullptr;
+    struct pw_remote *pwRemote = nullptr;
+    struct pw_thread_loop *pwMainLoop = nullptr;
+#else
+    pw_core *pwCore = nullptr;
+    pw_loop *pwLoop = nullptr;
+    pw_remote *pwRemote = nullptr;
+    pw_thread_loop *pwMainLoop = nullptr;
+    pw_type *pwCoreType = nullptr;
+    PwType *pwType = nullptr;
+#endif
+
+    spa_hook remoteListener;
+
+private:
+#if !PW_CHECK_VERSION(0, 2, 9)
+    void initializePwTypes();
+#endif
+
+    QDBusUnixFileDescriptor pipewireFd;
+    bool started = false;
+    // Only touched with the loop locked, pending streams don't have their
+    // pw_stream yet
+    QVector<ScreenCastStream *> streams;
+    QVector<ScreenCastStream *> pendingStreams;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_PIPEWIRE_CORE_H
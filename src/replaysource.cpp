@@ -0,0 +1,377 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "replaysource.h"
+#include "framescaler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestReplaySource, "xdp-test-replay-source")
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME_MAGIC "FRAME"
+#define Y4M_MAX_HEADER 1024
+
+// Number of frames we ask the kernel to read ahead of the one being published
+#define READ_AHEAD_FRAMES 4
+
+static size_t pageSize()
+{
+    static const size_t size = (size_t) sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static inline uint8_t clampToByte(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+ReplaySource::ReplaySource()
+{
+}
+
+ReplaySource::~ReplaySource()
+{
+    close();
+}
+
+bool ReplaySource::open(const QString &fileName, const QSize &rawSize)
+{
+    close();
+
+    int fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        qCWarning(XdgDesktopPortalTestReplaySource) << "Failed to open replay file" << fileName << strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        qCWarning(XdgDesktopPortalTestReplaySource) << "Replay file is empty or can't be read" << fileName;
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file referenced on its own
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        qCWarning(XdgDesktopPortalTestReplaySource) << "Failed to map replay file" << fileName << strerror(errno);
+        return false;
+    }
+
+    m_data = static_cast<uint8_t *>(data);
+    m_length = (size_t) st.st_size;
+
+    madvise(m_data, m_length, MADV_SEQUENTIAL);
+
+    if (m_length > strlen(Y4M_MAGIC) && memcmp(m_data, Y4M_MAGIC, strlen(Y4M_MAGIC)) == 0) {
+        m_fileFormat = FormatY4M;
+        if (!parseY4MHeader()) {
+            qCWarning(XdgDesktopPortalTestReplaySource) << "Unsupported Y4M header in" << fileName;
+            close();
+            return false;
+        }
+    } else {
+        if (!rawSize.isValid() || rawSize.isEmpty()) {
+            qCWarning(XdgDesktopPortalTestReplaySource) << "Raw replay file" << fileName << "needs a frame size";
+            close();
+            return false;
+        }
+        m_fileFormat = FormatRaw;
+        m_size = rawSize;
+        m_frameBytes = (size_t) rawSize.width() * rawSize.height() * FrameScaler::BytesPerPixel;
+        m_firstFrame = 0;
+    }
+
+    if (m_firstFrame + m_frameBytes > m_length) {
+        qCWarning(XdgDesktopPortalTestReplaySource) << "Replay file" << fileName << "doesn't contain a single frame";
+        close();
+        return false;
+    }
+
+    m_offset = m_firstFrame;
+    m_readAheadEnd = m_firstFrame;
+    m_releasedUpTo = 0;
+    m_atEnd = false;
+
+    qCDebug(XdgDesktopPortalTestReplaySource) << "Replaying" << fileName << "with frame size" << m_size
+                                              << "and" << (m_length - m_firstFrame) / m_frameBytes << "frames";
+
+    return true;
+}
+
+void ReplaySource::close()
+{
+    if (m_data) {
+        munmap(m_data, m_length);
+        m_data = nullptr;
+    }
+
+    m_length = 0;
+    m_frameBytes = 0;
+    m_size = QSize();
+    m_frameRate = 0;
+    m_atEnd = true;
+}
+
+bool ReplaySource::loop() const
+{
+    return m_loop;
+}
+
+void ReplaySource::setLoop(bool loop)
+{
+    m_loop = loop;
+}
+
+bool ReplaySource::atEnd() const
+{
+    return m_atEnd;
+}
+
+uint ReplaySource::frameRate() const
+{
+    return m_frameRate;
+}
+
+QSize ReplaySource::size() const
+{
+    return m_size;
+}
+
+bool ReplaySource::renderFrame(uint8_t *dst, int stride)
+{
+    const uint8_t *frame = nextFrame();
+    if (!frame)
+        return false;
+
+    if (m_fileFormat == FormatY4M) {
+        convertYuvFrame(frame, dst, stride);
+        return true;
+    }
+
+    const int srcStride = m_size.width() * FrameScaler::BytesPerPixel;
+    if (stride == srcStride) {
+        memcpy(dst, frame, m_frameBytes);
+    } else {
+        for (int y = 0; y < m_size.height(); y++)
+            memcpy(dst + y * stride, frame + y * srcStride, srcStride);
+    }
+
+    return true;
+}
+
+bool ReplaySource::parseY4MHeader()
+{
+    const size_t searchLength = qMin<size_t>(m_length, Y4M_MAX_HEADER);
+    const uint8_t *end = static_cast<const uint8_t *>(memchr(m_data, '\n', searchLength));
+    if (!end)
+        return false;
+
+    const QByteArray header = QByteArray::fromRawData(reinterpret_cast<const char *>(m_data), end - m_data);
+    const QList<QByteArray> tokens = header.mid(strlen(Y4M_MAGIC)).split(' ');
+
+    int width = 0;
+    int height = 0;
+
+    // Default colorspace according to the Y4M specification
+    m_chromaShiftX = 1;
+    m_chromaShiftY = 1;
+    m_mono = false;
+
+    for (const QByteArray &token : tokens) {
+        if (token.isEmpty())
+            continue;
+
+        const QByteArray value = token.mid(1);
+        switch (token.at(0)) {
+        case 'W':
+            width = value.toInt();
+            break;
+        case 'H':
+            height = value.toInt();
+            break;
+        case 'F': {
+            const QList<QByteArray> fraction = value.split(':');
+            if (fraction.count() == 2 && fraction.at(1).toUInt() > 0)
+                m_frameRate = qRound(fraction.at(0).toDouble() / fraction.at(1).toDouble());
+            break;
+        }
+        case 'I':
+            if (value != "p" && value != "?")
+                qCWarning(XdgDesktopPortalTestReplaySource) << "Interlaced Y4M content will be replayed as progressive";
+            break;
+        case 'C':
+            if (value == "420" || value == "420jpeg" || value == "420paldv" || value == "420mpeg2") {
+                m_chromaShiftX = 1;
+                m_chromaShiftY = 1;
+            } else if (value == "422") {
+                m_chromaShiftX = 1;
+                m_chromaShiftY = 0;
+            } else if (value == "444") {
+                m_chromaShiftX = 0;
+                m_chromaShiftY = 0;
+            } else if (value == "mono") {
+                m_mono = true;
+            } else {
+                qCWarning(XdgDesktopPortalTestReplaySource) << "Unsupported Y4M colorspace" << value;
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (width <= 0 || height <= 0)
+        return false;
+
+    m_size = QSize(width, height);
+
+    const size_t lumaBytes = (size_t) width * height;
+    if (m_mono) {
+        m_frameBytes = lumaBytes;
+    } else {
+        const size_t chromaWidth = (width + (1 << m_chromaShiftX) - 1) >> m_chromaShiftX;
+        const size_t chromaHeight = (height + (1 << m_chromaShiftY) - 1) >> m_chromaShiftY;
+        m_frameBytes = lumaBytes + 2 * chromaWidth * chromaHeight;
+    }
+
+    m_firstFrame = (end - m_data) + 1;
+
+    return true;
+}
+
+const uint8_t *ReplaySource::nextFrame()
+{
+    if (!m_data)
+        return nullptr;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t dataOffset = m_offset;
+
+        if (m_fileFormat == FormatY4M && m_offset + strlen(Y4M_FRAME_MAGIC) < m_length &&
+            memcmp(m_data + m_offset, Y4M_FRAME_MAGIC, strlen(Y4M_FRAME_MAGIC)) == 0) {
+            // Frame headers may carry parameters, skip to the end of the line
+            const size_t searchLength = qMin<size_t>(m_length - m_offset, Y4M_MAX_HEADER);
+            const uint8_t *end = static_cast<const uint8_t *>(memchr(m_data + m_offset, '\n', searchLength));
+            dataOffset = end ? (end - m_data) + 1 : m_length;
+        } else if (m_fileFormat == FormatY4M) {
+            dataOffset = m_length;
+        }
+
+        if (dataOffset + m_frameBytes <= m_length) {
+            const uint8_t *frame = m_data + dataOffset;
+
+            releaseBehind(m_offset);
+            m_offset = dataOffset + m_frameBytes;
+            readAhead();
+
+            return frame;
+        }
+
+        if (!m_loop || attempt > 0)
+            break;
+
+        qCDebug(XdgDesktopPortalTestReplaySource) << "Reached end of the replay file, starting over";
+
+        m_offset = m_firstFrame;
+        m_readAheadEnd = m_firstFrame;
+        m_releasedUpTo = 0;
+    }
+
+    if (!m_atEnd)
+        qCDebug(XdgDesktopPortalTestReplaySource) << "Reached end of the replay file";
+
+    m_atEnd = true;
+    return nullptr;
+}
+
+void ReplaySource::readAhead()
+{
+    // Only ask again once we are about to run out of the previous window,
+    // so that we issue one madvise() every few frames, not one per frame
+    if (m_offset + m_frameBytes < m_readAheadEnd || m_readAheadEnd >= m_length)
+        return;
+
+    const size_t start = m_offset & ~(pageSize() - 1);
+    const size_t end = qMin(m_length, m_offset + READ_AHEAD_FRAMES * (m_frameBytes + Y4M_MAX_HEADER));
+
+    madvise(m_data + start, end - start, MADV_WILLNEED);
+    m_readAheadEnd = end;
+}
+
+void ReplaySource::releaseBehind(size_t offset)
+{
+    // Drop pages of frames we already published from our mapping, so replaying
+    // a long session doesn't grow RSS. They are still in the page cache if
+    // we loop around and need them again.
+    const size_t releaseEnd = offset & ~(pageSize() - 1);
+
+    if (releaseEnd <= m_releasedUpTo)
+        return;
+
+    madvise(m_data + m_releasedUpTo, releaseEnd - m_releasedUpTo, MADV_DONTNEED);
+    m_releasedUpTo = releaseEnd;
+}
+
+void ReplaySource::convertYuvFrame(const uint8_t *src, uint8_t *dst, int stride) const
+{
+    const int width = m_size.width();
+    const int height = m_size.height();
+    const int chromaWidth = (width + (1 << m_chromaShiftX) - 1) >> m_chromaShiftX;
+    const int chromaHeight = (height + (1 << m_chromaShiftY) - 1) >> m_chromaShiftY;
+
+    const uint8_t *yPlane = src;
+    const uint8_t *uPlane = yPlane + (size_t) width * height;
+    const uint8_t *vPlane = uPlane + (size_t) chromaWidth * chromaHeight;
+
+    // BT.601 limited range, which is what Y4M content is unless stated otherwise
+    for (int y = 0; y < height; y++) {
+        const uint8_t *yRow = yPlane + (size_t) y * width;
+        const uint8_t *uRow = uPlane + (size_t) (y >> m_chromaShiftY) * chromaWidth;
+        const uint8_t *vRow = vPlane + (size_t) (y >> m_chromaShiftY) * chromaWidth;
+        uint8_t *out = dst + (size_t) y * stride;
+
+        for (int x = 0; x < width; x++) {
+            const int c = 298 * (yRow[x] - 16);
+            const int d = m_mono ? 0 : uRow[x >> m_chromaShiftX] - 128;
+            const int e = m_mono ? 0 : vRow[x >> m_chromaShiftX] - 128;
+
+            out[0] = clampToByte((c + 409 * e + 128) >> 8);
+            out[1] = clampToByte((c - 100 * d - 208 * e + 128) >> 8);
+            out[2] = clampToByte((c + 516 * d + 128) >> 8);
+            out[3] = 0xff;
+            out += 4;
+        }
+    }
+}
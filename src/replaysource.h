@@ -0,0 +1,83 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_REPLAY_SOURCE_H
+#define XDG_DESKTOP_PORTAL_TEST_REPLAY_SOURCE_H
+
+#include "framesource.h"
+
+#include <QString>
+
+#include <stddef.h>
+
+// Replays a pre-recorded session from a memory-mapped file. Either raw RGBx
+// frames of a known size, or a YUV4MPEG2 (Y4M) file with 8-bit 4:2:0, 4:2:2,
+// 4:4:4 or mono content, which is converted while being written out.
+class ReplaySource : public FrameSource
+{
+public:
+    ReplaySource();
+    ~ReplaySource() override;
+
+    // @rawSize is only used for files which don't carry a Y4M header
+    bool open(const QString &fileName, const QSize &rawSize = QSize());
+    void close();
+
+    bool loop() const;
+    void setLoop(bool loop);
+
+    bool atEnd() const override;
+    // Frame rate from the Y4M header, 0 if the file doesn't specify one
+    uint frameRate() const override;
+
+    QSize size() const override;
+    bool renderFrame(uint8_t *dst, int stride) override;
+
+private:
+    enum FileFormat {
+        FormatRaw = 0,
+        FormatY4M
+    };
+
+    bool parseY4MHeader();
+    const uint8_t *nextFrame();
+    void readAhead();
+    void releaseBehind(size_t offset);
+    void convertYuvFrame(const uint8_t *src, uint8_t *dst, int stride) const;
+
+    FileFormat m_fileFormat = FormatRaw;
+    QSize m_size;
+    uint m_frameRate = 0;
+    int m_chromaShiftX = 1;
+    int m_chromaShiftY = 1;
+    bool m_mono = false;
+    bool m_loop = false;
+    bool m_atEnd = false;
+
+    uint8_t *m_data = nullptr;
+    size_t m_length = 0;
+    size_t m_frameBytes = 0;
+    size_t m_firstFrame = 0;
+    size_t m_offset = 0;
+    size_t m_readAheadEnd = 0;
+    size_t m_releasedUpTo = 0;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_REPLAY_SOURCE_H
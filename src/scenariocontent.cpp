@@ -0,0 +1,401 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "scenariocontent.h"
+
+#include <QFile>
+#include <QList>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestScenarioContent, "xdp-test-scenario-content")
+
+#define DEFAULT_GLYPH_WIDTH 8
+#define DEFAULT_GLYPH_HEIGHT 16
+#define DEFAULT_CLOCK_WIDTH 64
+#define DEFAULT_CLOCK_HEIGHT 16
+#define TITLE_BAR_HEIGHT 24
+
+static inline uint32_t rgbx(uint32_t red, uint32_t green, uint32_t blue)
+{
+    return 0xff000000 | blue << 16 | green << 8 | red;
+}
+
+// Cheap integer hash, good enough to look like noise
+static inline uint32_t mix(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x7feb352d;
+    value ^= value >> 15;
+    value *= 0x846ca68b;
+    value ^= value >> 16;
+    return value;
+}
+
+static bool parseSize(const QByteArray &value, const QSize &screen, QSize *size)
+{
+    if (value == "full") {
+        *size = screen;
+        return true;
+    }
+
+    const QList<QByteArray> parts = value.split('x');
+    if (parts.count() != 2)
+        return false;
+
+    bool widthOk = false;
+    bool heightOk = false;
+    *size = QSize(parts.at(0).toInt(&widthOk), parts.at(1).toInt(&heightOk));
+
+    return widthOk && heightOk && !size->isEmpty();
+}
+
+ScenarioContent::ScenarioContent(const QSize &size)
+    : m_size(size)
+{
+    reset();
+}
+
+bool ScenarioContent::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(XdgDesktopPortalTestScenarioContent) << "Failed to open scenario" << fileName << file.errorString();
+        return false;
+    }
+
+    return parse(file.readAll());
+}
+
+bool ScenarioContent::parse(const QByteArray &scenario)
+{
+    QVector<Phase> phases;
+    quint32 seed = 1;
+    int lineNumber = 0;
+
+    for (QByteArray line : scenario.split('\n')) {
+        lineNumber++;
+
+        const int comment = line.indexOf('#');
+        if (comment >= 0)
+            line.truncate(comment);
+
+        const QList<QByteArray> tokens = line.simplified().split(' ');
+        if (tokens.first().isEmpty())
+            continue;
+
+        const QByteArray &name = tokens.first();
+        bool ok = false;
+
+        if (name == "seed") {
+            seed = tokens.value(1).toUInt(&ok);
+            if (!ok || tokens.count() != 2) {
+                qCWarning(XdgDesktopPortalTestScenarioContent) << "Invalid seed on line" << lineNumber;
+                return false;
+            }
+            continue;
+        }
+
+        Phase phase;
+        if (name == "static") {
+            phase.type = Static;
+            phase.interval = 60;
+        } else if (name == "typing") {
+            phase.type = Typing;
+            phase.interval = 4;
+        } else if (name == "drag") {
+            phase.type = Drag;
+        } else if (name == "noise") {
+            phase.type = Noise;
+        } else if (name == "idle") {
+            phase.type = Idle;
+        } else {
+            qCWarning(XdgDesktopPortalTestScenarioContent) << "Unknown phase" << name << "on line" << lineNumber;
+            return false;
+        }
+
+        phase.frames = tokens.value(1).toInt(&ok);
+        if (!ok || phase.frames <= 0) {
+            qCWarning(XdgDesktopPortalTestScenarioContent) << "Phase on line" << lineNumber << "needs a number of frames";
+            return false;
+        }
+
+        for (int i = 2; i < tokens.count(); i++) {
+            const int separator = tokens.at(i).indexOf('=');
+            const QByteArray key = tokens.at(i).left(separator);
+            const QByteArray value = separator < 0 ? QByteArray() : tokens.at(i).mid(separator + 1);
+
+            if (key == "interval") {
+                phase.interval = value.toInt(&ok);
+                ok = ok && phase.interval > 0;
+            } else if (key == "speed") {
+                phase.speed = value.toInt(&ok);
+                ok = ok && phase.speed > 0;
+            } else if (key == "size") {
+                ok = parseSize(value, m_size, &phase.size);
+            } else {
+                ok = false;
+            }
+
+            if (!ok) {
+                qCWarning(XdgDesktopPortalTestScenarioContent) << "Invalid option" << tokens.at(i) << "on line" << lineNumber;
+                return false;
+            }
+        }
+
+        phases << phase;
+    }
+
+    if (phases.isEmpty()) {
+        qCWarning(XdgDesktopPortalTestScenarioContent) << "Scenario has no phases";
+        return false;
+    }
+
+    m_phases = phases;
+    m_seed = seed;
+    reset();
+
+    return true;
+}
+
+QVector<ScenarioContent::Phase> ScenarioContent::phases() const
+{
+    return m_phases;
+}
+
+int ScenarioContent::currentPhase() const
+{
+    return m_phase;
+}
+
+QSize ScenarioContent::size() const
+{
+    return m_size;
+}
+
+void ScenarioContent::reset()
+{
+    const int width = m_size.width();
+    const int height = m_size.height();
+
+    m_phase = -1;
+    m_phaseFrame = 0;
+
+    m_textArea = QRect(width / 16, height / 8, width / 2, height / 4);
+    m_glyphSize = QSize(DEFAULT_GLYPH_WIDTH, DEFAULT_GLYPH_HEIGHT);
+    m_typed = 0;
+
+    m_window = QRect(width / 3, height / 3, qMax(1, width / 4), qMax(1, height / 4));
+    m_windowDirection = QPoint(1, 1);
+
+    m_noise = QRect();
+    m_noiseFrame = 0;
+
+    m_clock = QRect(width - DEFAULT_CLOCK_WIDTH - 8, 8, DEFAULT_CLOCK_WIDTH, DEFAULT_CLOCK_HEIGHT).intersected(QRect(QPoint(0, 0), m_size));
+    m_ticks = 0;
+}
+
+void ScenarioContent::advance(QVector<QRect> *damage)
+{
+    if (m_phases.isEmpty())
+        return;
+
+    if (m_phase < 0 || ++m_phaseFrame >= m_phases.at(m_phase).frames) {
+        if (m_phase >= 0)
+            leavePhase(m_phases.at(m_phase), damage);
+
+        m_phaseFrame = 0;
+        m_phase++;
+
+        // The timeline starts over from the very same state
+        if (m_phase >= m_phases.count() || m_phase == 0) {
+            reset();
+            m_phase = 0;
+            *damage << QRect(QPoint(0, 0), m_size);
+        }
+
+        enterPhase(m_phases.at(m_phase), damage);
+    }
+
+    const Phase &phase = m_phases.at(m_phase);
+    if (m_phaseFrame % phase.interval)
+        return;
+
+    switch (phase.type) {
+    case Static:
+        m_ticks++;
+        *damage << m_clock;
+        break;
+    case Typing:
+        if (m_typed >= glyphCapacity()) {
+            // The text area is full, clear it and start from the top
+            m_typed = 0;
+            *damage << m_textArea;
+        }
+
+        *damage << QRect(m_textArea.x() + (m_typed % glyphColumns()) * m_glyphSize.width(),
+                         m_textArea.y() + (m_typed / glyphColumns()) * m_glyphSize.height(),
+                         m_glyphSize.width(), m_glyphSize.height());
+        m_typed++;
+        break;
+    case Drag: {
+        const QRect previous = m_window;
+        QPoint step = m_windowDirection * phase.speed;
+
+        if (m_window.left() + step.x() < 0 || m_window.right() + step.x() >= m_size.width())
+            m_windowDirection.rx() = -m_windowDirection.x();
+        if (m_window.top() + step.y() < 0 || m_window.bottom() + step.y() >= m_size.height())
+            m_windowDirection.ry() = -m_windowDirection.y();
+
+        step = m_windowDirection * phase.speed;
+        const QRect next = m_window.translated(step);
+        if (QRect(QPoint(0, 0), m_size).contains(next))
+            m_window = next;
+
+        *damage << previous << m_window;
+        break;
+    }
+    case Noise:
+        m_noiseFrame++;
+        *damage << m_noise;
+        break;
+    case Idle:
+        break;
+    }
+}
+
+void ScenarioContent::enterPhase(const Phase &phase, QVector<QRect> *damage)
+{
+    switch (phase.type) {
+    case Static:
+        resizeLayer(&m_clock, phase.size.isValid() ? phase.size : QSize(DEFAULT_CLOCK_WIDTH, DEFAULT_CLOCK_HEIGHT), damage);
+        break;
+    case Typing: {
+        const QSize glyphSize = phase.size.isValid() ? phase.size : QSize(DEFAULT_GLYPH_WIDTH, DEFAULT_GLYPH_HEIGHT);
+        if (glyphSize != m_glyphSize) {
+            m_glyphSize = glyphSize;
+            m_typed = 0;
+            *damage << m_textArea;
+        }
+        break;
+    }
+    case Drag:
+        resizeLayer(&m_window, phase.size.isValid() ? phase.size : QSize(qMax(1, m_size.width() / 4), qMax(1, m_size.height() / 4)), damage);
+        break;
+    case Noise:
+        m_noise = QRect(QPoint(0, 0), phase.size.isValid() ? phase.size : m_size);
+        m_noise.moveCenter(QRect(QPoint(0, 0), m_size).center());
+        m_noise = m_noise.intersected(QRect(QPoint(0, 0), m_size));
+        *damage << m_noise;
+        break;
+    case Idle:
+        break;
+    }
+}
+
+void ScenarioContent::leavePhase(const Phase &phase, QVector<QRect> *damage)
+{
+    if (phase.type == Noise) {
+        *damage << m_noise;
+        m_noise = QRect();
+    }
+}
+
+void ScenarioContent::resizeLayer(QRect *layer, const QSize &size, QVector<QRect> *damage) const
+{
+    if (layer->size() == size)
+        return;
+
+    *damage << *layer;
+
+    // Keep the top left corner unless the layer would stick out of the screen
+    const QSize clamped = size.boundedTo(m_size);
+    layer->setSize(clamped);
+    layer->moveTo(qMin(layer->x(), m_size.width() - clamped.width()), qMin(layer->y(), m_size.height() - clamped.height()));
+
+    *damage << *layer;
+}
+
+int ScenarioContent::glyphColumns() const
+{
+    return qMax(1, m_textArea.width() / m_glyphSize.width());
+}
+
+int ScenarioContent::glyphCapacity() const
+{
+    return glyphColumns() * qMax(1, m_textArea.height() / m_glyphSize.height());
+}
+
+void ScenarioContent::render(const QRect &rect, uint8_t *dst, int stride) const
+{
+    const int width = qMax(1, m_size.width() - 1);
+    const int height = qMax(1, m_size.height() - 1);
+    const int columns = glyphColumns();
+    const int titleBar = qMin(TITLE_BAR_HEIGHT, m_window.height() / 4);
+
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        uint32_t *line = reinterpret_cast<uint32_t *>(dst + (size_t) (y - rect.top()) * stride);
+        const uint32_t red = y * 255 / height;
+
+        for (int x = rect.left(); x <= rect.right(); x++)
+            line[x - rect.left()] = rgbx(red, 64, x * 255 / width);
+
+        // Text area, typed glyphs are blocks with a one pixel gap and a random pattern
+        if (y >= m_textArea.top() && y <= m_textArea.bottom()) {
+            const int glyphY = (y - m_textArea.top()) / m_glyphSize.height();
+            const int glyphLine = (y - m_textArea.top()) % m_glyphSize.height();
+            const int left = qMax(rect.left(), m_textArea.left());
+            const int right = qMin(rect.right(), m_textArea.right());
+
+            for (int x = left; x <= right; x++) {
+                const int glyphX = (x - m_textArea.left()) / m_glyphSize.width();
+                const int glyph = glyphY * columns + glyphX;
+                const int glyphColumn = (x - m_textArea.left()) % m_glyphSize.width();
+
+                bool ink = glyphX < columns && glyph < m_typed && glyphColumn && glyphLine;
+                if (ink)
+                    ink = mix(uint32_t(glyph) * 31 + m_seed) >> ((glyphColumn + glyphLine * 3) % 31) & 1;
+                line[x - rect.left()] = ink ? rgbx(24, 24, 24) : rgbx(240, 240, 240);
+            }
+        }
+
+        if (y >= m_clock.top() && y <= m_clock.bottom()) {
+            const int left = qMax(rect.left(), m_clock.left());
+            const int right = qMin(rect.right(), m_clock.right());
+            for (int x = left; x <= right; x++)
+                line[x - rect.left()] = ((x - m_clock.left()) / 4 + m_ticks) % 5 ? rgbx(255, 255, 255) : rgbx(0, 0, 0);
+        }
+
+        if (y >= m_window.top() && y <= m_window.bottom()) {
+            const uint32_t color = y - m_window.top() < titleBar ? rgbx(48, 64, 160) : rgbx(220, 220, 210);
+            const int left = qMax(rect.left(), m_window.left());
+            const int right = qMin(rect.right(), m_window.right());
+            for (int x = left; x <= right; x++)
+                line[x - rect.left()] = color;
+        }
+
+        if (y >= m_noise.top() && y <= m_noise.bottom()) {
+            const uint32_t frame = mix(m_noiseFrame ^ m_seed) ^ uint32_t(y) * 0x85ebca77;
+            const int left = qMax(rect.left(), m_noise.left());
+            const int right = qMin(rect.right(), m_noise.right());
+            for (int x = left; x <= right; x++)
+                line[x - rect.left()] = mix(frame ^ uint32_t(x) * 0x9e3779b1) | 0xff000000;
+        }
+    }
+}
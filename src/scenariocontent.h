@@ -0,0 +1,93 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_SCENARIO_CONTENT_H
+#define XDG_DESKTOP_PORTAL_TEST_SCENARIO_CONTENT_H
+
+#include "tilecontent.h"
+
+#include <QByteArray>
+#include <QString>
+
+// Plays a timeline of content phases read from a scenario file. Phases
+// count frames, not time, so a scenario always produces the very same
+// frames and damage no matter how fast it is played.
+class ScenarioContent : public TileContent
+{
+public:
+    enum PhaseType {
+        Static = 0, // Nothing but a clock ticking
+        Typing,     // Characters appearing in a text area
+        Drag,       // A window moved around
+        Noise,      // Fullscreen video, closed when the phase ends
+        Idle        // Nothing changes at all
+    };
+
+    struct Phase {
+        PhaseType type = Idle;
+        int frames = 0;
+        // Frames between two changes
+        int interval = 1;
+        // Size of what changes, the default of the phase type when invalid
+        QSize size;
+        // Pixels a dragged window moves with every change
+        int speed = 16;
+    };
+
+    explicit ScenarioContent(const QSize &size);
+
+    bool load(const QString &fileName);
+    bool parse(const QByteArray &scenario);
+
+    QVector<Phase> phases() const;
+    // Index of the phase the last advance() played, -1 before the first one
+    int currentPhase() const;
+
+    QSize size() const override;
+    void advance(QVector<QRect> *damage) override;
+    void render(const QRect &rect, uint8_t *dst, int stride) const override;
+
+private:
+    void reset();
+    void enterPhase(const Phase &phase, QVector<QRect> *damage);
+    void leavePhase(const Phase &phase, QVector<QRect> *damage);
+    void resizeLayer(QRect *layer, const QSize &size, QVector<QRect> *damage) const;
+    int glyphColumns() const;
+    int glyphCapacity() const;
+
+    QSize m_size;
+    QVector<Phase> m_phases;
+    quint32 m_seed = 1;
+    int m_phase = -1;
+    int m_phaseFrame = 0;
+
+    // Layers keep what previous phases left on them
+    QRect m_textArea;
+    QSize m_glyphSize;
+    int m_typed = 0;
+    QRect m_window;
+    QPoint m_windowDirection;
+    QRect m_noise;
+    quint32 m_noiseFrame = 0;
+    QRect m_clock;
+    int m_ticks = 0;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_SCENARIO_CONTENT_H
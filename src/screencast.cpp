@@ -19,17 +19,28 @@
  */
 
 #include "screencast.h"
+#include "replaysource.h"
+#include "scenariocontent.h"
+#include "screencastproducer.h"
 #include "screencaststream.h"
 #include "session.h"
+#include "sourcecatalog.h"
+#include "streamworkerpool.h"
+#include "tilecontent.h"
+#include "tiledgenerator.h"
+#include "tracer.h"
 
 #include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusMessage>
 #include <QDBusMetaType>
 #include <QDBusObjectPath>
-#include <QEventLoop>
+#include <QFile>
 #include <QLoggingCategory>
-#include <QImage>
+#include <QRect>
 #include <QSize>
 #include <QTimer>
+#include <QUuid>
 
 Q_LOGGING_CATEGORY(XdgDesktopPortalTestScreenCast, "xdp-test-screencast")
 
@@ -63,32 +74,109 @@ const QDBusArgument &operator << (QDBusArgument &arg, const ScreenCastPortal::St
     return arg;
 }
 
+const QDBusArgument &operator >> (const QDBusArgument &arg, ScreenCastPortal::RestoreData &restoreData)
+{
+    QDBusVariant data;
+
+    arg.beginStructure();
+    arg >> restoreData.vendor >> restoreData.version >> data;
+    arg.endStructure();
+
+    restoreData.data = data.variant();
+
+    return arg;
+}
+
+const QDBusArgument &operator << (QDBusArgument &arg, const ScreenCastPortal::RestoreData &restoreData)
+{
+    arg.beginStructure();
+    arg << restoreData.vendor << restoreData.version << QDBusVariant(restoreData.data);
+    arg.endStructure();
+
+    return arg;
+}
+
 Q_DECLARE_METATYPE(ScreenCastPortal::Stream)
 Q_DECLARE_METATYPE(ScreenCastPortal::Streams)
+Q_DECLARE_METATYPE(ScreenCastPortal::RestoreData)
+
+// Identifies restore data we handed out, other backends' data is ignored
+#define RESTORE_DATA_VENDOR "xdg-desktop-portal-test"
+#define RESTORE_DATA_VERSION 1
+// Closed persistent sessions whose streams are kept, and for how many seconds
+#define DEFAULT_WARM_SESSIONS 4
+#define DEFAULT_WARM_TIMEOUT 60
+
+// Parses sizes in the "1920x1080" form used by the XDP_TEST_* variables
+static QSize sizeFromString(const QByteArray &string)
+{
+    const QList<QByteArray> dimensions = string.toLower().split('x');
+
+    if (dimensions.count() != 2)
+        return QSize();
+
+    return QSize(dimensions.at(0).toInt(), dimensions.at(1).toInt());
+}
 
 ScreenCastPortal::ScreenCastPortal(QObject *parent)
     : QDBusAbstractAdaptor(parent)
 {
     qDBusRegisterMetaType<ScreenCastPortal::Stream>();
     qDBusRegisterMetaType<ScreenCastPortal::Streams>();
+    qDBusRegisterMetaType<ScreenCastPortal::RestoreData>();
+
+    m_catalog.reset(new SourceCatalog(SourceCatalog::fromEnvironment()));
+    m_workers = new StreamWorkerPool(0, this);
+
+    bool ok = false;
+    m_warmLimit = qEnvironmentVariableIntValue("XDP_TEST_RESTORE_STREAMS", &ok);
+    if (!ok || m_warmLimit < 0)
+        m_warmLimit = DEFAULT_WARM_SESSIONS;
+    m_warmTimeout = qEnvironmentVariableIntValue("XDP_TEST_RESTORE_TIMEOUT", &ok);
+    if (!ok || m_warmTimeout <= 0)
+        m_warmTimeout = DEFAULT_WARM_TIMEOUT;
 }
 
 ScreenCastPortal::~ScreenCastPortal()
 {
-    if (m_timer)
-        delete m_timer;
+    // Producers are deleted by their worker threads once the pool stops them
+    for (const QList<QPointer<ScreenCastProducer>> &producers : qAsConst(m_producers)) {
+        for (const QPointer<ScreenCastProducer> &producer : producers) {
+            if (producer)
+                producer->deleteLater();
+        }
+    }
+
+    for (const PendingStart &pending : qAsConst(m_pendingStarts)) {
+        for (const QPointer<ScreenCastProducer> &producer : pending.producers) {
+            if (producer)
+                producer->deleteLater();
+        }
+    }
+
+    for (const WarmKey &key : QList<WarmKey>(m_warmOrder))
+        dropWarmSession(key);
+}
+
+uint ScreenCastPortal::AvailableSourceTypes() const
+{
+    return m_catalog->availableTypes();
+}
 
-    if (m_stream)
-        delete m_stream;
+int ScreenCastPortal::workerLoad() const
+{
+    return m_workers->load();
 }
 
 uint ScreenCastPortal::CreateSession(const QDBusObjectPath &handle,
                                      const QDBusObjectPath &session_handle,
                                      const QString &app_id,
                                      const QVariantMap &options,
+                                     const QDBusMessage &message,
                                      QVariantMap &results)
 {
     Q_UNUSED(results)
+    TraceScope trace("CreateSession");
 
     qCDebug(XdgDesktopPortalTestScreenCast) << "CreateSession called with parameters:";
     qCDebug(XdgDesktopPortalTestScreenCast) << "    handle: " << handle.path();
@@ -96,14 +184,16 @@ uint ScreenCastPortal::CreateSession(const QDBusObjectPath &handle,
     qCDebug(XdgDesktopPortalTestScreenCast) << "    app_id: " << app_id;
     qCDebug(XdgDesktopPortalTestScreenCast) << "    options: " << options;
 
-    Session *session = Session::createSession(this, Session::ScreenCast, app_id, session_handle.path());
+    // Normally the frontend, which outlives its clients' sessions unless it crashes
+    Session *session = Session::createSession(this, Session::ScreenCast, app_id, session_handle.path(), message.service());
 
     if (!session) {
         return 2;
     }
 
-    connect(session, &Session::closed, [this] () {
-        stopStreaming();
+    const QString sessionPath = session_handle.path();
+    connect(session, &Session::closed, [this, sessionPath, session] () {
+        stopStreaming(sessionPath, qobject_cast<ScreenCastSession *>(session));
     });
 
     return 0;
@@ -116,6 +206,7 @@ uint ScreenCastPortal::SelectSources(const QDBusObjectPath &handle,
                                      QVariantMap &results)
 {
     Q_UNUSED(results)
+    TraceScope trace("SelectSources");
 
     qCDebug(XdgDesktopPortalTestScreenCast) << "SelectSource called with parameters:";
     qCDebug(XdgDesktopPortalTestScreenCast) << "    handle: " << handle.path();
@@ -140,6 +231,54 @@ uint ScreenCastPortal::SelectSources(const QDBusObjectPath &handle,
         types = (SourceType)(options.value(QStringLiteral("types")).toUInt());
     }
 
+    // 0 doesn't persist, 1 while the application runs and 2 until revoked,
+    // which the frontend takes care of by keeping or dropping the token
+    if (options.contains(QStringLiteral("persist_mode"))) {
+        session->setPersistMode(qMin(options.value(QStringLiteral("persist_mode")).toUInt(), 2u));
+    }
+
+    // Restoring skips what the user would have picked in the dialog again
+    if (options.contains(QStringLiteral("restore_data"))) {
+        const RestoreData restoreData = qdbus_cast<RestoreData>(options.value(QStringLiteral("restore_data")));
+        const QVariantMap data = qdbus_cast<QVariantMap>(restoreData.data);
+        const QStringList restoredSources = qdbus_cast<QStringList>(data.value(QStringLiteral("sources")));
+
+        bool valid = restoreData.vendor == QLatin1String(RESTORE_DATA_VENDOR) &&
+                     restoreData.version == RESTORE_DATA_VERSION && !restoredSources.isEmpty();
+        for (const QString &name : restoredSources)
+            valid = valid && !m_catalog->source(name).name.isEmpty();
+
+        if (valid) {
+            session->setSourceTypes(data.value(QStringLiteral("types")).toUInt());
+            session->setMultipleSources(data.value(QStringLiteral("multiple")).toBool());
+            session->setSources(restoredSources);
+            session->setRestoreToken(data.value(QStringLiteral("token")).toString());
+            return 0;
+        }
+
+        qCDebug(XdgDesktopPortalTestScreenCast) << "Ignoring restore data for sources no longer available" << restoreData.vendor << restoredSources;
+    }
+
+    // No types means monitors, like in the portal documentation
+    if (types == Any)
+        types = Monitor;
+
+    // There is no dialog, XDP_TEST_SELECT_SOURCES can pick what the user would
+    const QStringList names = QString::fromUtf8(qgetenv("XDP_TEST_SELECT_SOURCES")).split(QLatin1Char(','), QString::SkipEmptyParts);
+    const QVector<SourceCatalog::Source> sources = m_catalog->select(types, session->multipleSources(), names);
+
+    if (sources.isEmpty()) {
+        qCWarning(XdgDesktopPortalTestScreenCast) << "No source matches types" << types << names;
+        return 2;
+    }
+
+    QStringList selected;
+    for (const SourceCatalog::Source &source : sources)
+        selected << source.name;
+
+    session->setSourceTypes(types);
+    session->setSources(selected);
+
     return 0;
 }
 
@@ -148,9 +287,10 @@ uint ScreenCastPortal::Start(const QDBusObjectPath &handle,
                              const QString &app_id,
                              const QString &parent_window,
                              const QVariantMap &options,
+                             const QDBusMessage &message,
                              QVariantMap &results)
 {
-    Q_UNUSED(results)
+    TraceScope trace("Start");
 
     qCDebug(XdgDesktopPortalTestScreenCast) << "Start called with parameters:";
     qCDebug(XdgDesktopPortalTestScreenCast) << "    handle: " << handle.path();
@@ -166,92 +306,369 @@ uint ScreenCastPortal::Start(const QDBusObjectPath &handle,
         return 2;
     }
 
-    m_stream = new ScreenCastStream(QSize(8, 8));
-    m_stream->init();
+    if (!m_producers.value(session_handle.path()).isEmpty() || m_pendingStarts.contains(session_handle.path())) {
+        qCWarning(XdgDesktopPortalTestScreenCast) << "Session was already started" << session_handle.path();
+        return 2;
+    }
 
-    connect(m_stream, &ScreenCastStream::startStreaming, this, [this] () {
-        m_streamingEnabled = true;
-        if (m_timer)
-            m_timer->start();
-    });
+    // Sessions Start()ed without SelectSources() get the first monitor
+    QStringList sourceNames = session->sources();
+    if (sourceNames.isEmpty()) {
+        const QVector<SourceCatalog::Source> sources = m_catalog->select(Monitor, false);
+        if (!sources.isEmpty())
+            sourceNames << sources.first().name;
+    }
 
-    connect(m_stream, &ScreenCastStream::stopStreaming, this, &ScreenCastPortal::stopStreaming);
+    const QString sessionPath = session_handle.path();
 
-    bool streamReady = false;
-    QEventLoop loop;
-    connect(m_stream, &ScreenCastStream::streamReady, this, [&loop, &streamReady] {
-        loop.quit();
-        streamReady = true;
-    });
+    // Restored sessions take over the streams their previous session left
+    // running, those are already negotiated and don't need to wait for PipeWire
+    QHash<ScreenCastProducer *, uint> nodeIds;
+    QList<QPointer<ScreenCastProducer>> producers = takeWarmProducers(WarmKey(session->appId(), session->restoreToken()), sourceNames, nodeIds);
 
-    // HACK wait for stream to be ready
-    QTimer::singleShot(3000, &loop, &QEventLoop::quit);
-    loop.exec();
+    // Watched before checking them, so that no stop goes unnoticed
+    bool restorable = !producers.isEmpty();
+    for (const QPointer<ScreenCastProducer> &producer : qAsConst(producers)) {
+        watchProducer(sessionPath, producer);
+        restorable = restorable && !producer->isStopped();
+    }
 
-    disconnect(m_stream, &ScreenCastStream::streamReady, this, nullptr);
+    if (restorable) {
+        qCDebug(XdgDesktopPortalTestScreenCast) << "Restoring" << producers.count() << "streams of" << session->restoreToken();
+        return finishStart(sessionPath, session, sourceNames, producers, nodeIds, results);
+    }
 
-    if (!streamReady) {
-        if (m_stream) {
-            delete m_stream;
-            m_stream = nullptr;
-        }
+    for (const QPointer<ScreenCastProducer> &producer : qAsConst(producers))
+        producer->deleteLater();
+    producers.clear();
+    nodeIds.clear();
+
+    if (!createProducers(sourceNames, producers))
         return 2;
-    }
 
-    m_timer = new QTimer(this);
-    m_timer->setInterval(2000);
-    m_timer->setSingleShot(false);
-    connect(m_timer, &QTimer::timeout, this, [this] () {
-        QImage capture = QImage(QSize(8, 8), QImage::Format_RGBA8888);
-        switch (m_frameCounter) {
-            case 0:
-                capture.fill(QColor("red"));
-                break;
-            case 1:
-                capture.fill(QColor("green"));
-                break;
-            case 2:
-                capture.fill(QColor("blue"));
-                break;
-            default:
-                capture.fill(QColor("black"));
-        }
-        m_frameCounter++;
-        if (!m_stream->writeFrame(capture.bits()))
-            qCWarning(XdgDesktopPortalTestScreenCast) << "Failed to write frame";
+    // Answered once all streams got their node, the D-Bus thread keeps
+    // serving other sessions while PipeWire sets them up
+    message.setDelayedReply(true);
+
+    PendingStart &pending = m_pendingStarts[sessionPath];
+    pending.message = message;
+    pending.sources = sourceNames;
+    pending.producers = producers;
+    pending.timeout = new QTimer(this);
+    pending.timeout->setSingleShot(true);
+    connect(pending.timeout, &QTimer::timeout, this, [this, sessionPath] () {
+        finishPendingStart(sessionPath, false);
     });
+    pending.timeout->start(3000);
+
+    for (const QPointer<ScreenCastProducer> &producer : qAsConst(producers)) {
+        // Only used as a key, the producer may be gone by the time this runs
+        ScreenCastProducer *sourceProducer = producer;
+        connect(sourceProducer, &ScreenCastProducer::streamReady, this, [this, sessionPath, sourceProducer] (uint nodeId) {
+            streamReady(sessionPath, sourceProducer, nodeId);
+        });
+        watchProducer(sessionPath, producer);
+
+        QMetaObject::invokeMethod(sourceProducer, "start", Qt::QueuedConnection);
+    }
+
+    return 0;
+}
+
+uint ScreenCastPortal::finishStart(const QString &sessionPath, ScreenCastSession *session, const QStringList &sourceNames,
+                                   const QList<QPointer<ScreenCastProducer>> &producers, const QHash<ScreenCastProducer *, uint> &nodeIds,
+                                   QVariantMap &results)
+{
+    Streams streams;
+    for (int i = 0; i < producers.count(); i++) {
+        const QPointer<ScreenCastProducer> &producer = producers.at(i);
+        const SourceCatalog::Source source = m_catalog->source(sourceNames.at(i));
+
+        session->addStream(nodeIds.value(producer), producer);
+
+        Stream stream;
+        stream.nodeId = nodeIds.value(producer);
+        stream.map = QVariantMap({{QLatin1String("size"), source.geometry.size()},
+                                  {QLatin1String("source_type"), source.type}});
+        if (source.type == Monitor)
+            stream.map.insert(QStringLiteral("position"), source.geometry.topLeft());
+        streams << stream;
+    }
+
+    m_producers.insert(sessionPath, producers);
+    m_nodeIds.insert(sessionPath, nodeIds);
 
-    Stream stream;
-    stream.nodeId = m_stream->nodeId();
-    stream.map = QVariantMap({{QLatin1String("size"), QSize(8, 8)}});
-    QVariant streams = QVariant::fromValue<Streams>({stream});
+    QVariant streamsVariant = QVariant::fromValue<Streams>(streams);
 
-    if (!streams.isValid()) {
+    if (!streamsVariant.isValid()) {
         qCWarning(XdgDesktopPortalTestScreenCast) << "Pipewire stream is not ready to be streamed";
         return 2;
     }
 
-    results.insert(QStringLiteral("streams"), streams);
+    results.insert(QStringLiteral("streams"), streamsVariant);
+
+    // The selection travels with the token, so that sessions can be restored
+    // even when their streams weren't kept or the portal was restarted
+    if (session->persistMode()) {
+        if (session->restoreToken().isEmpty())
+            session->setRestoreToken(QUuid::createUuid().toString());
+
+        RestoreData restoreData;
+        restoreData.vendor = QStringLiteral(RESTORE_DATA_VENDOR);
+        restoreData.version = RESTORE_DATA_VERSION;
+        restoreData.data = QVariantMap({{QStringLiteral("token"), session->restoreToken()},
+                                        {QStringLiteral("sources"), sourceNames},
+                                        {QStringLiteral("types"), session->sourceTypes()},
+                                        {QStringLiteral("multiple"), session->multipleSources()}});
+
+        results.insert(QStringLiteral("persist_mode"), session->persistMode());
+        results.insert(QStringLiteral("restore_data"), QVariant::fromValue<RestoreData>(restoreData));
+    }
 
     return 0;
 }
 
-void ScreenCastPortal::stopStreaming()
+bool ScreenCastPortal::createProducers(const QStringList &sourceNames, QList<QPointer<ScreenCastProducer>> &producers)
 {
-    if (m_streamingEnabled) {
-        m_streamingEnabled = false;
+    for (const QString &name : qAsConst(sourceNames)) {
+        const SourceCatalog::Source source = m_catalog->source(name);
+        if (source.name.isEmpty())
+            continue;
+
+        // Windows are shared as the part of their monitor they cover
+        QSize resolution = source.type == Window ? m_catalog->source(source.monitor).geometry.size() : source.geometry.size();
+        FrameSource *frameSource = nullptr;
+
+        if (qEnvironmentVariableIsSet("XDP_TEST_REPLAY_FILE")) {
+            ReplaySource *replaySource = new ReplaySource();
+            replaySource->setLoop(qgetenv("XDP_TEST_REPLAY_LOOP") == "1");
+
+            if (!replaySource->open(QFile::decodeName(qgetenv("XDP_TEST_REPLAY_FILE")), sizeFromString(qgetenv("XDP_TEST_REPLAY_SIZE")))) {
+                delete replaySource;
+                break;
+            }
+
+            resolution = replaySource->size();
+            frameSource = replaySource;
+        } else if (qEnvironmentVariableIsSet("XDP_TEST_SCENARIO")) {
+            ScenarioContent *scenario = new ScenarioContent(resolution);
+            if (!scenario->load(QFile::decodeName(qgetenv("XDP_TEST_SCENARIO")))) {
+                delete scenario;
+                break;
+            }
 
-        if (m_timer) {
-            m_timer->stop();
-            delete m_timer;
-            m_timer = nullptr;
+            frameSource = new TiledGenerator(scenario);
+        } else if (qgetenv("XDP_TEST_CONTENT") == "desktop") {
+            frameSource = new TiledGenerator(new DesktopContent(resolution));
         }
 
-        if (m_stream) {
-            delete m_stream;
-            m_stream = nullptr;
+        // The stream and its frame timer live in a worker thread, so that neither
+        // frame production nor stream callbacks compete with D-Bus dispatch
+        ScreenCastProducer *producer = new ScreenCastProducer(resolution, frameSource);
+        if (source.type == Window)
+            producer->setCropRegion(source.geometry);
+        m_workers->assign(producer);
+
+        producers << producer;
+    }
+
+    if (producers.isEmpty() || producers.count() != sourceNames.count()) {
+        for (const QPointer<ScreenCastProducer> &producer : qAsConst(producers))
+            producer->deleteLater();
+        producers.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void ScreenCastPortal::streamReady(const QString &sessionPath, ScreenCastProducer *producer, uint nodeId)
+{
+    if (!m_pendingStarts.contains(sessionPath))
+        return;
+
+    PendingStart &pending = m_pendingStarts[sessionPath];
+    pending.nodeIds.insert(producer, nodeId);
+    if (pending.nodeIds.count() == pending.producers.count())
+        finishPendingStart(sessionPath, true);
+}
+
+void ScreenCastPortal::finishPendingStart(const QString &sessionPath, bool ready)
+{
+    const PendingStart pending = m_pendingStarts.take(sessionPath);
+    delete pending.timeout;
+
+    ScreenCastSession *session = qobject_cast<ScreenCastSession*>(Session::getSession(sessionPath));
+    bool usable = ready && session;
+    for (const QPointer<ScreenCastProducer> &producer : pending.producers)
+        usable = usable && producer && !producer->isStopped();
+
+    uint response = 2;
+    QVariantMap results;
+
+    if (usable) {
+        response = finishStart(sessionPath, session, pending.sources, pending.producers, pending.nodeIds, results);
+    } else {
+        qCWarning(XdgDesktopPortalTestScreenCast) << "Only" << pending.nodeIds.count() << "of" << pending.producers.count() << "streams got ready";
+        for (const QPointer<ScreenCastProducer> &producer : pending.producers) {
+            if (producer)
+                producer->deleteLater();
         }
+    }
+
+    QDBusConnection::sessionBus().send(pending.message.createReply({ response, results }));
+}
+
+void ScreenCastPortal::stopStreaming(const QString &sessionPath, ScreenCastSession *session)
+{
+    // Closed before its streams got ready, Start() fails
+    if (m_pendingStarts.contains(sessionPath)) {
+        finishPendingStart(sessionPath, false);
+        return;
+    }
+
+    const QList<QPointer<ScreenCastProducer>> producers = m_producers.take(sessionPath);
+    const QHash<ScreenCastProducer *, uint> nodeIds = m_nodeIds.take(sessionPath);
+
+    if (session) {
+        for (uint nodeId : nodeIds)
+            session->removeStream(nodeId);
+    }
+
+    // Streams of persistent sessions stay around, paused, for the session to be restored
+    if (session && session->persistMode() && !session->restoreToken().isEmpty() && m_warmLimit > 0 && !producers.isEmpty()) {
+        parkProducers(WarmKey(session->appId(), session->restoreToken()), session->sources(), producers, nodeIds);
+        return;
+    }
+
+    for (const QPointer<ScreenCastProducer> &producer : producers) {
+        if (producer)
+            producer->deleteLater();
+    }
+}
 
-        m_frameCounter = 0;
+void ScreenCastPortal::parkProducers(const WarmKey &key, const QStringList &sources, const QList<QPointer<ScreenCastProducer>> &producers,
+                                     const QHash<ScreenCastProducer *, uint> &nodeIds)
+{
+    dropWarmSession(key);
+
+    WarmSession warm;
+    warm.sources = sources;
+    warm.producers = producers;
+    warm.nodeIds = nodeIds;
+    warm.expiry = new QTimer(this);
+    warm.expiry->setSingleShot(true);
+    connect(warm.expiry, &QTimer::timeout, this, [this, key] () {
+        dropWarmSession(key);
+    });
+    warm.expiry->start(m_warmTimeout * 1000);
+
+    for (const QPointer<ScreenCastProducer> &producer : producers) {
+        if (!producer)
+            continue;
+
+        // A stream failing while parked can't be restored anymore
+        disconnect(producer, &ScreenCastProducer::stopped, this, nullptr);
+        connect(producer, &ScreenCastProducer::stopped, this, [this, key] () {
+            dropWarmSession(key);
+        });
+    }
+
+    m_warmSessions.insert(key, warm);
+    m_warmOrder << key;
+
+    while (m_warmOrder.count() > m_warmLimit)
+        dropWarmSession(m_warmOrder.first());
+}
+
+QList<QPointer<ScreenCastProducer>> ScreenCastPortal::takeWarmProducers(const WarmKey &key, const QStringList &sources, QHash<ScreenCastProducer *, uint> &nodeIds)
+{
+    if (key.second.isEmpty() || !m_warmSessions.contains(key))
+        return {};
+
+    // Only the very same selection gets the streams
+    const WarmSession &warm = m_warmSessions[key];
+    bool usable = warm.sources == sources;
+    for (const QPointer<ScreenCastProducer> &producer : warm.producers)
+        usable = usable && producer && warm.nodeIds.contains(producer);
+
+    if (!usable) {
+        dropWarmSession(key);
+        return {};
     }
+
+    const QList<QPointer<ScreenCastProducer>> producers = warm.producers;
+    for (const QPointer<ScreenCastProducer> &producer : producers)
+        disconnect(producer, &ScreenCastProducer::stopped, this, nullptr);
+    nodeIds = warm.nodeIds;
+
+    delete warm.expiry;
+    m_warmSessions.remove(key);
+    m_warmOrder.removeAll(key);
+
+    return producers;
+}
+
+void ScreenCastPortal::dropWarmSession(const WarmKey &key)
+{
+    if (!m_warmSessions.contains(key))
+        return;
+
+    const WarmSession warm = m_warmSessions.take(key);
+    m_warmOrder.removeAll(key);
+
+    delete warm.expiry;
+    for (const QPointer<ScreenCastProducer> &producer : warm.producers) {
+        if (producer)
+            producer->deleteLater();
+    }
+}
+
+void ScreenCastPortal::watchProducer(const QString &sessionPath, const QPointer<ScreenCastProducer> &producer)
+{
+    disconnect(producer, &ScreenCastProducer::stopped, this, nullptr);
+
+    // Queued from the worker thread, the producer may be gone by then
+    connect(producer, &ScreenCastProducer::stopped, this, [this, sessionPath, producer] () {
+        if (m_pendingStarts.contains(sessionPath))
+            finishPendingStart(sessionPath, false);
+        else
+            stopProducer(sessionPath, producer);
+    });
+}
+
+void ScreenCastPortal::stopProducer(const QString &sessionPath, const QPointer<ScreenCastProducer> &producer)
+{
+    // Producers no longer in the session were already deleted with it
+    if (!producer || !m_producers.value(sessionPath).contains(producer))
+        return;
+
+    // Other sources of the session keep streaming
+    if (ScreenCastSession *session = qobject_cast<ScreenCastSession*>(Session::getSession(sessionPath)))
+        session->removeStream(m_nodeIds.value(sessionPath).value(producer));
+
+    QList<QPointer<ScreenCastProducer>> &producers = m_producers[sessionPath];
+    producers.removeAll(producer);
+    m_nodeIds[sessionPath].remove(producer);
+    if (producers.isEmpty()) {
+        m_producers.remove(sessionPath);
+        m_nodeIds.remove(sessionPath);
+    }
+
+    producer->deleteLater();
+}
+
+ScreenCastPortalControl::ScreenCastPortalControl(ScreenCastPortal *screenCast, QObject *parent)
+    : QDBusAbstractAdaptor(parent)
+    , m_screenCast(screenCast)
+{
+}
+
+QVariantMap ScreenCastPortalControl::GetStatistics() const
+{
+    return QVariantMap {
+        { QStringLiteral("producers"), ScreenCastProducer::count() },
+        { QStringLiteral("streams"), ScreenCastStream::outputStreamCount() },
+        { QStringLiteral("worker-load"), m_screenCast->workerLoad() },
+    };
 }
@@ -22,11 +22,19 @@
 #define XDG_DESKTOP_PORTAL_TEST_SCREENCAST_H
 
 #include <QDBusAbstractAdaptor>
+#include <QDBusMessage>
+#include <QHash>
+#include <QPair>
+#include <QPointer>
+#include <QScopedPointer>
+#include <QStringList>
 
 class QDBusObjectPath;
-class ScreenCastStream;
-class QSize;
 class QTimer;
+class ScreenCastProducer;
+class ScreenCastSession;
+class SourceCatalog;
+class StreamWorkerPool;
 
 class ScreenCastPortal : public QDBusAbstractAdaptor
 {
@@ -34,6 +42,7 @@ class ScreenCastPortal : public QDBusAbstractAdaptor
     Q_CLASSINFO("D-Bus Interface", "org.freedesktop.impl.portal.ScreenCast")
     Q_PROPERTY(uint version READ version)
     Q_PROPERTY(uint AvailableSourceTypes READ AvailableSourceTypes)
+    Q_PROPERTY(uint AvailableCursorModes READ AvailableCursorModes)
 public:
     enum SourceType {
         Any = 0,
@@ -47,17 +56,30 @@ public:
     } Stream;
     typedef QList<Stream> Streams;
 
+    // restore_data of SelectSources and Start, (suv)
+    typedef struct {
+        QString vendor;
+        uint version;
+        QVariant data;
+    } RestoreData;
+
     explicit ScreenCastPortal(QObject *parent);
     ~ScreenCastPortal();
 
-    uint version() const { return 1; }
-    uint AvailableSourceTypes() const { return Any; };
+    uint version() const { return 4; }
+    uint AvailableSourceTypes() const;
+    // Only hidden, frames don't have a cursor
+    uint AvailableCursorModes() const { return 1; }
+
+    // Producers assigned to the worker threads and not destroyed yet
+    int workerLoad() const;
 
 public Q_SLOTS:
     uint CreateSession(const QDBusObjectPath &handle,
                        const QDBusObjectPath &session_handle,
                        const QString &app_id,
                        const QVariantMap &options,
+                       const QDBusMessage &message,
                        QVariantMap &results);
 
     uint SelectSources(const QDBusObjectPath &handle,
@@ -71,18 +93,76 @@ public Q_SLOTS:
                const QString &app_id,
                const QString &parent_window,
                const QVariantMap &options,
+               const QDBusMessage &message,
                QVariantMap &results);
 
-private Q_SLOTS:
-    void stopStreaming();
-
 private:
-    ScreenCastStream *m_stream;
-    QTimer *m_timer;
-    int m_frameCounter = 0;
+    // Streams of a closed persistent session, kept for it to be restored
+    struct WarmSession {
+        QStringList sources;
+        QList<QPointer<ScreenCastProducer>> producers;
+        QHash<ScreenCastProducer *, uint> nodeIds;
+        QTimer *expiry = nullptr;
+    };
+    // App id and restore token, tokens only restore streams of their own application
+    typedef QPair<QString, QString> WarmKey;
+
+    // Start() calls answered once the streams of their session are ready
+    struct PendingStart {
+        QDBusMessage message;
+        QStringList sources;
+        QList<QPointer<ScreenCastProducer>> producers;
+        QHash<ScreenCastProducer *, uint> nodeIds;
+        QTimer *timeout = nullptr;
+    };
+
+    void stopStreaming(const QString &sessionPath, ScreenCastSession *session);
+    void stopProducer(const QString &sessionPath, const QPointer<ScreenCastProducer> &producer);
+    // Fails a pending Start() of the session or removes the stream from the
+    // started session once @producer stopped
+    void watchProducer(const QString &sessionPath, const QPointer<ScreenCastProducer> &producer);
+    // Creates the producers of the sources, their streams aren't started yet
+    bool createProducers(const QStringList &sourceNames, QList<QPointer<ScreenCastProducer>> &producers);
+    void streamReady(const QString &sessionPath, ScreenCastProducer *producer, uint nodeId);
+    void finishPendingStart(const QString &sessionPath, bool ready);
+    uint finishStart(const QString &sessionPath, ScreenCastSession *session, const QStringList &sourceNames,
+                     const QList<QPointer<ScreenCastProducer>> &producers, const QHash<ScreenCastProducer *, uint> &nodeIds,
+                     QVariantMap &results);
+    void parkProducers(const WarmKey &key, const QStringList &sources, const QList<QPointer<ScreenCastProducer>> &producers,
+                       const QHash<ScreenCastProducer *, uint> &nodeIds);
+    QList<QPointer<ScreenCastProducer>> takeWarmProducers(const WarmKey &key, const QStringList &sources, QHash<ScreenCastProducer *, uint> &nodeIds);
+    void dropWarmSession(const WarmKey &key);
+
+    QScopedPointer<SourceCatalog> m_catalog;
+    StreamWorkerPool *m_workers = nullptr;
+    // Producers of started sessions, one per source, keyed by session path
+    QHash<QString, QList<QPointer<ScreenCastProducer>>> m_producers;
+    // Keyed by session path as well
+    QHash<QString, PendingStart> m_pendingStarts;
+    // Node ids the producers of started sessions reported when they got ready,
+    // their streams belong to worker threads
+    QHash<QString, QHash<ScreenCastProducer *, uint>> m_nodeIds;
+
+    // m_warmOrder has the oldest first
+    QHash<WarmKey, WarmSession> m_warmSessions;
+    QList<WarmKey> m_warmOrder;
+    int m_warmLimit = 0;
+    int m_warmTimeout = 0;
+};
 
-    bool m_streamingEnabled;
+// Not part of the portal API, lets tests check what the sessions left behind
+class ScreenCastPortalControl : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.impl.portal.desktop.test.ScreenCastPortalControl")
+public:
+    ScreenCastPortalControl(ScreenCastPortal *screenCast, QObject *parent);
 
+public Q_SLOTS:
+    QVariantMap GetStatistics() const;
+
+private:
+    ScreenCastPortal *m_screenCast;
 };
 
 #endif // XDG_DESKTOP_PORTAL_TEST_SCREENCAST_H
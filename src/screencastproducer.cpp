@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "screencastproducer.h"
+#include "framesource.h"
+#include "screencaststream.h"
+
+#include <QColor>
+#include <QImage>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestScreenCastProducer, "xdp-test-screencast-producer")
+
+// Producers alive, to check that closed sessions don't leave any behind
+static QAtomicInt producers;
+
+ScreenCastProducer::ScreenCastProducer(const QSize &resolution, FrameSource *source, QObject *parent)
+    : QObject(parent)
+    , m_resolution(resolution)
+    , m_source(source)
+{
+    producers.ref();
+}
+
+ScreenCastProducer::~ScreenCastProducer()
+{
+    producers.deref();
+
+    if (m_scheduler)
+        m_scheduler->removeJob(m_job);
+
+    if (m_stream)
+        delete m_stream;
+
+    if (m_source)
+        delete m_source;
+}
+
+QSize ScreenCastProducer::resolution() const
+{
+    return m_resolution;
+}
+
+void ScreenCastProducer::setCropRegion(const QRect &region)
+{
+    m_cropRegion = region;
+}
+
+ScreenCastStream *ScreenCastProducer::stream() const
+{
+    return m_stream;
+}
+
+FrameScheduler::Statistics ScreenCastProducer::scheduling() const
+{
+    if (!m_scheduler)
+        return FrameScheduler::Statistics();
+
+    return m_scheduler->statistics(m_job);
+}
+
+bool ScreenCastProducer::isStopped() const
+{
+    return m_stopped.load();
+}
+
+int ScreenCastProducer::count()
+{
+    return producers.load();
+}
+
+void ScreenCastProducer::start()
+{
+    // Everything below has to be created in the worker thread we were moved to
+    m_stream = new ScreenCastStream(m_resolution, this);
+    m_stream->setCropRegion(m_cropRegion);
+    m_stream->init();
+
+    // Frames of all streams of this worker are produced by its scheduler
+    m_scheduler = FrameScheduler::instance();
+    m_job = m_scheduler->addJob([this] () {
+        produceFrame();
+    });
+    m_scheduler->setInterval(m_job, 2000000000);
+
+    connect(m_stream, &ScreenCastStream::streamReady, this, &ScreenCastProducer::streamReady);
+
+    connect(m_stream, &ScreenCastStream::startStreaming, this, [this] () {
+        m_streamingEnabled = true;
+        updateInterval();
+        m_scheduler->start(m_job);
+
+        // Everything was kept around while paused, don't make the consumer
+        // wait a whole frame interval for the first frame after resuming
+        if (m_stream->isSuspended()) {
+            m_stream->resume();
+            produceFrame();
+        }
+    });
+
+    connect(m_stream, &ScreenCastStream::pauseStreaming, this, [this] () {
+        if (!m_streamingEnabled)
+            return;
+
+        m_scheduler->stop(m_job);
+        m_stream->suspend(qgetenv("XDP_TEST_PAUSE_RELEASE") == "1");
+    });
+
+    connect(m_stream, &ScreenCastStream::stopStreaming, this, &ScreenCastProducer::stopStreaming);
+
+    // Once a specific framerate was asked for, even the test pattern is
+    // produced at it, so that it can be used for measurements
+    connect(m_stream, &ScreenCastStream::renegotiated, this, [this] () {
+        m_followFramerate = true;
+        updateInterval();
+    });
+}
+
+void ScreenCastProducer::updateInterval()
+{
+    // Real content is produced at the rate the consumer asked for, the test
+    // pattern slowly enough for tests to check every single frame
+    uint framerate = (m_source || m_followFramerate) ? m_stream->framerate() : 0;
+
+    // Recordings play at the rate they were recorded at, but never faster
+    // than the consumer takes frames
+    if (m_source && m_source->frameRate())
+        framerate = framerate ? qMin(framerate, m_source->frameRate()) : m_source->frameRate();
+
+    if (framerate)
+        m_scheduler->setInterval(m_job, 1000000000 / framerate);
+}
+
+void ScreenCastProducer::produceFrame()
+{
+    if (!m_stream)
+        return;
+
+    if (m_source) {
+        if (m_stream->writeFrame(m_source))
+            return;
+
+        if (m_source->atEnd()) {
+            qCDebug(XdgDesktopPortalTestScreenCastProducer) << "Frame source finished, no more frames to publish";
+            m_scheduler->stop(m_job);
+        } else {
+            qCWarning(XdgDesktopPortalTestScreenCastProducer) << "Failed to write frame";
+        }
+        return;
+    }
+
+    QImage capture = QImage(m_resolution, QImage::Format_RGBA8888);
+    switch (m_frameCounter) {
+        case 0:
+            capture.fill(QColor("red"));
+            break;
+        case 1:
+            capture.fill(QColor("green"));
+            break;
+        case 2:
+            capture.fill(QColor("blue"));
+            break;
+        default:
+            capture.fill(QColor("black"));
+    }
+    m_frameCounter++;
+    if (!m_stream->writeFrame(capture.bits()))
+        qCWarning(XdgDesktopPortalTestScreenCastProducer) << "Failed to write frame";
+}
+
+void ScreenCastProducer::stopStreaming()
+{
+    if (m_streamingEnabled) {
+        m_streamingEnabled = false;
+        m_scheduler->stop(m_job);
+        m_stopped.store(1);
+        Q_EMIT stopped();
+    }
+}
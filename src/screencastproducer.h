@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_SCREENCAST_PRODUCER_H
+#define XDG_DESKTOP_PORTAL_TEST_SCREENCAST_PRODUCER_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QRect>
+#include <QSize>
+
+#include "framescheduler.h"
+
+class FrameSource;
+class ScreenCastStream;
+
+// Owns an output stream together with whatever feeds it. Meant to be moved
+// to a StreamWorkerPool thread, where start() creates the stream and all of
+// its frames get produced.
+class ScreenCastProducer : public QObject
+{
+    Q_OBJECT
+public:
+    // Takes ownership of @source, without one the solid color test pattern is produced
+    explicit ScreenCastProducer(const QSize &resolution, FrameSource *source = nullptr, QObject *parent = nullptr);
+    ~ScreenCastProducer();
+
+    QSize resolution() const;
+    // Has to be set before start(), see ScreenCastStream::setCropRegion()
+    void setCropRegion(const QRect &region);
+    // Only valid once streamReady() was emitted
+    ScreenCastStream *stream() const;
+    // Deadlines of produced frames, has to be called from the producer's thread
+    FrameScheduler::Statistics scheduling() const;
+    // Whether stopped() was emitted, safe to call from any thread
+    bool isStopped() const;
+
+    // Producers alive in the process, safe to call from any thread
+    static int count();
+
+public Q_SLOTS:
+    void start();
+
+Q_SIGNALS:
+    void streamReady(uint nodeId);
+    // The stream went away, the producer should be destroyed
+    void stopped();
+
+private Q_SLOTS:
+    void produceFrame();
+    void stopStreaming();
+
+private:
+    void updateInterval();
+
+    QSize m_resolution;
+    QRect m_cropRegion;
+    FrameSource *m_source = nullptr;
+    ScreenCastStream *m_stream = nullptr;
+    // Scheduler of the worker thread the producer was started in
+    FrameScheduler *m_scheduler = nullptr;
+    int m_job = -1;
+    int m_frameCounter = 0;
+
+    bool m_streamingEnabled = false;
+    bool m_followFramerate = false;
+    QAtomicInt m_stopped;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_SCREENCAST_PRODUCER_H
@@ -19,13 +19,22 @@
  */
 
 #include "screencaststream.h"
+#include "binarylog.h"
+#include "framebufferpool.h"
+#include "framesource.h"
+#include "loopbacktransport.h"
+#include "tracer.h"
 
 #include <limits.h>
 #include <math.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <QLoggingCategory>
+#include <QMutexLocker>
 #include <QSize>
 
 Q_LOGGING_CATEGORY(XdgDesktopPortalTestScreenCastStream, "xdp-test-screencast-stream")
@@ -43,7 +52,47 @@ public:
 
 #define PROP_RANGE(min, max) 2, (min), (max)
 
-#define BITS_PER_PIXEL  4
+// Frames after which the adaptive mode reconsiders the buffer count
+#define ADAPTIVE_WINDOW_FRAMES 60
+// Windows without dropped frames before the buffer count is lowered again
+#define ADAPTIVE_QUIET_WINDOWS 5
+
+// Attached to each pw_buffer through its user_data
+struct BufferInfo {
+    qint64 queuedAt = 0;
+};
+
+// Same clock in producer and consumer processes, so timestamps can be compared
+// Output streams alive, to check that closed sessions don't leave any behind
+static QAtomicInt outputStreams;
+
+static int64_t monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static spa_meta_header *findHeader(ScreenCastStream *stream, spa_buffer *buffer)
+{
+#if PW_CHECK_VERSION(0, 2, 9)
+    Q_UNUSED(stream)
+    return static_cast<spa_meta_header *>(spa_buffer_find_meta_data(buffer, SPA_META_Header, sizeof(spa_meta_header)));
+#else
+    return static_cast<spa_meta_header *>(spa_buffer_find_meta(buffer, stream->core->pwCoreType->meta.Header));
+#endif
+}
+
+static spa_meta_video_crop *findCrop(ScreenCastStream *stream, spa_buffer *buffer)
+{
+#if PW_CHECK_VERSION(0, 2, 9)
+    Q_UNUSED(stream)
+    return static_cast<spa_meta_video_crop *>(spa_buffer_find_meta_data(buffer, SPA_META_VideoCrop, sizeof(spa_meta_video_crop)));
+#else
+    return static_cast<spa_meta_video_crop *>(spa_buffer_find_meta(buffer, stream->core->pwCoreType->meta.VideoCrop));
+#endif
+}
 
 static int greatestCommonDivisor(int a, int b)
 {
@@ -139,60 +188,45 @@ static PwFraction pipewireFractionFromDouble(double src)
     return fraction;
 }
 
-static void onStateChanged(void *data, pw_remote_state old, pw_remote_state state, const char *error)
-{
-    Q_UNUSED(old);
-
-    ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
-
-    switch (state) {
-    case PW_REMOTE_STATE_ERROR:
-        // TODO notify error
-        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Remote error: " << error;
-        break;
-    case PW_REMOTE_STATE_CONNECTED:
-        // TODO notify error
-        qCDebug(XdgDesktopPortalTestScreenCastStream) << "Remote state: " << pw_remote_state_as_string(state);
-        if (!pw->createStream()) {
-            if (pw->streamDirection == ScreenCastStream::DirectionOutput)
-                Q_EMIT pw->stopStreaming();
-        }
-        break;
-    default:
-        qCDebug(XdgDesktopPortalTestScreenCastStream) << "Remote state: " << pw_remote_state_as_string(state);
-        break;
-    }
-}
-
+// Every direction gets its own callback table, Direction is a constant in
+// there and the branches on it are gone once the template is instantiated
+template<ScreenCastStream::StreamDirection Direction>
 static void onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message)
 {
     Q_UNUSED(old)
 
     ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
+    const bool isOutput = Direction == ScreenCastStream::DirectionOutput;
+
+    // Runs on the PipeWire loop, which is no place for qCDebug()
+    if (state != PW_STREAM_STATE_ERROR)
+        BinaryLog::log(BinaryLog::StreamState, pw_stream_state_as_string(state), Direction);
 
     switch (state) {
     case PW_STREAM_STATE_ERROR:
         qCWarning(XdgDesktopPortalTestScreenCastStream) << "Stream error: " << error_message;
         break;
     case PW_STREAM_STATE_CONFIGURE:
-        qCDebug(XdgDesktopPortalTestScreenCastStream) << "Stream state: " << pw_stream_state_as_string(state);
-        if (pw->streamDirection == ScreenCastStream::DirectionOutput)
+        if (isOutput)
             Q_EMIT pw->streamReady((uint)pw_stream_get_node_id(pw->pwStream));
         else
             pw_stream_set_active(pw->pwStream, true);
         break;
     case PW_STREAM_STATE_UNCONNECTED:
     case PW_STREAM_STATE_CONNECTING:
+        if (isOutput) {
+            Q_EMIT pw->stopStreaming();
+        }
+        break;
     case PW_STREAM_STATE_READY:
     case PW_STREAM_STATE_PAUSED:
-        if (pw->streamDirection == ScreenCastStream::DirectionOutput) {
-            qCDebug(XdgDesktopPortalTestScreenCastStream) << "Stream state: " << pw_stream_state_as_string(state);
-            Q_EMIT pw->stopStreaming();
+        // The consumer only paused, keep the node and its format so that it can resume right away
+        if (isOutput) {
+            Q_EMIT pw->pauseStreaming();
         }
         break;
     case PW_STREAM_STATE_STREAMING:
-        if (pw->streamDirection == ScreenCastStream::DirectionOutput) {
-            qCDebug(XdgDesktopPortalTestScreenCastStream) << "Stream state: " << pw_stream_state_as_string(state);
+        if (isOutput) {
             Q_EMIT pw->startStreaming();
         }
         break;
@@ -201,109 +235,72 @@ static void onStreamStateChanged(void *data, pw_stream_state old, pw_stream_stat
 
 static void onStreamFormatChanged(void *data, const struct spa_pod *format)
 {
-    qCDebug(XdgDesktopPortalTestScreenCastStream) << "Stream format changed";
+    TraceScope trace("onStreamFormatChanged");
 
     ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
 
-    uint8_t paramsBuffer[1024];
-    int32_t width, height, stride, size;
-    struct spa_pod_builder pod_builder;
-    const struct spa_pod *params[1];
-    const int bpp = 4;
-
-    if (!format) {
-        pw_stream_finish_format(pw->pwStream, 0, nullptr, 0);
-        return;
-    }
+    pw->formatChanged(format);
+}
 
-#if PW_CHECK_VERSION(0, 2, 9)
-    spa_format_video_raw_parse (format, &pw->videoFormat);
-#else
-    spa_format_video_raw_parse (format, &pw->videoFormat, &pw->pwType->format_video);
-#endif
+// Only input streams have anything to do here, output streams push their
+// frames from writeFrame() and don't register a process callback at all
+static void onInputStreamProcess(void *data)
+{
+    TraceScope trace("onStreamProcess");
+    ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
 
-    width = pw->videoFormat.size.width;
-    height =pw->videoFormat.size.height;
-    stride = SPA_ROUND_UP_N (width * bpp, 4);
-    size = height * stride;
+    pw_buffer *buf;
+    if (!(buf = pw_stream_dequeue_buffer(pw->pwStream)))
+        return;
 
-    pod_builder = SPA_POD_BUILDER_INIT (paramsBuffer, sizeof (paramsBuffer));
+    pw->readFrame(buf);
 
-#if PW_CHECK_VERSION(0, 2, 9)
-    params[0] = (spa_pod*) spa_pod_builder_add_object(&pod_builder,
-                                                   SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                                                   ":", SPA_PARAM_BUFFERS_buffers, "?ri", SPA_CHOICE_RANGE(16, 2, 16),
-                                                   ":", SPA_PARAM_BUFFERS_size, "i", size,
-                                                   ":", SPA_PARAM_BUFFERS_stride, "i", stride,
-                                                   ":", SPA_PARAM_BUFFERS_align, "i", 16);
-    params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&pod_builder,
-                SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                ":", SPA_PARAM_BUFFERS_size, "i", size,
-                ":", SPA_PARAM_BUFFERS_stride, "i", stride,
-                ":", SPA_PARAM_BUFFERS_buffers, "?ri", SPA_CHOICE_RANGE(16, 2, 16),
-                ":", SPA_PARAM_BUFFERS_align, "i", 16));
-    if (pw->streamDirection == ScreenCastStream::DirectionInput) {
-        params[1] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&pod_builder,
-                    SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
-                    ":", SPA_PARAM_META_type, "I", SPA_META_Header,
-                    ":", SPA_PARAM_META_size, "i", sizeof(struct spa_meta_header)));
-    }
-#else
-    params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_object(&pod_builder,
-                pw->pwCoreType->param.idBuffers, pw->pwCoreType->param_buffers.Buffers,
-                ":", pw->pwCoreType->param_buffers.size, "i", size,
-                ":", pw->pwCoreType->param_buffers.stride, "i", stride,
-                ":", pw->pwCoreType->param_buffers.buffers, "iru", 16, SPA_POD_PROP_MIN_MAX(2, 16),
-                ":", pw->pwCoreType->param_buffers.align, "i", 16));
-    if (pw->streamDirection == ScreenCastStream::DirectionInput) {
-        params[1] = reinterpret_cast<spa_pod *>(spa_pod_builder_object(&pod_builder,
-                    pw->pwCoreType->param.idMeta, pw->pwCoreType->param_meta.Meta,
-                    ":", pw->pwCoreType->param_meta.type, "I", pw->pwCoreType->meta.Header,
-                    ":", pw->pwCoreType->param_meta.size, "i", sizeof(struct spa_meta_header)));
-    }
-#endif
-    pw_stream_finish_format (pw->pwStream, 0,
-                             params, pw->streamDirection == ScreenCastStream::DirectionInput ? 2 : 1);
+    pw_stream_queue_buffer(pw->pwStream, buf);
 }
 
-static void onStreamProcess(void *data)
+static void onStreamAddBuffer(void *data, pw_buffer *buffer)
 {
     ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
 
-    if (pw->streamDirection == ScreenCastStream::DirectionInput) {
-        pw_buffer *buf;
-        if (!(buf = pw_stream_dequeue_buffer(pw->pwStream)))
-            return;
+    pw->addBuffer(buffer);
+}
 
-        pw->readFrame(buf);
+static void onStreamRemoveBuffer(void *data, pw_buffer *buffer)
+{
+    ScreenCastStream *pw = static_cast<ScreenCastStream*>(data);
 
-        pw_stream_queue_buffer(pw->pwStream, buf);
-    }
+    pw->removeBuffer(buffer);
 }
 
-static const struct pw_remote_events pwRemoteEvents = {
-    .version = PW_VERSION_REMOTE_EVENTS,
+static const struct pw_stream_events pwOutputStreamEvents = {
+    .version = PW_VERSION_STREAM_EVENTS,
     .destroy = nullptr,
-    .info_changed = nullptr,
-    .sync_reply = nullptr,
-    .state_changed = onStateChanged,
+    .state_changed = onStreamStateChanged<ScreenCastStream::DirectionOutput>,
+    .format_changed = onStreamFormatChanged,
+    .add_buffer = onStreamAddBuffer,
+    .remove_buffer = onStreamRemoveBuffer,
+    .process = nullptr,
 };
 
-static const struct pw_stream_events pwStreamEvents = {
+static const struct pw_stream_events pwInputStreamEvents = {
     .version = PW_VERSION_STREAM_EVENTS,
     .destroy = nullptr,
-    .state_changed = onStreamStateChanged,
+    .state_changed = onStreamStateChanged<ScreenCastStream::DirectionInput>,
     .format_changed = onStreamFormatChanged,
-    .add_buffer = nullptr,
-    .remove_buffer = nullptr,
-    .process = onStreamProcess,
+    .add_buffer = onStreamAddBuffer,
+    .remove_buffer = onStreamRemoveBuffer,
+    .process = onInputStreamProcess,
 };
 
 ScreenCastStream::ScreenCastStream(const QSize &resolution, QObject *parent)
     : QObject(parent)
     , streamDirection(ScreenCastStream::DirectionOutput)
     , resolution(resolution)
+    , buffers(BufferSettings::fromEnvironment())
 {
+    adaptiveBufferCount = buffers.buffers;
+    clock.start();
+    outputStreams.ref();
 }
 
 ScreenCastStream::ScreenCastStream(const QSize &resolution, const QDBusUnixFileDescriptor &fd, uint streamNodeId, QObject *parent)
@@ -312,68 +309,82 @@ ScreenCastStream::ScreenCastStream(const QSize &resolution, const QDBusUnixFileD
     , resolution(resolution)
     , pipewireFd(fd)
     , pwStreamNodeId(streamNodeId)
+    , buffers(BufferSettings::fromEnvironment())
+{
+    fb = FramebufferPool::instance()->acquireImage(resolution, QImage::Format_RGBA8888);
+    adaptiveBufferCount = buffers.buffers;
+    clock.start();
+}
 
+ScreenCastStream::ScreenCastStream(const QSize &resolution, PipeWireCore *core, uint streamNodeId, QObject *parent)
+    : QObject(parent)
+    , core(core)
+    , streamDirection(ScreenCastStream::DirectionInput)
+    , resolution(resolution)
+    , pwStreamNodeId(streamNodeId)
+    , buffers(BufferSettings::fromEnvironment())
 {
-    fb = QImage(resolution, QImage::Format_RGBA8888);
+    fb = FramebufferPool::instance()->acquireImage(resolution, QImage::Format_RGBA8888);
+    adaptiveBufferCount = buffers.buffers;
+    clock.start();
 }
 
 ScreenCastStream::~ScreenCastStream()
 {
-    if (pwMainLoop)
-        pw_thread_loop_stop(pwMainLoop);
+    if (streamDirection == ScreenCastStream::DirectionOutput)
+        outputStreams.deref();
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-    if (pwType)
-        delete pwType;
-#endif
+    if (loopback)
+        loopback->disconnectStream(this);
 
-    if (pwStream)
-        pw_stream_destroy(pwStream);
+    if (!core)
+        return;
+
+    core->detach(this);
 
-    if (pwRemote)
-        pw_remote_destroy(pwRemote);
+    if (ownsCore) {
+        pw_thread_loop_stop(core->pwMainLoop);
 
-    if (pwCore)
-        pw_core_destroy(pwCore);
+        if (pwStream)
+            pw_stream_destroy(pwStream);
 
-    if (pwMainLoop)
-        pw_thread_loop_destroy(pwMainLoop);
+        delete core;
+        return;
+    }
 
-    if (pwLoop)
-        pw_loop_destroy(pwLoop);
+    // Other streams keep using the loop, only take our node off it
+    core->lock();
+    if (pwStream)
+        pw_stream_destroy(pwStream);
+    core->unlock();
 }
 
 void ScreenCastStream::init()
 {
-    pw_init(nullptr, nullptr);
-
-    pwLoop = pw_loop_new(nullptr);
-    pwMainLoop = pw_thread_loop_new(pwLoop, "pipewire-main-loop");
-
-    pwCore = pw_core_new(pwLoop, nullptr);
-#if !PW_CHECK_VERSION(0, 2, 9)
-    pwCoreType = pw_core_get_type(pwCore);
-#endif
-    pwRemote = pw_remote_new(pwCore, nullptr, 0);
+    if (!core) {
+        core = streamDirection == ScreenCastStream::DirectionInput ? new PipeWireCore(pipewireFd) : new PipeWireCore();
+        ownsCore = true;
+    }
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-    initializePwTypes();
-#endif
+    core->attach(this);
+    core->init();
+}
 
-    pw_remote_add_listener(pwRemote, &remoteListener, &pwRemoteEvents, this);
+bool ScreenCastStream::initLoopback(LoopbackTransport *transport)
+{
+    uint8_t buffer[1024];
+    spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-    if (streamDirection == ScreenCastStream::DirectionInput)
-        pw_remote_connect_fd(pwRemote, pipewireFd.fileDescriptor());
-    else
-        pw_remote_connect(pwRemote);
+    // Borrows the unconnected core of the transport for the type map of old PipeWire
+    loopback = transport;
+    core = transport->core();
 
-    if (pw_thread_loop_start(pwMainLoop) < 0)
-        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Failed to start main PipeWire loop";
+    return transport->connectStream(this, buildFormat(&podBuilder));
 }
 
 uint ScreenCastStream::framerate() const
 {
-    if (pwStream)
+    if (hasStream())
         return videoFormat.max_framerate.num / videoFormat.max_framerate.denom;
 
     return 0;
@@ -389,12 +400,18 @@ uint ScreenCastStream::nodeId() const
 
 QImage ScreenCastStream::framebuffer() const
 {
+    QMutexLocker locker(&fbMutex);
     return fb;
 }
 
+int ScreenCastStream::coalescedNotifications() const
+{
+    return coalescedFrames.load();
+}
+
 bool ScreenCastStream::createStream()
 {
-    if (pw_remote_get_state(pwRemote, nullptr) != PW_REMOTE_STATE_CONNECTED) {
+    if (!core->isConnected()) {
         qCWarning(XdgDesktopPortalTestScreenCastStream) << "Cannot create pipewire stream";
         return false;
     }
@@ -402,130 +419,888 @@ bool ScreenCastStream::createStream()
     uint8_t buffer[1024];
     spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-    const float frameRate = 25;
-
-    spa_fraction maxFramerate;
-    spa_fraction minFramerate;
     const spa_pod *params[1];
 
     if (streamDirection == ScreenCastStream::DirectionOutput) {
-        pwStream = pw_stream_new(pwRemote, "xdp-test-screen-cast", nullptr);
+        pwStream = pw_stream_new(core->pwRemote, "xdp-test-screen-cast", nullptr);
     } else {
         auto reuseProps = pw_properties_new("pipewire.client.reuse", "1", nullptr); // null marks end of varargs
-        pwStream = pw_stream_new(pwRemote, "xdp-test-consume-stream", reuseProps);
+        pwStream = pw_stream_new(core->pwRemote, "xdp-test-consume-stream", reuseProps);
     }
 
+    params[0] = buildFormat(&podBuilder);
+
+    const bool isOutput = streamDirection == ScreenCastStream::DirectionOutput;
+
+    pw_stream_add_listener(pwStream, &streamListener, isOutput ? &pwOutputStreamEvents : &pwInputStreamEvents, this);
+
+    auto flags = static_cast<pw_stream_flags>(isOutput ? PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS :
+                                                         PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_INACTIVE | PW_STREAM_FLAG_MAP_BUFFERS);
+
+#if PW_CHECK_VERSION(0, 2, 9)
+    if (pw_stream_connect(pwStream, isOutput ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT, isOutput ? 0 : pwStreamNodeId , flags, params, 1) != 0) {
+#else
+    if (pw_stream_connect(pwStream, isOutput ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT, nullptr, flags, params, 1) != 0) {
+#endif
+        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Could not connect to stream";
+        return false;
+   }
+
+    return true;
+}
+
+const spa_pod *ScreenCastStream::buildFormat(spa_pod_builder *builder) const
+{
+    // Unless asked for something specific we offer anything up to our
+    // resolution and 25 fps, otherwise exactly what was requested
+    const QSize size = requestedSize.isValid() ? requestedSize : resolution;
+    const float frameRate = requestedFramerate ? requestedFramerate : 25;
+
     PwFraction fraction = pipewireFractionFromDouble(frameRate);
 
-    minFramerate = SPA_FRACTION(1, 1);
-    maxFramerate = SPA_FRACTION((uint32_t)fraction.num, (uint32_t)fraction.denom);
+    spa_fraction maxFramerate = SPA_FRACTION((uint32_t)fraction.num, (uint32_t)fraction.denom);
+    spa_fraction minFramerate = requestedFramerate ? maxFramerate : SPA_FRACTION(1, 1);
 
-    spa_rectangle minResolution = SPA_RECTANGLE(1, 1);
-    spa_rectangle maxResolution = SPA_RECTANGLE((uint32_t)resolution.width(), (uint32_t)resolution.height());
+    spa_rectangle maxResolution = SPA_RECTANGLE((uint32_t)size.width(), (uint32_t)size.height());
+    spa_rectangle minResolution = requestedSize.isValid() ? maxResolution : SPA_RECTANGLE(1, 1);
 
     spa_fraction paramFraction = SPA_FRACTION(0, 1);
 
 #if PW_CHECK_VERSION(0, 2, 9)
-    params[0] = (spa_pod*)spa_pod_builder_add_object(&podBuilder,
+    if (streamDirection == ScreenCastStream::DirectionInput) {
+        // Consumers take whatever byte order the producer currently has
+        return (spa_pod*)spa_pod_builder_add_object(builder,
                                         SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
                                         ":", SPA_FORMAT_mediaType, "I", SPA_MEDIA_TYPE_video,
                                         ":", SPA_FORMAT_mediaSubtype, "I", SPA_MEDIA_SUBTYPE_raw,
-                                        ":", SPA_FORMAT_VIDEO_format, "I", SPA_VIDEO_FORMAT_RGBx,
+                                        ":", SPA_FORMAT_VIDEO_format, "?eI", SPA_CHOICE_ENUM(3, SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_BGRx),
+                                        ":", SPA_FORMAT_VIDEO_size, "?rR", SPA_CHOICE_RANGE(&maxResolution, &minResolution, &maxResolution),
+                                        ":", SPA_FORMAT_VIDEO_framerate, "F", &paramFraction,
+                                        ":", SPA_FORMAT_VIDEO_maxFramerate, "?rF", SPA_CHOICE_RANGE(&maxFramerate, &minFramerate, &maxFramerate));
+    }
+
+    return (spa_pod*)spa_pod_builder_add_object(builder,
+                                        SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                                        ":", SPA_FORMAT_mediaType, "I", SPA_MEDIA_TYPE_video,
+                                        ":", SPA_FORMAT_mediaSubtype, "I", SPA_MEDIA_SUBTYPE_raw,
+                                        ":", SPA_FORMAT_VIDEO_format, "I", pixelFormat == FormatBGRx ? SPA_VIDEO_FORMAT_BGRx : SPA_VIDEO_FORMAT_RGBx,
                                         ":", SPA_FORMAT_VIDEO_size, "?rR", SPA_CHOICE_RANGE(&maxResolution, &minResolution, &maxResolution),
                                         ":", SPA_FORMAT_VIDEO_framerate, "F", &paramFraction,
                                         ":", SPA_FORMAT_VIDEO_maxFramerate, "?rF", SPA_CHOICE_RANGE(&maxFramerate, &minFramerate, &maxFramerate));
 #else
-    params[0] = (spa_pod*)spa_pod_builder_object(&podBuilder,
-                                        pwCoreType->param.idEnumFormat, pwCoreType->spa_format,
-                                        "I", pwType->media_type.video,
-                                        "I", pwType->media_subtype.raw,
-                                        ":", pwType->format_video.format, "I", pwType->video_format.RGBx,
-                                        ":", pwType->format_video.size, "Rru", &maxResolution, SPA_POD_PROP_MIN_MAX(&minResolution, &maxResolution),
-                                        ":", pwType->format_video.framerate, "F", &paramFraction,
-                                        ":", pwType->format_video.max_framerate, "Fru", &maxFramerate, PROP_RANGE (&minFramerate, &maxFramerate));
+    if (streamDirection == ScreenCastStream::DirectionInput) {
+        return (spa_pod*)spa_pod_builder_object(builder,
+                                        core->pwCoreType->param.idEnumFormat, core->pwCoreType->spa_format,
+                                        "I", core->pwType->media_type.video,
+                                        "I", core->pwType->media_subtype.raw,
+                                        ":", core->pwType->format_video.format, "Ieu", core->pwType->video_format.RGBx,
+                                                                         SPA_POD_PROP_ENUM(2, core->pwType->video_format.RGBx, core->pwType->video_format.BGRx),
+                                        ":", core->pwType->format_video.size, "Rru", &maxResolution, SPA_POD_PROP_MIN_MAX(&minResolution, &maxResolution),
+                                        ":", core->pwType->format_video.framerate, "F", &paramFraction,
+                                        ":", core->pwType->format_video.max_framerate, "Fru", &maxFramerate, PROP_RANGE (&minFramerate, &maxFramerate));
+    }
+
+    return (spa_pod*)spa_pod_builder_object(builder,
+                                        core->pwCoreType->param.idEnumFormat, core->pwCoreType->spa_format,
+                                        "I", core->pwType->media_type.video,
+                                        "I", core->pwType->media_subtype.raw,
+                                        ":", core->pwType->format_video.format, "I", pixelFormat == FormatBGRx ? core->pwType->video_format.BGRx : core->pwType->video_format.RGBx,
+                                        ":", core->pwType->format_video.size, "Rru", &maxResolution, SPA_POD_PROP_MIN_MAX(&minResolution, &maxResolution),
+                                        ":", core->pwType->format_video.framerate, "F", &paramFraction,
+                                        ":", core->pwType->format_video.max_framerate, "Fru", &maxFramerate, PROP_RANGE (&minFramerate, &maxFramerate));
 #endif
+}
 
-    pw_stream_add_listener(pwStream, &streamListener, &pwStreamEvents, this);
+bool ScreenCastStream::renegotiate(const QSize &size, uint framerate, PixelFormat format)
+{
+    if (streamDirection != ScreenCastStream::DirectionOutput || !hasStream())
+        return false;
 
-    const bool isOutput = streamDirection == ScreenCastStream::DirectionOutput;
+    if (size.isValid() && size.isEmpty())
+        return false;
 
-    auto flags = static_cast<pw_stream_flags>(isOutput ? PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS :
-                                                         PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_INACTIVE | PW_STREAM_FLAG_MAP_BUFFERS);
+    uint8_t buffer[1024];
+    spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod *params[1];
+
+    core->lock();
+
+    if (size.isValid())
+        requestedSize = size;
+    if (framerate)
+        requestedFramerate = framerate;
+    pixelFormat = format;
+
+    params[0] = buildFormat(&podBuilder);
+
+    qCDebug(XdgDesktopPortalTestScreenCastStream) << "Renegotiating stream to" << requestedSize << requestedFramerate << "fps"
+                                                  << (pixelFormat == FormatBGRx ? "BGRx" : "RGBx");
+
+    renegotiationTimer.start();
+    const int result = updateParams(params, 1);
+    if (result < 0)
+        renegotiationTimer.invalidate();
+
+    core->unlock();
+
+    if (result < 0) {
+        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Failed to update stream params:" << strerror(-result);
+        return false;
+    }
+
+    return true;
+}
+
+QSize ScreenCastStream::negotiatedSize() const
+{
+    if (!hasStream())
+        return QSize();
 
+    return QSize(videoFormat.size.width, videoFormat.size.height);
+}
+
+ScreenCastStream::PixelFormat ScreenCastStream::negotiatedFormat() const
+{
 #if PW_CHECK_VERSION(0, 2, 9)
-    if (pw_stream_connect(pwStream, isOutput ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT, isOutput ? 0 : pwStreamNodeId , flags, params, 1) != 0) {
+    return videoFormat.format == SPA_VIDEO_FORMAT_BGRx ? FormatBGRx : FormatRGBx;
 #else
-    if (pw_stream_connect(pwStream, isOutput ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT, nullptr, flags, params, 1) != 0) {
+    return videoFormat.format == core->pwType->video_format.BGRx ? FormatBGRx : FormatRGBx;
 #endif
-        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Could not connect to stream";
+}
+
+ScreenCastStream::BufferSettings ScreenCastStream::BufferSettings::fromEnvironment()
+{
+    BufferSettings settings;
+    bool ok = false;
+
+    int value = qEnvironmentVariableIntValue("XDP_TEST_MIN_BUFFERS", &ok);
+    if (ok && value > 0)
+        settings.minBuffers = value;
+
+    value = qEnvironmentVariableIntValue("XDP_TEST_MAX_BUFFERS", &ok);
+    if (ok && value >= settings.minBuffers)
+        settings.maxBuffers = value;
+
+    value = qEnvironmentVariableIntValue("XDP_TEST_BUFFERS", &ok);
+    settings.buffers = qBound(settings.minBuffers, ok ? value : settings.buffers, settings.maxBuffers);
+
+    const QByteArray align = qgetenv("XDP_TEST_BUFFER_ALIGN");
+    if (align == "page")
+        settings.align = getpagesize();
+    else if (align == "64")
+        settings.align = 64;
+
+    value = qEnvironmentVariableIntValue("XDP_TEST_BUFFER_PADDING", &ok);
+    if (ok && value >= 0)
+        settings.padding = value;
+
+    settings.adaptive = qgetenv("XDP_TEST_ADAPTIVE_BUFFERS") == "1";
+
+    return settings;
+}
+
+ScreenCastStream::BufferSettings ScreenCastStream::bufferSettings() const
+{
+    QMutexLocker locker(&bufferMutex);
+    return buffers;
+}
+
+bool ScreenCastStream::setBufferSettings(const BufferSettings &settings)
+{
+    if (settings.minBuffers < 1 || settings.maxBuffers < settings.minBuffers ||
+        settings.align <= 0 || (settings.align & (settings.align - 1)) || settings.padding < 0)
         return false;
-   }
+
+    {
+        QMutexLocker locker(&bufferMutex);
+        buffers = settings;
+        buffers.buffers = qBound(buffers.minBuffers, buffers.buffers, buffers.maxBuffers);
+        adaptiveBufferCount = buffers.buffers;
+    }
+    quietWindows = 0;
+
+    if (!hasStream() || negotiatedSize().isEmpty())
+        return true;
+
+    return updateBuffersParam();
+}
+
+int ScreenCastStream::bufferCount() const
+{
+    return allocatedBuffers.load();
+}
+
+qint64 ScreenCastStream::bufferMemory() const
+{
+    QMutexLocker locker(&bufferMutex);
+    return qint64(allocatedBuffers.load()) * bufferSize;
+}
+
+int ScreenCastStream::buffersAdded() const
+{
+    return addedBuffers.load();
+}
+
+int ScreenCastStream::buffersRemoved() const
+{
+    return removedBuffers.load();
+}
+
+int ScreenCastStream::dequeueFailures() const
+{
+    return failedDequeues.load();
+}
+
+qint64 ScreenCastStream::bufferRoundTrip() const
+{
+    return averageRoundTrip.load();
+}
+
+QRect ScreenCastStream::cropRegion() const
+{
+    QMutexLocker locker(&cropMutex);
+    return crop;
+}
+
+void ScreenCastStream::setCropRegion(const QRect &region)
+{
+    QMutexLocker locker(&cropMutex);
+    crop = region.intersected(QRect(QPoint(0, 0), resolution));
+}
+
+QRect ScreenCastStream::negotiatedCropRegion() const
+{
+    const QRect region = cropRegion();
+    const QSize size = negotiatedSize();
+    if (region.isEmpty() || size.isEmpty())
+        return QRect(QPoint(0, 0), size);
+
+    if (size == resolution)
+        return region;
+
+    // The region is given in our resolution, follow the consumer's scaling
+    const QRect scaled(region.x() * size.width() / resolution.width(), region.y() * size.height() / resolution.height(),
+                       region.width() * size.width() / resolution.width(), region.height() * size.height() / resolution.height());
+    return scaled.intersected(QRect(QPoint(0, 0), size));
+}
+
+int ScreenCastStream::framesProduced() const
+{
+    return producedFrames.load();
+}
+
+int ScreenCastStream::framesReceived() const
+{
+    return receivedFrames.load();
+}
+
+int ScreenCastStream::framesDropped() const
+{
+    return droppedFrames.load();
+}
+
+const LatencyHistogram &ScreenCastStream::frameLatency() const
+{
+    return latency;
+}
+
+const spa_pod *ScreenCastStream::buildBuffersParam(spa_pod_builder *builder)
+{
+    const int pageSize = getpagesize();
+
+    QMutexLocker locker(&bufferMutex);
+    const int align = buffers.align;
+
+    // Lines start on cache lines at most, page aligned lines would only waste memory
+    bufferStride = SPA_ROUND_UP_N(videoFormat.size.width * FrameScaler::BytesPerPixel, qBound(4, align, 64));
+    bufferSize = bufferStride * videoFormat.size.height + buffers.padding;
+    if (align >= pageSize)
+        bufferSize = SPA_ROUND_UP_N(bufferSize, pageSize);
+    currentLayout.stride = bufferStride;
+
+    // Adaptive mode pins the count, otherwise PipeWire picks from the range
+    const int count = buffers.adaptive ? adaptiveBufferCount : buffers.buffers;
+    const int minCount = buffers.adaptive ? count : buffers.minBuffers;
+    const int maxCount = buffers.adaptive ? count : buffers.maxBuffers;
+    const int size = bufferSize;
+    const int stride = bufferStride;
+    locker.unlock();
+
+#if PW_CHECK_VERSION(0, 2, 9)
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                ":", SPA_PARAM_BUFFERS_size, "i", size,
+                ":", SPA_PARAM_BUFFERS_stride, "i", stride,
+                ":", SPA_PARAM_BUFFERS_buffers, "?ri", SPA_CHOICE_RANGE(count, minCount, maxCount),
+                ":", SPA_PARAM_BUFFERS_align, "i", align));
+#else
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_object(builder,
+                core->pwCoreType->param.idBuffers, core->pwCoreType->param_buffers.Buffers,
+                ":", core->pwCoreType->param_buffers.size, "i", size,
+                ":", core->pwCoreType->param_buffers.stride, "i", stride,
+                ":", core->pwCoreType->param_buffers.buffers, "iru", count, SPA_POD_PROP_MIN_MAX(minCount, maxCount),
+                ":", core->pwCoreType->param_buffers.align, "i", align));
+#endif
+}
+
+const spa_pod *ScreenCastStream::buildMetaParam(spa_pod_builder *builder)
+{
+    // Producers stamp every frame with a sequence number and the time it was
+    // queued at, consumers use it to find out about latency and dropped frames
+#if PW_CHECK_VERSION(0, 2, 9)
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                ":", SPA_PARAM_META_type, "I", SPA_META_Header,
+                ":", SPA_PARAM_META_size, "i", sizeof(struct spa_meta_header)));
+#else
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_object(builder,
+                core->pwCoreType->param.idMeta, core->pwCoreType->param_meta.Meta,
+                ":", core->pwCoreType->param_meta.type, "I", core->pwCoreType->meta.Header,
+                ":", core->pwCoreType->param_meta.size, "i", sizeof(struct spa_meta_header)));
+#endif
+}
+
+const spa_pod *ScreenCastStream::buildCropParam(spa_pod_builder *builder)
+{
+    // Windows and regions are shared as the whole monitor plus the part of it
+    // the consumer should show, we never copy the part out ourselves
+#if PW_CHECK_VERSION(0, 2, 9)
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                ":", SPA_PARAM_META_type, "I", SPA_META_VideoCrop,
+                ":", SPA_PARAM_META_size, "i", sizeof(struct spa_meta_video_crop)));
+#else
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_object(builder,
+                core->pwCoreType->param.idMeta, core->pwCoreType->param_meta.Meta,
+                ":", core->pwCoreType->param_meta.type, "I", core->pwCoreType->meta.VideoCrop,
+                ":", core->pwCoreType->param_meta.size, "i", sizeof(struct spa_meta_video_crop)));
+#endif
+}
+
+void ScreenCastStream::addBuffer(pw_buffer *buffer)
+{
+    buffer->user_data = new BufferInfo();
+    allocatedBuffers.ref();
+    addedBuffers.ref();
+    bufferGeneration.ref();
+}
+
+void ScreenCastStream::removeBuffer(pw_buffer *buffer)
+{
+    delete static_cast<BufferInfo *>(buffer->user_data);
+    buffer->user_data = nullptr;
+    allocatedBuffers.deref();
+    removedBuffers.ref();
+    bufferGeneration.ref();
+}
+
+bool ScreenCastStream::updateBuffersParam()
+{
+    uint8_t buffer[1024];
+    spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod *params[4];
+
+    core->lock();
+
+    // Transports only passing the format on send the buffers with the next format change
+    buffersParamChanged = true;
+    params[0] = buildFormat(&podBuilder);
+    params[1] = buildBuffersParam(&podBuilder);
+    params[2] = buildMetaParam(&podBuilder);
+    params[3] = buildCropParam(&podBuilder);
+
+    const int result = updateParams(params, 4);
+
+    core->unlock();
+
+    if (result < 0) {
+        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Failed to update buffer params:" << strerror(-result);
+        return false;
+    }
 
     return true;
 }
 
+void ScreenCastStream::adaptBufferCount()
+{
+    QMutexLocker locker(&bufferMutex);
+
+    if (!buffers.adaptive || ++windowFrames < ADAPTIVE_WINDOW_FRAMES)
+        return;
+
+    const int delivered = windowFrames - windowFailures;
+    const qint64 roundTrip = delivered > 0 ? windowRoundTrip / delivered / 1000 : 0;
+    const qint64 frameInterval = framerate() ? 1000000 / framerate() : 40000;
+    averageRoundTrip.store(roundTrip);
+
+    int count = adaptiveBufferCount;
+
+    if (windowFailures > 0) {
+        // Running out of buffers means dropped frames, trade memory for them right away
+        count += windowFailures;
+        quietWindows = 0;
+    } else {
+        // Buffers the consumer holds at a time, plus the one we are writing into
+        const int needed = int(roundTrip / frameInterval) + 2;
+        if (needed < count && ++quietWindows >= ADAPTIVE_QUIET_WINDOWS) {
+            count--;
+            quietWindows = 0;
+        }
+    }
+
+    count = qBound(buffers.minBuffers, count, buffers.maxBuffers);
+
+    windowFrames = 0;
+    windowFailures = 0;
+    windowRoundTrip = 0;
+
+    if (count == adaptiveBufferCount)
+        return;
+
+    BinaryLog::log(BinaryLog::BufferCountAdapted, adaptiveBufferCount, count, roundTrip);
+
+    adaptiveBufferCount = count;
+    // Building the param takes the lock again, from the PipeWire thread's side
+    locker.unlock();
+    updateBuffersParam();
+}
+
+pw_buffer *ScreenCastStream::dequeueBuffer()
+{
+    TraceScope trace("pw_stream_dequeue_buffer");
+    pw_buffer *buffer = loopback ? loopback->dequeueBuffer(this) : pw_stream_dequeue_buffer(pwStream);
+
+    if (!buffer) {
+        failedDequeues.ref();
+        windowFailures++;
+        adaptBufferCount();
+        return nullptr;
+    }
+
+    BufferInfo *info = static_cast<BufferInfo *>(buffer->user_data);
+    if (info && info->queuedAt)
+        windowRoundTrip += clock.nsecsElapsed() - info->queuedAt;
+
+    return buffer;
+}
+
+void ScreenCastStream::queueBuffer(pw_buffer *buffer)
+{
+    TraceScope trace("queueBuffer");
+
+    BufferInfo *info = static_cast<BufferInfo *>(buffer->user_data);
+    if (info)
+        info->queuedAt = clock.nsecsElapsed();
+
+    // Buffers without a frame don't count as produced
+    if (buffer->buffer->datas[0].chunk->size) {
+        const int sequence = producedFrames.load();
+        trace.setArgument(sequence);
+        if (spa_meta_header *header = findHeader(this, buffer->buffer)) {
+            header->flags = 0;
+            header->seq = sequence;
+            header->pts = monotonicTime();
+            header->dts_offset = 0;
+        }
+        producedFrames.ref();
+
+        if (spa_meta_video_crop *crop = findCrop(this, buffer->buffer)) {
+            const QRect region = negotiatedCropRegion();
+            crop->x = region.x();
+            crop->y = region.y();
+            crop->width = region.width();
+            crop->height = region.height();
+        }
+    }
+
+    if (loopback)
+        loopback->queueBuffer(this, buffer);
+    else
+        pw_stream_queue_buffer(pwStream, buffer);
+    adaptBufferCount();
+
+    if (resumeTimer.isValid()) {
+        lastResumeLatency = resumeTimer.nsecsElapsed() / 1000;
+        resumeTimer.invalidate();
+        BinaryLog::log(BinaryLog::FirstFrameResumed, lastResumeLatency);
+    }
+}
+
+void ScreenCastStream::suspend(bool releaseMemory)
+{
+    if (suspended)
+        return;
+
+    suspended = true;
+    releasedMemory = releaseMemory;
+
+    if (releaseMemory) {
+        // Our scaling scratch buffer is recreated on the next frame, PipeWire
+        // buffers are shrunk to the minimal count until we resume
+        sourceFrame = QByteArray();
+
+        if (hasStream() && !negotiatedSize().isEmpty()) {
+            {
+                QMutexLocker locker(&bufferMutex);
+                savedAdaptive = buffers.adaptive;
+                savedBufferCount = adaptiveBufferCount;
+                // Pinning the count is what the adaptive mode does as well
+                buffers.adaptive = true;
+                adaptiveBufferCount = buffers.minBuffers;
+            }
+            updateBuffersParam();
+        }
+    }
+
+    qCDebug(XdgDesktopPortalTestScreenCastStream) << "Stream suspended, keeping" << idleMemory() << "bytes";
+}
+
+void ScreenCastStream::resume()
+{
+    if (!suspended)
+        return;
+
+    suspended = false;
+
+    if (releasedMemory) {
+        releasedMemory = false;
+        {
+            QMutexLocker locker(&bufferMutex);
+            buffers.adaptive = savedAdaptive;
+            adaptiveBufferCount = savedBufferCount;
+        }
+        if (hasStream() && !negotiatedSize().isEmpty())
+            updateBuffersParam();
+    }
+
+    resumeTimer.start();
+}
+
+bool ScreenCastStream::isSuspended() const
+{
+    return suspended;
+}
+
+qint64 ScreenCastStream::idleMemory() const
+{
+    if (!suspended)
+        return 0;
+
+    return bufferMemory() + sourceFrame.capacity();
+}
+
+qint64 ScreenCastStream::resumeLatency() const
+{
+    return lastResumeLatency;
+}
+
+int ScreenCastStream::outputStreamCount()
+{
+    return outputStreams.load();
+}
+
+ScreenCastStream::FrameLayout ScreenCastStream::frameLayout() const
+{
+    QMutexLocker locker(&bufferMutex);
+    return currentLayout;
+}
+
+uint8_t *ScreenCastStream::bufferData(pw_buffer *buffer, const FrameLayout &layout)
+{
+    spa_data &data = buffer->buffer->datas[0];
+
+    // Buffers of the previous allocation may still come back while the new
+    // ones are on their way, those are handed back empty instead of being
+    // written past their end. Buffers we don't queue again are gone for good.
+    if (data.data && size_t(layout.stride) * layout.size.height() <= data.maxsize)
+        return static_cast<uint8_t *>(data.data);
+
+    data.chunk->size = 0;
+    queueBuffer(buffer);
+    return nullptr;
+}
+
 bool ScreenCastStream::writeFrame(uint8_t *screenData)
 {
+    TraceScope trace("writeFrame");
     struct pw_buffer *buffer;
     struct spa_buffer *spa_buffer;
     uint8_t *data = nullptr;
 
-    if (!(buffer = pw_stream_dequeue_buffer(pwStream)))
+    // Renegotiation happens on the PipeWire thread, stick to what we start with
+    const FrameLayout layout = frameLayout();
+    const QSize negotiatedSize = layout.size;
+    const int stride = layout.stride;
+
+    // The consumer may pick anything between 1x1 and our resolution, and it may
+    // change its mind mid-stream, scale whatever we have to what it asked for
+    if (!scaler.configure(resolution, negotiatedSize))
+        return false;
+
+    if (!(buffer = dequeueBuffer()))
         return false;
 
     spa_buffer = buffer->buffer;
 
-    if (!(data = (uint8_t *) spa_buffer->datas[0].data))
+    if (!(data = bufferData(buffer, layout)))
         return false;
 
-    memcpy(data, screenData, BITS_PER_PIXEL * videoFormat.size.height * videoFormat.size.width * sizeof(uint8_t));
+    {
+        TraceScope trace("scale");
+        scaler.scale(screenData, resolution.width() * FrameScaler::BytesPerPixel, data, stride);
+        if (layout.format == FormatBGRx)
+            FrameScaler::swapRedBlue(data, stride, negotiatedSize);
+    }
 
-    spa_buffer->datas[0].chunk->size = spa_buffer->datas[0].maxsize;
+    spa_buffer->datas[0].chunk->size = stride * negotiatedSize.height();
+    spa_buffer->datas[0].chunk->stride = stride;
 
-    pw_stream_queue_buffer(pwStream, buffer);
+    queueBuffer(buffer);
+    return true;
+}
+
+bool ScreenCastStream::writeFrame(FrameSource *source)
+{
+    TraceScope trace("writeFrame");
+    struct pw_buffer *buffer;
+    struct spa_buffer *spa_buffer;
+    uint8_t *data = nullptr;
+
+    // Renegotiation happens on the PipeWire thread, stick to what we start with
+    const FrameLayout layout = frameLayout();
+    const QSize sourceSize = source->size();
+    const QSize negotiatedSize = layout.size;
+    const int stride = layout.stride;
+    const bool needsScaling = sourceSize != negotiatedSize;
+    const bool bgrx = layout.format == FormatBGRx;
+
+    // Sources redrawing only what changed rely on buffers keeping their contents
+    const int generation = bufferGeneration.load();
+    if (generation != sourceBufferGeneration) {
+        sourceBufferGeneration = generation;
+        source->invalidate();
+    }
+
+    // Scaled frames get their channels swapped after scaling
+    const bool sourceSwaps = source->setSwapRedBlue(bgrx && !needsScaling);
+
+    if (needsScaling && !scaler.configure(sourceSize, negotiatedSize))
+        return false;
+
+    // Sources move on with every frame they render, so a frame is only
+    // rendered once there is a buffer to put it into
+    if (!(buffer = dequeueBuffer()))
+        return false;
+
+    spa_buffer = buffer->buffer;
+
+    if (!(data = bufferData(buffer, layout)))
+        return false;
+
+    bool rendered;
+    if (needsScaling) {
+        // Only reallocated when the source size changes
+        const int sourceFrameSize = sourceSize.width() * sourceSize.height() * FrameScaler::BytesPerPixel;
+        if (sourceFrame.size() != sourceFrameSize) {
+            sourceFrame.resize(sourceFrameSize);
+            source->invalidate();
+        }
+
+        {
+            TraceScope renderTrace("renderFrame");
+            rendered = source->renderFrame(reinterpret_cast<uint8_t *>(sourceFrame.data()), sourceSize.width() * FrameScaler::BytesPerPixel);
+        }
+
+        if (rendered) {
+            TraceScope scaleTrace("scale");
+            scaler.scale(reinterpret_cast<const uint8_t *>(sourceFrame.constData()), sourceSize.width() * FrameScaler::BytesPerPixel, data, stride);
+        }
+    } else {
+        // Render straight into the buffer, there is no intermediate copy of the frame
+        TraceScope renderTrace("renderFrame");
+        rendered = source->renderFrame(data, stride);
+    }
+
+    if (!rendered) {
+        spa_buffer->datas[0].chunk->size = 0;
+        queueBuffer(buffer);
+        return false;
+    }
+
+    if (bgrx && (needsScaling || !sourceSwaps)) {
+        TraceScope swapTrace("swapRedBlue");
+        FrameScaler::swapRedBlue(data, stride, negotiatedSize);
+    }
+
+    spa_buffer->datas[0].chunk->size = stride * negotiatedSize.height();
+    spa_buffer->datas[0].chunk->stride = stride;
+
+    queueBuffer(buffer);
     return true;
 }
 
 bool ScreenCastStream::readFrame(pw_buffer *pwBuffer)
 {
+    TraceScope trace("readFrame");
     auto *spaBuffer = pwBuffer->buffer;
-    void *src = nullptr;
+    uint8_t *src = nullptr;
 
-    src = spaBuffer->datas[0].data;
+    src = static_cast<uint8_t *>(spaBuffer->datas[0].data);
     if (!src)
         return false;
 
-    quint32 maxSize = spaBuffer->datas[0].maxsize;
+    if (spa_meta_header *header = findHeader(this, spaBuffer)) {
+        if (header->pts > 0)
+            latency.record((monotonicTime() - header->pts) / 1000);
+
+        // Gaps in the sequence are frames the producer queued but we never got
+        if (receivedFrames.load() && header->seq > lastSequence + 1)
+            droppedFrames.fetchAndAddRelaxed(header->seq - lastSequence - 1);
+        lastSequence = header->seq;
+        trace.setArgument(header->seq);
+    }
+    receivedFrames.ref();
+
+    const QSize negotiatedSize(videoFormat.size.width, videoFormat.size.height);
+    const qint32 lineBytes = negotiatedSize.width() * FrameScaler::BytesPerPixel;
     qint32 srcStride = spaBuffer->datas[0].chunk->stride;
-    if (srcStride != resolution.width() * 4) {
-        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Got buffer with stride different from screen stride" << srcStride << "!=" << resolution.width() * 4;
+    if (srcStride < lineBytes) {
+        qCWarning(XdgDesktopPortalTestScreenCastStream) << "Got buffer with stride smaller than the negotiated width" << srcStride << "<" << lineBytes;
         return false;
     }
 
-    memcpy(fb.bits(), src, maxSize);
-    Q_EMIT framebufferUpdated();
+    // Only the part of the frame the producer wants us to show ends up in the framebuffer
+    QRect region(QPoint(0, 0), negotiatedSize);
+    if (spa_meta_video_crop *cropMeta = findCrop(this, spaBuffer)) {
+        const QRect cropRegion(cropMeta->x, cropMeta->y, cropMeta->width, cropMeta->height);
+        if (!cropRegion.isEmpty() && region.contains(cropRegion))
+            region = cropRegion;
+    }
+    {
+        QMutexLocker locker(&cropMutex);
+        crop = region;
+    }
+
+    // Format_RGB32 is BGRx in memory on little endian
+    const QImage::Format imageFormat = negotiatedFormat() == FormatBGRx ? QImage::Format_RGB32 : QImage::Format_RGBA8888;
+    // Writing into an image somebody still holds would detach it into a copy,
+    // a fresh one from the pool is cheaper. The previous framebuffer goes back
+    // to the pool as soon as nobody uses it.
+    if (backFb.size() != region.size() || backFb.format() != imageFormat || !backFb.isDetached())
+        backFb = FramebufferPool::instance()->acquireImage(region.size(), imageFormat);
+
+    {
+        TraceScope copyTrace("copyRect");
+        FrameScaler::copyRect(src, srcStride, region, backFb.bits(), backFb.bytesPerLine());
+    }
+
+    publishFramebuffer();
     return true;
 }
 
-void ScreenCastStream::removeStream()
+void ScreenCastStream::publishFramebuffer()
 {
-    // FIXME destroying streams seems to be crashing, Mutter also doesn't remove them, maybe Pipewire does this automatically
-    // pw_stream_destroy(pwStream);
-    // pwStream = nullptr;
-    pw_stream_disconnect(pwStream);
+    {
+        QMutexLocker locker(&fbMutex);
+        fb.swap(backFb);
+    }
+
+    // One wake-up is enough however many frames arrive until it is handled,
+    // the receiver only ever looks at the newest one
+    if (!notificationPending.testAndSetAcquire(0, 1)) {
+        coalescedFrames.ref();
+        return;
+    }
+
+    QMetaObject::invokeMethod(this, [this] () {
+        notificationPending.storeRelease(0);
+        Q_EMIT framebufferUpdated();
+    }, Qt::QueuedConnection);
 }
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-void ScreenCastStream::initializePwTypes()
+void ScreenCastStream::formatChanged(const spa_pod *format)
 {
-    // raw C-like ScreenCastStream type map
-    auto map = pwCoreType->map;
+    uint8_t paramsBuffer[1024];
+    int32_t width, height;
+    struct spa_pod_builder pod_builder;
+    const struct spa_pod *params[3];
 
-    pwType = new PwType();
+    if (!format) {
+        finishFormat(nullptr, 0);
+        return;
+    }
 
-    spa_type_media_type_map(map, &pwType->media_type);
-    spa_type_media_subtype_map(map, &pwType->media_subtype);
-    spa_type_format_video_map (map, &pwType->format_video);
-    spa_type_video_format_map (map, &pwType->video_format);
-}
+#if PW_CHECK_VERSION(0, 2, 9)
+    spa_format_video_raw_parse (format, &videoFormat);
+#else
+    spa_format_video_raw_parse (format, &videoFormat, &core->pwType->format_video);
 #endif
+
+    width = videoFormat.size.width;
+    height = videoFormat.size.height;
+
+    // Frames are scaled to the new size on the next write, the session keeps going.
+    // Our own frame storage follows the size lazily.
+    BinaryLog::log(BinaryLog::StreamFormat, width, height, videoFormat.format);
+
+    if (renegotiationTimer.isValid()) {
+        const qint64 latency = renegotiationTimer.nsecsElapsed() / 1000;
+        renegotiationTimer.invalidate();
+        renegotiationLatency.store(latency);
+        BinaryLog::log(BinaryLog::StreamRenegotiated, latency);
+        Q_EMIT renegotiated(latency);
+    }
+
+    pod_builder = SPA_POD_BUILDER_INIT (paramsBuffer, sizeof (paramsBuffer));
+
+    // Both formats have the same stride, so a framerate or format switch
+    // keeps the buffers we have. Only a new size, new buffer settings or
+    // having no buffers at all makes us ask for new ones.
+    const QSize size(width, height);
+    uint32_t count = 0;
+    if (size != buffersParamSize || buffersParamChanged || !allocatedBuffers.load()) {
+        params[count++] = buildBuffersParam(&pod_builder);
+        buffersParamSize = size;
+        buffersParamChanged = false;
+    }
+    params[count++] = buildMetaParam(&pod_builder);
+    params[count++] = buildCropParam(&pod_builder);
+
+    {
+        QMutexLocker locker(&bufferMutex);
+        currentLayout.size = size;
+        currentLayout.format = negotiatedFormat();
+    }
+
+    finishFormat(params, count);
+}
+
+int ScreenCastStream::updateParams(const spa_pod **params, uint32_t count)
+{
+    // The format always comes first, buffers follow from it
+    if (loopback)
+        return loopback->updateFormat(this, params[0]);
+
+    return pw_stream_update_params(pwStream, params, count);
+}
+
+bool ScreenCastStream::hasStream() const
+{
+    return pwStream || loopback;
+}
+
+void ScreenCastStream::finishFormat(const spa_pod **params, uint32_t count)
+{
+    if (loopback)
+        loopback->finishFormat(this, params, count);
+    else
+        pw_stream_finish_format(pwStream, 0, params, count);
+}
+
+void ScreenCastStream::removeStream()
+{
+    // FIXME destroying streams seems to be crashing, Mutter also doesn't remove them, maybe Pipewire does this automatically
+    // pw_stream_destroy(pwStream);
+    // pwStream = nullptr;
+    pw_stream_disconnect(pwStream);
+}
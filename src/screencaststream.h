@@ -22,15 +22,11 @@
 #define SCREEN_CAST_STREAM_H
 
 #include <QObject>
+#include <QRect>
 #include <QSize>
 
-#include <pipewire/version.h>
+#include "pipewirecore.h"
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-#include <spa/support/type-map.h>
-#include <spa/param/format-utils.h>
-#include <spa/param/video/raw-utils.h>
-#endif
 #include <spa/param/video/format-utils.h>
 #include <spa/param/props.h>
 
@@ -39,92 +35,260 @@
 #include <pipewire/remote.h>
 #include <pipewire/stream.h>
 
+#include <QAtomicInteger>
+#include <QByteArray>
 #include <QDBusUnixFileDescriptor>
+#include <QElapsedTimer>
 #include <QImage>
+#include <QMutex>
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-class PwType {
-public:
-  spa_type_media_type media_type;
-  spa_type_media_subtype media_subtype;
-  spa_type_format_video format_video;
-  spa_type_video_format video_format;
-};
-#endif
+#include "framescaler.h"
+#include "latencyhistogram.h"
 
+class FrameSource;
+class LoopbackTransport;
 class QSocketNotifier;
 
 class ScreenCastStream : public QObject
 {
     Q_OBJECT
+    // Stands in for PipeWire, so it gets to see what the stream asks for
+    friend class LoopbackTransport;
 public:
     enum StreamDirection {
         DirectionOutput = 0,
         DirectionInput = 1
     };
 
+    enum PixelFormat {
+        FormatRGBx = 0,
+        FormatBGRx = 1
+    };
+
+    // What frames are written with, the negotiated size and format and the
+    // stride of the buffers we asked for
+    struct FrameLayout {
+        QSize size;
+        PixelFormat format = FormatRGBx;
+        int stride = 0;
+    };
+
+    // How buffers are requested from PipeWire, see README for the matching variables
+    struct BufferSettings {
+        int buffers = 16;
+        int minBuffers = 2;
+        int maxBuffers = 16;
+        // 16, 64 (cache line) or the page size
+        int align = 16;
+        // Extra bytes at the end of each buffer
+        int padding = 0;
+        // Grow the buffer count when we run out of buffers, shrink it again when idle
+        bool adaptive = false;
+
+        static BufferSettings fromEnvironment();
+    };
+
     // Constructor for output stream
     explicit ScreenCastStream(const QSize &resolution, QObject *parent = nullptr);
     // Constructor for input stream
     ScreenCastStream(const QSize &resolution, const QDBusUnixFileDescriptor &fd, uint streamNodeId, QObject *parent = nullptr);
+    // Constructor for input stream sharing its remote and loop with other
+    // streams, @core has to outlive the stream
+    ScreenCastStream(const QSize &resolution, PipeWireCore *core, uint streamNodeId, QObject *parent = nullptr);
 
     ~ScreenCastStream();
 
     // Public
     void init();
+    // Exchanges buffers with the other stream on @transport instead of PipeWire,
+    // @transport has to outlive the stream
+    bool initLoopback(LoopbackTransport *transport);
     uint framerate() const;
     uint nodeId() const;
+    // Newest frame an input stream got, safe to call from any thread
     QImage framebuffer() const;
+    // Frames an input stream got while a framebufferUpdated() was still
+    // pending, and thus didn't queue another one
+    int coalescedNotifications() const;
+
+    // Makes the output stream offer exactly the given size, framerate and format,
+    // the consumer renegotiates without the stream being recreated. Invalid size
+    // or zero framerate keep the current value.
+    bool renegotiate(const QSize &size, uint framerate, PixelFormat format);
+    QSize negotiatedSize() const;
+    PixelFormat negotiatedFormat() const;
+
+    BufferSettings bufferSettings() const;
+    // Renegotiates buffers right away when the stream is already running
+    bool setBufferSettings(const BufferSettings &settings);
+    // Number of buffers PipeWire actually allocated for us and their memory
+    int bufferCount() const;
+    qint64 bufferMemory() const;
+    // Buffers PipeWire added and removed so far, reallocating shows up in both
+    int buffersAdded() const;
+    int buffersRemoved() const;
+    int dequeueFailures() const;
+    // Average time in microseconds a buffer takes from being queued until we get it back
+    qint64 bufferRoundTrip() const;
+
+    // Frames an output stream queued, shared by all consumers of the node
+    int framesProduced() const;
+    // Frames an input stream got, the ones it missed and how long after
+    // being queued by the producer they arrived, in microseconds
+    int framesReceived() const;
+    int framesDropped() const;
+    const LatencyHistogram &frameLatency() const;
+
+    // Part of the frame the consumer should show, in our resolution, a null
+    // rect shares the whole frame. It is sent as metadata along with the full
+    // frame. For input streams this is the region of the last frame we got.
+    QRect cropRegion() const;
+    void setCropRegion(const QRect &region);
+
+    // Stops frame production but keeps the node and its format alive, so that
+    // a paused consumer can resume without the stream being recreated. With
+    // @releaseMemory we also drop what we can until resume() is called.
+    void suspend(bool releaseMemory);
+    void resume();
+    bool isSuspended() const;
+    // Bytes held by the stream while suspended
+    qint64 idleMemory() const;
+    // Microseconds from the consumer resuming until our first frame was queued
+    qint64 resumeLatency() const;
+
+    // Output streams alive in the process, safe to call from any thread
+    static int outputStreamCount();
 
     // Public because we need access from static functions
     bool createStream();
     void removeStream();
+    void formatChanged(const spa_pod *format);
+    const spa_pod *buildBuffersParam(spa_pod_builder *builder);
+    const spa_pod *buildMetaParam(spa_pod_builder *builder);
+    const spa_pod *buildCropParam(spa_pod_builder *builder);
+    void addBuffer(pw_buffer *buffer);
+    void removeBuffer(pw_buffer *buffer);
 
 public Q_SLOTS:
     bool readFrame(pw_buffer *pwBuffer);
     bool writeFrame(uint8_t *screenData);
+    bool writeFrame(FrameSource *source);
 
 Q_SIGNALS:
+    // Emitted in the thread the stream lives in, at most one is queued no
+    // matter how many frames arrive meanwhile, framebuffer() has the newest
     void framebufferUpdated();
     void streamReady(uint nodeId);
     void startStreaming();
     void stopStreaming();
+    void pauseStreaming();
+    // Emitted from the PipeWire thread, latency is in microseconds
+    void renegotiated(qint64 latency);
 
 
-#if !PW_CHECK_VERSION(0, 2, 9)
-private:
-    void initializePwTypes();
-#endif
-
 public:
+    PipeWireCore *core = nullptr;
+    LoopbackTransport *loopback = nullptr;
 #if PW_CHECK_VERSION(0, 2, 9)
-    struct pw_core *pwCore = nullptr;
-    struct pw_loop *pwLoop = nullptr;
     struct pw_stream *pwStream = nullptr;
-    struct pw_remote *pwRemote = nullptr;
-    struct pw_thread_loop *pwMainLoop = nullptr;
 #else
-    pw_core *pwCore = nullptr;
-    pw_loop *pwLoop = nullptr;
     pw_stream *pwStream = nullptr;
-    pw_remote *pwRemote = nullptr;
-    pw_thread_loop *pwMainLoop = nullptr;
-    pw_type *pwCoreType = nullptr;
-    PwType *pwType = nullptr;
 #endif
 
-    spa_hook remoteListener;
     spa_hook streamListener;
 
-    spa_video_info_raw videoFormat;
+    spa_video_info_raw videoFormat = {};
 
     StreamDirection streamDirection;
 
+    // Time from renegotiate() until the new format got applied
+    QElapsedTimer renegotiationTimer;
+    // Written on the PipeWire thread, read by the session
+    QAtomicInteger<qint64> renegotiationLatency = -1;
+
 private:
+    const spa_pod *buildFormat(spa_pod_builder *builder) const;
+    bool updateBuffersParam();
+    int updateParams(const spa_pod **params, uint32_t count);
+    void finishFormat(const spa_pod **params, uint32_t count);
+    bool hasStream() const;
+    QRect negotiatedCropRegion() const;
+    void adaptBufferCount();
+    pw_buffer *dequeueBuffer();
+    void queueBuffer(pw_buffer *buffer);
+    void publishFramebuffer();
+    FrameLayout frameLayout() const;
+    uint8_t *bufferData(pw_buffer *buffer, const FrameLayout &layout);
+
     QSize resolution;
     QDBusUnixFileDescriptor pipewireFd;
+    // Whether we created the core ourselves or share one we were given
+    bool ownsCore = false;
     uint pwStreamNodeId;
+    // Frames are copied into backFb and swapped with fb once complete
     QImage fb;
+    QImage backFb;
+    mutable QMutex fbMutex;
+    // Set while a framebufferUpdated() is queued to the stream's thread
+    QAtomicInt notificationPending;
+    QAtomicInt coalescedFrames;
+
+    QSize requestedSize;
+    uint requestedFramerate = 0;
+    PixelFormat pixelFormat = FormatRGBx;
+
+    // Used when the consumer negotiated a different size than we produce
+    FrameScaler scaler;
+    QByteArray sourceFrame;
+
+    // Guards what both the PipeWire thread and the thread producing frames
+    // touch: the buffer settings and the layout frames are written with
+    mutable QMutex bufferMutex;
+    BufferSettings buffers;
+    // Count we currently ask for in adaptive mode
+    int adaptiveBufferCount = 0;
+    int bufferStride = 0;
+    int bufferSize = 0;
+    FrameLayout currentLayout;
+    QAtomicInt allocatedBuffers;
+    QAtomicInt addedBuffers;
+    QAtomicInt removedBuffers;
+    // Size the last Buffers param was built for, PipeWire keeps the buffers
+    // as long as we don't send a new one
+    QSize buffersParamSize;
+    // Settings changed, the next format change has to send a new Buffers param
+    bool buffersParamChanged = false;
+    // Bumped whenever buffers are added or removed
+    QAtomicInt bufferGeneration;
+    int sourceBufferGeneration = -1;
+    QAtomicInt failedDequeues;
+
+    // Adaptive mode bookkeeping, only touched from writeFrame()
+    QElapsedTimer clock;
+    int windowFrames = 0;
+    int windowFailures = 0;
+    qint64 windowRoundTrip = 0;
+    int quietWindows = 0;
+    QAtomicInteger<qint64> averageRoundTrip;
+
+    QAtomicInt producedFrames;
+    QAtomicInt receivedFrames;
+    QAtomicInt droppedFrames;
+    uint64_t lastSequence = 0;
+    LatencyHistogram latency;
+    // Set over D-Bus and read by the thread producing frames, or written by
+    // the PipeWire thread of input streams
+    mutable QMutex cropMutex;
+    QRect crop;
+
+    // Only touched on the thread of the stream, the producer resumes it
+    // there once the consumer started streaming again
+    bool suspended = false;
+    QElapsedTimer resumeTimer;
+    bool releasedMemory = false;
+    bool savedAdaptive = false;
+    int savedBufferCount = 0;
+    qint64 lastResumeLatency = -1;
 };
 
 #endif // SCREEN_CAST_STREAM_H
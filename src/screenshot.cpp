@@ -0,0 +1,268 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "screenshot.h"
+#include "screencast.h"
+#include "tilecontent.h"
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDBusConnection>
+#include <QDBusObjectPath>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QLoggingCategory>
+#include <QRunnable>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <stdio.h>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestScreenshot, "xdp-test-screenshot")
+
+// Seconds screenshots stay around, applications are expected to read or
+// copy them right away
+#define DEFAULT_MAX_AGE 600
+// Qt's PNG quality, higher is faster and bigger, 80 is zlib level 1
+#define DEFAULT_QUALITY 80
+
+// Kept by every encoder thread, so that screenshots of the same size don't allocate
+struct EncodeBuffers {
+    QImage image;
+    QByteArray encoded;
+};
+
+static thread_local EncodeBuffers encodeBuffers;
+
+class ScreenshotJob : public QRunnable
+{
+public:
+    ScreenshotJob(ScreenshotPortal *portal, const SourceCatalog::Source &source, const QDBusMessage &message, qint64 received)
+        : m_portal(portal)
+        , m_source(source)
+        , m_message(message)
+        , m_received(received)
+    {
+    }
+
+    void run() override
+    {
+        m_portal->capture(m_source, m_message, m_received);
+    }
+
+private:
+    ScreenshotPortal *m_portal;
+    SourceCatalog::Source m_source;
+    QDBusMessage m_message;
+    qint64 m_received;
+};
+
+ScreenshotPortal::ScreenshotPortal(QObject *parent)
+    : QDBusAbstractAdaptor(parent)
+{
+    // Same sources the ScreenCast portal offers
+    m_catalog = new SourceCatalog(SourceCatalog::fromEnvironment());
+    for (const SourceCatalog::Source &source : m_catalog->sources()) {
+        if (source.type == ScreenCastPortal::Monitor)
+            m_contents.insert(source.name, new DesktopContent(source.geometry.size()));
+    }
+
+    bool ok = false;
+    const int threads = qEnvironmentVariableIntValue("XDP_TEST_SCREENSHOT_THREADS", &ok);
+    m_encoders = new QThreadPool(this);
+    m_encoders->setMaxThreadCount(ok && threads > 0 ? threads : qMax(1, QThread::idealThreadCount()));
+    // Threads stay around with their buffers while requests keep coming
+    m_encoders->setExpiryTimeout(60000);
+
+    m_maxAge = qEnvironmentVariableIntValue("XDP_TEST_SCREENSHOT_MAX_AGE", &ok);
+    if (!ok || m_maxAge <= 0)
+        m_maxAge = DEFAULT_MAX_AGE;
+
+    m_quality = qEnvironmentVariableIntValue("XDP_TEST_SCREENSHOT_QUALITY", &ok);
+    if (!ok || m_quality < 0 || m_quality > 100)
+        m_quality = DEFAULT_QUALITY;
+
+    // XDG_RUNTIME_DIR is a tmpfs, screenshots never hit the disk
+    m_directory = QFile::decodeName(qgetenv("XDG_RUNTIME_DIR"));
+    if (m_directory.isEmpty())
+        m_directory = QDir::tempPath();
+
+    m_cleanup = new QTimer(this);
+    connect(m_cleanup, &QTimer::timeout, this, &ScreenshotPortal::removeOldFiles);
+    m_cleanup->start(qMin(m_maxAge, 60) * 1000);
+
+    m_clock.start();
+}
+
+ScreenshotPortal::~ScreenshotPortal()
+{
+    m_encoders->waitForDone();
+
+    qDeleteAll(m_contents);
+    delete m_catalog;
+}
+
+const LatencyHistogram &ScreenshotPortal::latency() const
+{
+    return m_latency;
+}
+
+void ScreenshotPortal::resetLatency()
+{
+    m_latency.reset();
+}
+
+int ScreenshotPortal::pendingRequests() const
+{
+    return m_pending.load();
+}
+
+uint ScreenshotPortal::Screenshot(const QDBusObjectPath &handle,
+                                  const QString &app_id,
+                                  const QString &parent_window,
+                                  const QVariantMap &options,
+                                  const QDBusMessage &message,
+                                  QVariantMap &results)
+{
+    Q_UNUSED(handle)
+    Q_UNUSED(app_id)
+    Q_UNUSED(parent_window)
+    Q_UNUSED(options)
+    Q_UNUSED(results)
+
+    const qint64 received = m_clock.nsecsElapsed();
+
+    // XDP_TEST_SCREENSHOT_SOURCE picks a source by name, the first monitor otherwise
+    QVector<SourceCatalog::Source> sources;
+    if (qEnvironmentVariableIsSet("XDP_TEST_SCREENSHOT_SOURCE"))
+        sources = m_catalog->select(ScreenCastPortal::Monitor | ScreenCastPortal::Window, false, { QString::fromLocal8Bit(qgetenv("XDP_TEST_SCREENSHOT_SOURCE")) });
+    else
+        sources = m_catalog->select(ScreenCastPortal::Monitor, false);
+
+    if (sources.isEmpty()) {
+        qCWarning(XdgDesktopPortalTestScreenshot) << "No source to take a screenshot of";
+        return 2;
+    }
+
+    // Answered by an encoder thread once the file is written
+    message.setDelayedReply(true);
+    m_pending.ref();
+    m_encoders->start(new ScreenshotJob(this, sources.first(), message, received));
+
+    return 0;
+}
+
+void ScreenshotPortal::capture(const SourceCatalog::Source &source, const QDBusMessage &message, qint64 received)
+{
+    // Windows are the part of their monitor they cover, only that part is rendered
+    const bool window = source.type == ScreenCastPortal::Window;
+    const TileContent *content = m_contents.value(window ? source.monitor : source.name);
+    const QRect region = window ? source.geometry : QRect(QPoint(0, 0), source.geometry.size());
+
+    EncodeBuffers &buffers = encodeBuffers;
+    if (buffers.image.size() != region.size())
+        buffers.image = QImage(region.size(), QImage::Format_RGBX8888);
+    if (!buffers.encoded.capacity())
+        buffers.encoded.reserve(region.width() * region.height());
+
+    uint response = 2;
+    QVariantMap results;
+
+    if (content) {
+        content->render(region, buffers.image.bits(), buffers.image.bytesPerLine());
+
+        // Truncating keeps the reserved capacity of the array
+        QBuffer device(&buffers.encoded);
+        device.open(QIODevice::WriteOnly | QIODevice::Truncate);
+        const bool encoded = buffers.image.save(&device, "PNG", m_quality);
+
+        // Written to a temporary file of its own and renamed, readers never see half a file
+        const QString fileName = nextFileName();
+        QTemporaryFile file(QStringLiteral("%1/xdp-test-screenshot-XXXXXX.tmp").arg(m_directory));
+        if (encoded && file.open() && file.write(buffers.encoded) == buffers.encoded.size() && file.flush() &&
+            ::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(fileName).constData()) == 0) {
+            // Gone already, nothing for the destructor to remove
+            file.setAutoRemove(false);
+            response = 0;
+            results.insert(QStringLiteral("uri"), QStringLiteral("file://") + fileName);
+        }
+
+        if (response)
+            qCWarning(XdgDesktopPortalTestScreenshot) << "Failed to write screenshot" << fileName << file.errorString();
+    }
+
+    QDBusConnection::sessionBus().send(message.createReply({ response, results }));
+
+    m_latency.record((m_clock.nsecsElapsed() - received) / 1000);
+    m_pending.deref();
+}
+
+QString ScreenshotPortal::nextFileName()
+{
+    // Never reused, a uri we handed out keeps pointing to its screenshot
+    const int index = m_fileCounter.fetchAndAddRelaxed(1);
+    return QStringLiteral("%1/xdp-test-screenshot-%2-%3.png").arg(m_directory).arg(QCoreApplication::applicationPid()).arg(index);
+}
+
+void ScreenshotPortal::removeOldFiles()
+{
+    const QDateTime oldest = QDateTime::currentDateTime().addSecs(-m_maxAge);
+    const QDir directory(m_directory);
+    // Temporary files of any instance are only left by crashes
+    const QStringList patterns = {
+        QStringLiteral("xdp-test-screenshot-%1-*.png").arg(QCoreApplication::applicationPid()),
+        QStringLiteral("xdp-test-screenshot-*.tmp")
+    };
+
+    for (const QFileInfo &info : directory.entryInfoList(patterns, QDir::Files)) {
+        if (info.lastModified() < oldest)
+            QFile::remove(info.filePath());
+    }
+}
+
+ScreenshotControl::ScreenshotControl(ScreenshotPortal *screenshot, QObject *parent)
+    : QDBusAbstractAdaptor(parent)
+    , m_screenshot(screenshot)
+{
+}
+
+QVariantMap ScreenshotControl::GetStatistics() const
+{
+    const LatencyHistogram &latency = m_screenshot->latency();
+
+    return QVariantMap {
+        { QStringLiteral("screenshots"), latency.count() },
+        { QStringLiteral("pending"), m_screenshot->pendingRequests() },
+        { QStringLiteral("latency-p50"), latency.percentile(50) },
+        { QStringLiteral("latency-p90"), latency.percentile(90) },
+        { QStringLiteral("latency-p99"), latency.percentile(99) },
+        { QStringLiteral("latency-max"), latency.maximum() },
+    };
+}
+
+void ScreenshotControl::ResetStatistics()
+{
+    m_screenshot->resetLatency();
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_SCREENSHOT_H
+#define XDG_DESKTOP_PORTAL_TEST_SCREENSHOT_H
+
+#include <QAtomicInt>
+#include <QDBusAbstractAdaptor>
+#include <QDBusMessage>
+#include <QElapsedTimer>
+#include <QHash>
+
+#include "latencyhistogram.h"
+#include "sourcecatalog.h"
+
+class QDBusObjectPath;
+class QThreadPool;
+class QTimer;
+class TileContent;
+
+// Screenshots of the sources the ScreenCast portal offers. Requests are
+// answered from a pool of encoder threads, rendering only the picked
+// source and encoding it into buffers each thread keeps reusing, so many
+// requests can be in flight without any PipeWire stream being set up.
+class ScreenshotPortal : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.impl.portal.Screenshot")
+    Q_PROPERTY(uint version READ version)
+public:
+    explicit ScreenshotPortal(QObject *parent);
+    ~ScreenshotPortal();
+
+    uint version() const { return 1; }
+
+    // Microseconds from a request arriving until its reply was sent
+    const LatencyHistogram &latency() const;
+    void resetLatency();
+    int pendingRequests() const;
+
+    // Public because the encoder threads need access
+    void capture(const SourceCatalog::Source &source, const QDBusMessage &message, qint64 received);
+
+public Q_SLOTS:
+    uint Screenshot(const QDBusObjectPath &handle,
+                    const QString &app_id,
+                    const QString &parent_window,
+                    const QVariantMap &options,
+                    const QDBusMessage &message,
+                    QVariantMap &results);
+
+private:
+    QString nextFileName();
+    // Removes screenshots and leftover temporary files older than m_maxAge
+    void removeOldFiles();
+
+    SourceCatalog *m_catalog = nullptr;
+    // Content of each monitor, rendered from several threads at once
+    QHash<QString, TileContent *> m_contents;
+    QThreadPool *m_encoders = nullptr;
+
+    QString m_directory;
+    // Seconds screenshots are kept for the application to read them
+    int m_maxAge = 0;
+    QTimer *m_cleanup = nullptr;
+    int m_quality = 0;
+    QAtomicInt m_fileCounter;
+
+    QElapsedTimer m_clock;
+    LatencyHistogram m_latency;
+    QAtomicInt m_pending;
+};
+
+// Not part of the portal API, lets tests read how fast screenshots are
+class ScreenshotControl : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.impl.portal.desktop.test.ScreenshotControl")
+public:
+    ScreenshotControl(ScreenshotPortal *screenshot, QObject *parent);
+
+public Q_SLOTS:
+    QVariantMap GetStatistics() const;
+    void ResetStatistics();
+
+private:
+    ScreenshotPortal *m_screenshot;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_SCREENSHOT_H
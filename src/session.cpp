@@ -20,23 +20,85 @@
 
 #include "session.h"
 #include "desktopportal.h"
+#include "binarylog.h"
+#include "screencastproducer.h"
+#include "screencaststream.h"
+#include "tracer.h"
 
 #include <QDBusArgument>
 #include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusError>
 #include <QDBusMessage>
 #include <QDBusPendingCall>
 #include <QDBusPendingReply>
 #include <QDBusPendingCallWatcher>
+#include <QDBusServiceWatcher>
+#include <QDBusUnixFileDescriptor>
+#include <QFile>
 #include <QLoggingCategory>
+#include <QRect>
+#include <QSize>
+#include <QStringList>
+#include <QThread>
+
+#include <unistd.h>
 
 Q_LOGGING_CATEGORY(XdgSessionTestSession, "xdp-test-session")
 
+// Not part of the portal API, lets tests drive the backend directly
+#define CONTROL_INTERFACE "org.freedesktop.impl.portal.desktop.test.ScreenCastControl"
+
 static QMap<QString, Session*> sessionList;
+// Watches the owners of all sessions, created with the first one
+static QDBusServiceWatcher *ownerWatcher = nullptr;
+
+static QList<Session *> sessionsOwnedBy(const QString &owner)
+{
+    QList<Session *> sessions;
+    for (Session *session : qAsConst(sessionList)) {
+        if (session->owner() == owner)
+            sessions << session;
+    }
+
+    return sessions;
+}
+
+// Clients which crash or quit without calling Close leave their sessions
+// behind, close them like Close would so streams and producers go away too
+static void reapSessions(const QString &owner)
+{
+    const QList<Session *> orphaned = sessionsOwnedBy(owner);
+    if (orphaned.isEmpty())
+        return;
 
-Session::Session(QObject *parent, const QString &appId, const QString &path)
+    qCDebug(XdgSessionTestSession) << "Closing" << orphaned.count() << "sessions of disconnected client" << owner;
+
+    for (Session *session : orphaned) {
+        session->close();
+        Q_EMIT session->closed();
+    }
+}
+
+static BinaryLog::Interface interfaceCode(const QString &interface)
+{
+    if (interface == QLatin1String("org.freedesktop.impl.portal.Session"))
+        return BinaryLog::SessionInterface;
+    if (interface == QLatin1String("org.freedesktop.DBus.Properties"))
+        return BinaryLog::PropertiesInterface;
+    if (interface == QLatin1String(CONTROL_INTERFACE))
+        return BinaryLog::ControlInterface;
+    if (interface == QLatin1String("org.freedesktop.DBus.Introspectable"))
+        return BinaryLog::IntrospectableInterface;
+
+    return BinaryLog::OtherInterface;
+}
+
+Session::Session(QObject *parent, const QString &appId, const QString &path, const QString &owner)
     : QDBusVirtualObject(parent)
     , m_appId(appId)
     , m_path(path)
+    , m_owner(owner)
 {
 }
 
@@ -55,9 +117,7 @@ bool Session::handleMessage(const QDBusMessage &message, const QDBusConnection &
     if (message.type() != QDBusMessage::MessageType::MethodCallMessage)
         return false;
 
-    qCDebug(XdgSessionTestSession) << message.interface();
-    qCDebug(XdgSessionTestSession) << message.member();
-    qCDebug(XdgSessionTestSession) << message.path();
+    BinaryLog::log(BinaryLog::SessionMessage, message.member(), interfaceCode(message.interface()));
 
     if (message.interface() == QLatin1String("org.freedesktop.impl.portal.Session")) {
         if (message.member() == QLatin1String("Close")) {
@@ -102,7 +162,7 @@ QString Session::introspect(const QString &path) const
             "</interface>");
     }
 
-    qCDebug(XdgSessionTestSession) << nodes;
+    BinaryLog::log(BinaryLog::SessionIntrospect, nodes.size());
 
     return nodes;
 }
@@ -113,21 +173,60 @@ bool Session::close()
     return QDBusConnection::sessionBus().send(reply);
 }
 
-Session * Session::createSession(QObject *parent, SessionType type, const QString &appId, const QString &path)
+QString Session::appId() const
+{
+    return m_appId;
+}
+
+QString Session::path() const
+{
+    return m_path;
+}
+
+QString Session::owner() const
+{
+    return m_owner;
+}
+
+Session * Session::createSession(QObject *parent, SessionType type, const QString &appId, const QString &path, const QString &owner)
 {
     QDBusConnection sessionBus = QDBusConnection::sessionBus();
 
     Session *session = nullptr;
     if (type == ScreenCast)
-        session = new ScreenCastSession(parent, appId, path);
+        session = new ScreenCastSession(parent, appId, path, owner);
 
     if (sessionBus.registerVirtualObject(path, session, QDBusConnection::VirtualObjectRegisterOption::SubPath)) {
         connect(session, &Session::closed, [session, path] () {
             sessionList.remove(path);
             QDBusConnection::sessionBus().unregisterObject(path);
+            // Stop watching clients once their last session is gone
+            if (ownerWatcher && !session->owner().isEmpty() && sessionsOwnedBy(session->owner()).isEmpty())
+                ownerWatcher->removeWatchedService(session->owner());
             session->deleteLater();
         });
         sessionList.insert(path, session);
+
+        if (!owner.isEmpty()) {
+            if (!ownerWatcher) {
+                ownerWatcher = new QDBusServiceWatcher(QString(), sessionBus, QDBusServiceWatcher::WatchForUnregistration, parent);
+                connect(ownerWatcher, &QDBusServiceWatcher::serviceUnregistered, reapSessions);
+                connect(ownerWatcher, &QObject::destroyed, [] () {
+                    ownerWatcher = nullptr;
+                });
+            }
+            ownerWatcher->addWatchedService(owner);
+
+            // The client may have gone before we started watching it
+            QDBusPendingCallWatcher *ownerCheck = new QDBusPendingCallWatcher(sessionBus.interface()->asyncCall(QStringLiteral("NameHasOwner"), owner), session);
+            connect(ownerCheck, &QDBusPendingCallWatcher::finished, [owner, ownerCheck] () {
+                QDBusPendingReply<bool> reply = *ownerCheck;
+                if (reply.isValid() && !reply.value())
+                    reapSessions(owner);
+                ownerCheck->deleteLater();
+            });
+        }
+
         return session;
     } else {
         qCDebug(XdgSessionTestSession) << sessionBus.lastError().message();
@@ -142,8 +241,8 @@ Session * Session::getSession(const QString &sessionHandle)
     return sessionList.value(sessionHandle);
 }
 
-ScreenCastSession::ScreenCastSession(QObject *parent, const QString &appId, const QString &path)
-    : Session(parent, appId, path)
+ScreenCastSession::ScreenCastSession(QObject *parent, const QString &appId, const QString &path, const QString &owner)
+    : Session(parent, appId, path, owner)
 {
 }
 
@@ -151,6 +250,103 @@ ScreenCastSession::~ScreenCastSession()
 {
 }
 
+bool ScreenCastSession::handleMessage(const QDBusMessage &message, const QDBusConnection &connection)
+{
+    if (message.path() != path() || message.interface() != QLatin1String(CONTROL_INTERFACE))
+        return Session::handleMessage(message, connection);
+
+    if (message.type() != QDBusMessage::MessageType::MethodCallMessage)
+        return false;
+
+    BinaryLog::log(BinaryLog::SessionMessage, message.member(), BinaryLog::ControlInterface);
+
+    if (message.member() == QLatin1String("UpdateStream")) {
+        TraceScope trace("UpdateStream");
+
+        if (message.arguments().count() != 1) {
+            return connection.send(message.createErrorReply(QDBusError::InvalidArgs, QStringLiteral("Expected a{sv} with stream options")));
+        }
+
+        const QVariantMap options = qdbus_cast<QVariantMap>(message.arguments().at(0));
+
+        // Sessions with several sources update the first one unless told otherwise
+        uint nodeId = m_nodeIds.isEmpty() ? 0 : m_nodeIds.first();
+        if (options.contains(QStringLiteral("node-id")))
+            nodeId = options.value(QStringLiteral("node-id")).toUInt();
+
+        bool updated = false;
+        invokeOnStreamThread(nodeId, [this, &options, &updated] (ScreenCastStream *stream) {
+            updated = updateStream(stream, options);
+        });
+        if (!updated) {
+            return connection.send(message.createErrorReply(QDBusError::Failed, QStringLiteral("Failed to update the stream")));
+        }
+
+        return connection.send(message.createReply());
+    } else if (message.member() == QLatin1String("GetStatistics")) {
+        TraceScope trace("GetStatistics");
+
+        QVariantList allStatistics;
+        for (uint nodeId : qAsConst(m_nodeIds)) {
+            QVariantMap streamStatistics;
+            invokeOnStreamThread(nodeId, [this, nodeId, &streamStatistics] (ScreenCastStream *stream) {
+                streamStatistics = statistics(nodeId, stream);
+            });
+            allStatistics << streamStatistics;
+        }
+
+        // The first stream is reported at the top level, all of them in "streams"
+        QVariantMap sessionStatistics = allStatistics.isEmpty() ? QVariantMap() : allStatistics.first().toMap();
+        sessionStatistics.insert(QStringLiteral("streams"), allStatistics);
+
+        QDBusMessage reply = message.createReply();
+        reply.setArguments({ sessionStatistics });
+        return connection.send(reply);
+    } else if (message.member() == QLatin1String("DumpTrace")) {
+        // The caller opens the file itself, we never write to paths picked by a peer
+        const QDBusUnixFileDescriptor fd = message.arguments().count() == 1 ? qvariant_cast<QDBusUnixFileDescriptor>(message.arguments().at(0))
+                                                                            : QDBusUnixFileDescriptor();
+        if (!fd.isValid()) {
+            return connection.send(message.createErrorReply(QDBusError::InvalidArgs, QStringLiteral("Expected h with a file descriptor to write to")));
+        }
+
+        if (!Tracer::isEnabled()) {
+            return connection.send(message.createErrorReply(QDBusError::Failed, QStringLiteral("Tracing is off, set XDP_TEST_TRACE to enable it")));
+        }
+
+        QFile file;
+        if (!file.open(fd.fileDescriptor(), QIODevice::WriteOnly, QFileDevice::DontCloseHandle) || !Tracer::dump(&file) || !file.flush()) {
+            return connection.send(message.createErrorReply(QDBusError::Failed, QStringLiteral("Failed to write the trace")));
+        }
+
+        return connection.send(message.createReply());
+    }
+
+    return false;
+}
+
+QString ScreenCastSession::introspect(const QString &path) const
+{
+    QString nodes = Session::introspect(path);
+
+    if (path.startsWith(QLatin1String("/org/freedesktop/portal/desktop/session/"))) {
+        nodes += QStringLiteral(
+            "<interface name=\"" CONTROL_INTERFACE "\">"
+            "    <method name=\"UpdateStream\">"
+            "        <arg type=\"a{sv}\" name=\"options\" direction=\"in\"/>"
+            "    </method>"
+            "    <method name=\"GetStatistics\">"
+            "        <arg type=\"a{sv}\" name=\"statistics\" direction=\"out\"/>"
+            "    </method>"
+            "    <method name=\"DumpTrace\">"
+            "        <arg type=\"h\" name=\"fd\" direction=\"in\"/>"
+            "    </method>"
+            "</interface>");
+    }
+
+    return nodes;
+}
+
 bool ScreenCastSession::multipleSources() const
 {
     return m_multipleSources;
@@ -160,3 +356,187 @@ void ScreenCastSession::setMultipleSources(bool multipleSources)
 {
     m_multipleSources = multipleSources;
 }
+
+uint ScreenCastSession::sourceTypes() const
+{
+    return m_sourceTypes;
+}
+
+void ScreenCastSession::setSourceTypes(uint types)
+{
+    m_sourceTypes = types;
+}
+
+QStringList ScreenCastSession::sources() const
+{
+    return m_sources;
+}
+
+void ScreenCastSession::setSources(const QStringList &sources)
+{
+    m_sources = sources;
+}
+
+uint ScreenCastSession::persistMode() const
+{
+    return m_persistMode;
+}
+
+void ScreenCastSession::setPersistMode(uint persistMode)
+{
+    m_persistMode = persistMode;
+}
+
+QString ScreenCastSession::restoreToken() const
+{
+    return m_restoreToken;
+}
+
+void ScreenCastSession::setRestoreToken(const QString &token)
+{
+    m_restoreToken = token;
+}
+
+QList<uint> ScreenCastSession::nodeIds() const
+{
+    return m_nodeIds;
+}
+
+void ScreenCastSession::addStream(uint nodeId, ScreenCastProducer *producer)
+{
+    m_nodeIds << nodeId;
+    m_producers.insert(nodeId, producer);
+}
+
+void ScreenCastSession::removeStream(uint nodeId)
+{
+    m_nodeIds.removeAll(nodeId);
+    m_producers.remove(nodeId);
+}
+
+void ScreenCastSession::invokeOnStreamThread(uint nodeId, const std::function<void(ScreenCastStream *)> &function) const
+{
+    ScreenCastProducer *producer = m_producers.value(nodeId);
+    if (!producer) {
+        function(nullptr);
+        return;
+    }
+
+    // The stream is driven and deleted by one of the stream worker threads,
+    // the D-Bus thread only ever touches it from there
+    if (producer->thread() == QThread::currentThread()) {
+        function(producer->stream());
+        return;
+    }
+
+    QMetaObject::invokeMethod(producer, [producer, &function] () {
+        function(producer->stream());
+    }, Qt::BlockingQueuedConnection);
+}
+
+bool ScreenCastSession::updateStream(ScreenCastStream *stream, const QVariantMap &options)
+{
+    if (!stream) {
+        qCWarning(XdgSessionTestSession) << "Tried to update stream of session without one" << path();
+        return false;
+    }
+
+    QSize size;
+    if (options.contains(QStringLiteral("size")))
+        size = qdbus_cast<QSize>(options.value(QStringLiteral("size")));
+
+    const uint framerate = options.value(QStringLiteral("framerate")).toUInt();
+
+    ScreenCastStream::PixelFormat format = stream->negotiatedFormat();
+    if (options.contains(QStringLiteral("format"))) {
+        const QString formatName = options.value(QStringLiteral("format")).toString();
+        if (formatName == QLatin1String("RGBx")) {
+            format = ScreenCastStream::FormatRGBx;
+        } else if (formatName == QLatin1String("BGRx")) {
+            format = ScreenCastStream::FormatBGRx;
+        } else {
+            qCWarning(XdgSessionTestSession) << "Unsupported stream format" << formatName;
+            return false;
+        }
+    }
+
+    static const QStringList bufferOptions = {
+        QStringLiteral("buffers"), QStringLiteral("min-buffers"), QStringLiteral("max-buffers"),
+        QStringLiteral("buffer-align"), QStringLiteral("buffer-padding"), QStringLiteral("adaptive-buffers")
+    };
+
+    bool hasBufferOptions = false;
+    for (const QString &option : bufferOptions)
+        hasBufferOptions |= options.contains(option);
+
+    if (hasBufferOptions) {
+        ScreenCastStream::BufferSettings settings = stream->bufferSettings();
+        settings.buffers = options.value(QStringLiteral("buffers"), settings.buffers).toInt();
+        settings.minBuffers = options.value(QStringLiteral("min-buffers"), settings.minBuffers).toInt();
+        settings.maxBuffers = options.value(QStringLiteral("max-buffers"), settings.maxBuffers).toInt();
+        settings.padding = options.value(QStringLiteral("buffer-padding"), settings.padding).toInt();
+        settings.adaptive = options.value(QStringLiteral("adaptive-buffers"), settings.adaptive).toBool();
+
+        // Either a number of bytes or "page"
+        const QVariant align = options.value(QStringLiteral("buffer-align"));
+        if (align.toString() == QLatin1String("page"))
+            settings.align = getpagesize();
+        else if (align.isValid())
+            settings.align = align.toInt();
+
+        if (!stream->setBufferSettings(settings)) {
+            qCWarning(XdgSessionTestSession) << "Invalid buffer settings" << options;
+            return false;
+        }
+    }
+
+    // Sharing a different part of the frame doesn't need any renegotiation
+    const bool hasCrop = options.contains(QStringLiteral("crop"));
+    if (hasCrop)
+        stream->setCropRegion(qdbus_cast<QRect>(options.value(QStringLiteral("crop"))));
+
+    if (!size.isValid() && !framerate && !options.contains(QStringLiteral("format")))
+        return hasBufferOptions || hasCrop;
+
+    return stream->renegotiate(size, framerate, format);
+}
+
+QVariantMap ScreenCastSession::statistics(uint nodeId, ScreenCastStream *stream) const
+{
+    QVariantMap statistics;
+
+    if (!stream)
+        return statistics;
+
+    // The node id of the stream itself belongs to the PipeWire thread
+    statistics.insert(QStringLiteral("node-id"), nodeId);
+    statistics.insert(QStringLiteral("size"), stream->negotiatedSize());
+    statistics.insert(QStringLiteral("framerate"), stream->framerate());
+    statistics.insert(QStringLiteral("format"), stream->negotiatedFormat() == ScreenCastStream::FormatBGRx ? QStringLiteral("BGRx") : QStringLiteral("RGBx"));
+    statistics.insert(QStringLiteral("renegotiation-latency"), stream->renegotiationLatency.load());
+
+    const ScreenCastStream::BufferSettings settings = stream->bufferSettings();
+    statistics.insert(QStringLiteral("buffer-count"), stream->bufferCount());
+    statistics.insert(QStringLiteral("buffer-memory"), stream->bufferMemory());
+    statistics.insert(QStringLiteral("buffer-align"), settings.align);
+    statistics.insert(QStringLiteral("adaptive-buffers"), settings.adaptive);
+    statistics.insert(QStringLiteral("dequeue-failures"), stream->dequeueFailures());
+    statistics.insert(QStringLiteral("buffer-round-trip"), stream->bufferRoundTrip());
+    statistics.insert(QStringLiteral("frames-produced"), stream->framesProduced());
+    statistics.insert(QStringLiteral("crop"), stream->cropRegion());
+
+    statistics.insert(QStringLiteral("paused"), stream->isSuspended());
+    statistics.insert(QStringLiteral("idle-memory"), stream->idleMemory());
+    statistics.insert(QStringLiteral("resume-latency"), stream->resumeLatency());
+
+    // Streams of the portal are owned by their producer
+    if (ScreenCastProducer *producer = qobject_cast<ScreenCastProducer *>(stream->parent())) {
+        const FrameScheduler::Statistics scheduling = producer->scheduling();
+        statistics.insert(QStringLiteral("frames-scheduled"), scheduling.frames);
+        statistics.insert(QStringLiteral("missed-deadlines"), scheduling.missedDeadlines);
+        statistics.insert(QStringLiteral("skipped-frames"), scheduling.skippedFrames);
+        statistics.insert(QStringLiteral("maximum-lateness"), scheduling.maximumLateness);
+    }
+
+    return statistics;
+}
@@ -22,12 +22,19 @@
 #define XDG_DESKTOP_PORTAL_TEST_SESSION_H
 
 #include <QDBusVirtualObject>
+#include <QHash>
+#include <QStringList>
+
+#include <functional>
+
+class ScreenCastProducer;
+class ScreenCastStream;
 
 class Session : public QDBusVirtualObject
 {
     Q_OBJECT
 public:
-    explicit Session(QObject *parent = nullptr, const QString &appId = QString(), const QString &path = QString());
+    explicit Session(QObject *parent = nullptr, const QString &appId = QString(), const QString &path = QString(), const QString &owner = QString());
     ~Session();
 
     enum SessionType {
@@ -39,9 +46,14 @@ public:
     QString introspect(const QString &path) const override;
 
     bool close();
+    QString appId() const;
+    QString path() const;
+    // Unique bus name of the client which created the session
+    QString owner() const;
     virtual SessionType type() const = 0;
 
-    static Session *createSession(QObject *parent, SessionType type, const QString &appId, const QString &path);
+    // Sessions with an @owner are closed when it disconnects from the bus
+    static Session *createSession(QObject *parent, SessionType type, const QString &appId, const QString &path, const QString &owner = QString());
     static Session *getSession(const QString &sessionHandle);
 
 Q_SIGNALS:
@@ -50,23 +62,61 @@ Q_SIGNALS:
 private:
     const QString m_appId;
     const QString m_path;
+    const QString m_owner;
 };
 
 class ScreenCastSession : public Session
 {
     Q_OBJECT
 public:
-    explicit ScreenCastSession(QObject *parent = nullptr, const QString &appId = QString(), const QString &path = QString());
+    explicit ScreenCastSession(QObject *parent = nullptr, const QString &appId = QString(), const QString &path = QString(), const QString &owner = QString());
     ~ScreenCastSession();
 
+    bool handleMessage(const QDBusMessage &message, const QDBusConnection &connection) override;
+    QString introspect(const QString &path) const override;
+
     bool multipleSources() const;
     void setMultipleSources(bool multipleSources);
 
+    // ScreenCastPortal::SourceType flags picked in SelectSources
+    uint sourceTypes() const;
+    void setSourceTypes(uint types);
+
+    // One stream per selected source, known by the node id its producer
+    // reported when it got ready, the first one is updated by default
+    QList<uint> nodeIds() const;
+    // Producers live in worker threads, the portal removes their streams
+    // from the session before it deletes them
+    void addStream(uint nodeId, ScreenCastProducer *producer);
+    void removeStream(uint nodeId);
+
+    QStringList sources() const;
+    void setSources(const QStringList &sources);
+
+    // persist_mode asked for in SelectSources, and the token the session was
+    // restored from or will be restorable with
+    uint persistMode() const;
+    void setPersistMode(uint persistMode);
+    QString restoreToken() const;
+    void setRestoreToken(const QString &token);
+
     SessionType type() const override { return SessionType::ScreenCast; }
 
 private:
-    bool m_multipleSources;
-    // TODO type
+    // Runs @function with the stream of @nodeId in the thread of its producer
+    // and waits for it, the stream is null if the session doesn't have it
+    void invokeOnStreamThread(uint nodeId, const std::function<void(ScreenCastStream *)> &function) const;
+    bool updateStream(ScreenCastStream *stream, const QVariantMap &options);
+    QVariantMap statistics(uint nodeId, ScreenCastStream *stream) const;
+
+    bool m_multipleSources = false;
+    uint m_sourceTypes = 0;
+    // Names of the picked SourceCatalog sources
+    QStringList m_sources;
+    uint m_persistMode = 0;
+    QString m_restoreToken;
+    QList<uint> m_nodeIds;
+    QHash<uint, ScreenCastProducer *> m_producers;
 };
 
 #endif // XDG_DESKTOP_PORTAL_TEST_SESSION_H
@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "sourcecatalog.h"
+#include "screencast.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestSourceCatalog, "xdp-test-source-catalog")
+
+SourceCatalog::SourceCatalog()
+{
+    Source monitor;
+    monitor.name = QStringLiteral("monitor-0");
+    monitor.type = ScreenCastPortal::Monitor;
+    monitor.geometry = QRect(0, 0, 8, 8);
+    m_sources << monitor;
+
+    addWindow(QStringLiteral("window-0"), monitor.name, QRect(2, 2, 4, 4));
+}
+
+SourceCatalog SourceCatalog::fromEnvironment()
+{
+    SourceCatalog catalog;
+
+    const QString value = QFile::decodeName(qgetenv("XDP_TEST_CATALOG"));
+    if (value.isEmpty())
+        return catalog;
+
+    if (!catalog.loadPreset(value) && !catalog.load(value)) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Failed to load source catalog" << value << ", using the default one";
+        return SourceCatalog();
+    }
+
+    return catalog;
+}
+
+bool SourceCatalog::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Failed to open" << fileName << file.errorString();
+        return false;
+    }
+
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if (!document.isObject()) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Invalid catalog" << fileName << error.errorString();
+        return false;
+    }
+
+    QVector<Source> sources;
+
+    const QJsonArray monitors = document.object().value(QStringLiteral("monitors")).toArray();
+    for (const QJsonValue &value : monitors) {
+        const QJsonObject object = value.toObject();
+
+        Source monitor;
+        monitor.name = object.value(QStringLiteral("name")).toString();
+        monitor.type = ScreenCastPortal::Monitor;
+        monitor.geometry = QRect(object.value(QStringLiteral("x")).toInt(), object.value(QStringLiteral("y")).toInt(),
+                                 object.value(QStringLiteral("width")).toInt(), object.value(QStringLiteral("height")).toInt());
+
+        if (monitor.name.isEmpty() || monitor.geometry.isEmpty()) {
+            qCWarning(XdgDesktopPortalTestSourceCatalog) << "Monitor needs a name and a size" << object;
+            return false;
+        }
+
+        sources << monitor;
+    }
+
+    if (sources.isEmpty()) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Catalog" << fileName << "has no monitors";
+        return false;
+    }
+
+    m_sources = sources;
+
+    const QJsonArray windows = document.object().value(QStringLiteral("windows")).toArray();
+    for (const QJsonValue &value : windows) {
+        const QJsonObject object = value.toObject();
+
+        // Windows without a monitor are on the first one
+        const QString monitor = object.value(QStringLiteral("monitor")).toString(m_sources.first().name);
+        const QRect geometry(object.value(QStringLiteral("x")).toInt(), object.value(QStringLiteral("y")).toInt(),
+                             object.value(QStringLiteral("width")).toInt(), object.value(QStringLiteral("height")).toInt());
+
+        if (!addWindow(object.value(QStringLiteral("name")).toString(), monitor, geometry))
+            return false;
+    }
+
+    return true;
+}
+
+bool SourceCatalog::loadPreset(const QString &preset)
+{
+    if (preset != QLatin1String("3x4k"))
+        return false;
+
+    m_sources.clear();
+
+    for (int i = 0; i < 3; i++) {
+        Source monitor;
+        monitor.name = QStringLiteral("monitor-%1").arg(i);
+        monitor.type = ScreenCastPortal::Monitor;
+        monitor.geometry = QRect(i * 3840, 0, 3840, 2160);
+        m_sources << monitor;
+    }
+
+    addWindow(QStringLiteral("browser"), QStringLiteral("monitor-0"), QRect(0, 0, 1920, 2160));
+    addWindow(QStringLiteral("video"), QStringLiteral("monitor-1"), QRect(960, 540, 1920, 1080));
+    addWindow(QStringLiteral("terminal"), QStringLiteral("monitor-2"), QRect(100, 100, 1280, 720));
+    addWindow(QStringLiteral("dialog"), QStringLiteral("monitor-2"), QRect(1600, 800, 640, 480));
+
+    return true;
+}
+
+QVector<SourceCatalog::Source> SourceCatalog::sources() const
+{
+    return m_sources;
+}
+
+SourceCatalog::Source SourceCatalog::source(const QString &name) const
+{
+    for (const Source &source : m_sources) {
+        if (source.name == name)
+            return source;
+    }
+
+    return Source();
+}
+
+uint SourceCatalog::availableTypes() const
+{
+    uint types = 0;
+    for (const Source &source : m_sources)
+        types |= source.type;
+
+    return types;
+}
+
+QVector<SourceCatalog::Source> SourceCatalog::select(uint types, bool multiple, const QStringList &names) const
+{
+    QVector<Source> selected;
+
+    // Monitors first, like a dialog would list them
+    for (uint type : { uint(ScreenCastPortal::Monitor), uint(ScreenCastPortal::Window) }) {
+        if (!(types & type))
+            continue;
+
+        for (const Source &source : m_sources) {
+            if (source.type != type || (!names.isEmpty() && !names.contains(source.name)))
+                continue;
+
+            selected << source;
+            if (!multiple)
+                return selected;
+        }
+    }
+
+    return selected;
+}
+
+bool SourceCatalog::addWindow(const QString &name, const QString &monitor, const QRect &geometry)
+{
+    const Source screen = source(monitor);
+
+    if (name.isEmpty() || screen.type != ScreenCastPortal::Monitor) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Window" << name << "needs a name and an existing monitor" << monitor;
+        return false;
+    }
+
+    // Windows are shared as part of their monitor, they can't be bigger than it
+    Source window;
+    window.name = name;
+    window.type = ScreenCastPortal::Window;
+    window.geometry = geometry.intersected(QRect(QPoint(0, 0), screen.geometry.size()));
+    window.monitor = monitor;
+
+    if (window.geometry.isEmpty()) {
+        qCWarning(XdgDesktopPortalTestSourceCatalog) << "Window" << name << "is not on its monitor" << geometry;
+        return false;
+    }
+
+    m_sources << window;
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_SOURCE_CATALOG_H
+#define XDG_DESKTOP_PORTAL_TEST_SOURCE_CATALOG_H
+
+#include <QRect>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// Virtual monitors and windows the ScreenCast portal offers. Without
+// XDP_TEST_CATALOG this is a single 8x8 monitor with one window on it.
+class SourceCatalog
+{
+public:
+    struct Source {
+        QString name;
+        // ScreenCastPortal::SourceType
+        uint type = 0;
+        // Monitors are placed in the global layout, windows on their monitor
+        QRect geometry;
+        // Monitor a window is on
+        QString monitor;
+    };
+
+    SourceCatalog();
+
+    // XDP_TEST_CATALOG is either a preset ("3x4k") or a JSON file
+    static SourceCatalog fromEnvironment();
+    bool load(const QString &fileName);
+    bool loadPreset(const QString &preset);
+
+    QVector<Source> sources() const;
+    Source source(const QString &name) const;
+    // ScreenCastPortal::SourceType flags of all sources
+    uint availableTypes() const;
+
+    // What a user would pick in a dialog. With @names only those sources are
+    // candidates, otherwise monitors come before windows.
+    QVector<Source> select(uint types, bool multiple, const QStringList &names = QStringList()) const;
+
+private:
+    bool addWindow(const QString &name, const QString &monitor, const QRect &geometry);
+
+    QVector<Source> m_sources;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_SOURCE_CATALOG_H
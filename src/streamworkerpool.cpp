@@ -0,0 +1,101 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "streamworkerpool.h"
+#include "threadtuning.h"
+
+#include <QLoggingCategory>
+#include <QThread>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestStreamWorkerPool, "xdp-test-stream-worker-pool")
+
+StreamWorkerPool::StreamWorkerPool(int threads, QObject *parent)
+    : QObject(parent)
+{
+    if (threads <= 0) {
+        bool ok = false;
+        threads = qEnvironmentVariableIntValue("XDP_TEST_WORKER_THREADS", &ok);
+        if (!ok || threads <= 0)
+            threads = qMax(1, QThread::idealThreadCount());
+    }
+
+    const ThreadTuning::Settings tuning = ThreadTuning::Settings::fromEnvironment(ThreadTuning::Worker);
+
+    for (int i = 0; i < threads; i++) {
+        QThread *thread = new QThread(this);
+        thread->setObjectName(QStringLiteral("xdp-test-worker-%1").arg(i));
+        // started() is emitted from the new thread, before its event loop
+        // runs. The direct connection makes the tuning apply to that thread.
+        if (!tuning.isDefault()) {
+            connect(thread, &QThread::started, thread, [tuning, i] () {
+                ThreadTuning::apply(tuning, i);
+            }, Qt::DirectConnection);
+        }
+        thread->start();
+
+        m_threads << thread;
+        m_load.insert(thread, 0);
+    }
+
+    qCDebug(XdgDesktopPortalTestStreamWorkerPool) << "Started" << threads << "stream worker threads";
+}
+
+StreamWorkerPool::~StreamWorkerPool()
+{
+    // Objects still living in the workers get their deferred deletes processed
+    // when the thread finishes
+    for (QThread *thread : qAsConst(m_threads)) {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+int StreamWorkerPool::threadCount() const
+{
+    return m_threads.count();
+}
+
+int StreamWorkerPool::load() const
+{
+    int load = 0;
+    for (int threadLoad : m_load)
+        load += threadLoad;
+
+    return load;
+}
+
+void StreamWorkerPool::assign(QObject *object)
+{
+    Q_ASSERT(object->thread() == thread());
+
+    QThread *leastLoaded = m_threads.first();
+    for (QThread *thread : qAsConst(m_threads)) {
+        if (m_load.value(thread) < m_load.value(leastLoaded))
+            leastLoaded = thread;
+    }
+
+    m_load[leastLoaded]++;
+
+    connect(object, &QObject::destroyed, this, [this, leastLoaded] () {
+        m_load[leastLoaded]--;
+    });
+
+    object->moveToThread(leastLoaded);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_STREAM_WORKER_POOL_H
+#define XDG_DESKTOP_PORTAL_TEST_STREAM_WORKER_POOL_H
+
+#include <QHash>
+#include <QObject>
+#include <QVector>
+
+class QThread;
+
+// Fixed set of threads running stream lifecycle and frame production, so that
+// the D-Bus thread is left with handling portal requests only
+class StreamWorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    // @threads <= 0 uses XDP_TEST_WORKER_THREADS or the number of cores
+    explicit StreamWorkerPool(int threads = 0, QObject *parent = nullptr);
+    ~StreamWorkerPool();
+
+    int threadCount() const;
+    // Objects assigned to the workers which weren't destroyed yet
+    int load() const;
+
+    // Moves @object to the least loaded worker, it is accounted to that
+    // worker until it gets destroyed
+    void assign(QObject *object);
+
+private:
+    QVector<QThread *> m_threads;
+    QHash<QThread *, int> m_load;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_STREAM_WORKER_POOL_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QAtomicInt>
+#include <QFile>
+#include <QRegularExpression>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include "../binarylog.h"
+
+#include <stdio.h>
+
+// Records in the ring of binarylog.cpp
+#define RING_SIZE 16384
+
+// Logs records whose arguments check each other, until told to stop
+class LogThread : public QThread
+{
+public:
+    explicit LogThread(int id)
+        : m_id(id)
+    {
+    }
+
+    QAtomicInt stop;
+
+protected:
+    void run() override
+    {
+        for (quint64 i = 0; !stop.load(); i++)
+            BinaryLog::log(BinaryLog::BufferCountAdapted, i, m_id, i * 31 + m_id);
+    }
+
+private:
+    const int m_id;
+};
+
+class BinaryLogTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testRoundTrip();
+    void testWrap();
+    void testConcurrentDump();
+
+private:
+    // Dumps the ring and decodes it again, line by line
+    QStringList dumpAndDecode();
+
+    QTemporaryDir m_dir;
+};
+
+QStringList BinaryLogTest::dumpAndDecode()
+{
+    const QString fileName = m_dir.filePath(QStringLiteral("binary.log"));
+    if (!BinaryLog::dump(QFile::encodeName(fileName).constData()))
+        return QStringList();
+
+    FILE *out = tmpfile();
+    if (!out)
+        return QStringList();
+
+    QByteArray decoded;
+    if (BinaryLog::decode(fileName, out)) {
+        rewind(out);
+        char line[512];
+        while (fgets(line, sizeof(line), out))
+            decoded += line;
+    }
+    fclose(out);
+
+    return QString::fromUtf8(decoded).split(QLatin1Char('\n'), QString::SkipEmptyParts);
+}
+
+void BinaryLogTest::testRoundTrip()
+{
+    QVERIFY(m_dir.isValid());
+
+    BinaryLog::log(BinaryLog::SessionMessage, QStringLiteral("UpdateStream"), BinaryLog::ControlInterface);
+    BinaryLog::log(BinaryLog::StreamFormat, 1920, 1080, 2);
+    // Text is cut after 16 characters
+    BinaryLog::log(BinaryLog::StreamState, "streaming-and-much-more", 1);
+
+    const QStringList lines = dumpAndDecode();
+    QCOMPARE(lines.count(), 3);
+    QVERIFY2(lines.at(0).endsWith(QLatin1String(" session-message member=UpdateStream interface=ScreenCastControl")), qPrintable(lines.at(0)));
+    QVERIFY2(lines.at(1).endsWith(QLatin1String(" stream-format width=1920 height=1080 format=2")), qPrintable(lines.at(1)));
+    QVERIFY2(lines.at(2).endsWith(QLatin1String(" stream-state state=streaming-and-mu direction=1")), qPrintable(lines.at(2)));
+
+    // Time and the logging thread come first
+    const QRegularExpression prefix(QStringLiteral("^\\d\\d:\\d\\d:\\d\\d\\.\\d{6} \\[\\d+\\] "));
+    for (const QString &line : lines)
+        QVERIFY2(prefix.match(line).hasMatch(), qPrintable(line));
+}
+
+void BinaryLogTest::testWrap()
+{
+    // Goes around the ring, only the newest records are left
+    const int count = RING_SIZE + 100;
+    for (int i = 0; i < count; i++)
+        BinaryLog::log(BinaryLog::StreamRenegotiated, i);
+
+    const QStringList lines = dumpAndDecode();
+    QCOMPARE(lines.count(), RING_SIZE + 1);
+    QVERIFY2(lines.last().startsWith(QLatin1String("(")) && lines.last().endsWith(QLatin1String(" earlier records were overwritten)")),
+             qPrintable(lines.last()));
+
+    const QRegularExpression latency(QStringLiteral(" stream-renegotiated latency-us=(\\d+)$"));
+    for (int i = 0; i < RING_SIZE; i++) {
+        const QRegularExpressionMatch match = latency.match(lines.at(i));
+        QVERIFY2(match.hasMatch(), qPrintable(lines.at(i)));
+        QCOMPARE(match.captured(1).toInt(), count - RING_SIZE + i);
+    }
+}
+
+void BinaryLogTest::testConcurrentDump()
+{
+    // Threads wrap the ring many times over while it's dumped, every record
+    // that makes it into a dump has to be one a thread wrote as a whole
+    QList<LogThread *> threads;
+    for (int i = 1; i <= 4; i++) {
+        threads << new LogThread(i);
+        threads.last()->start();
+    }
+
+    const QRegularExpression adapted(QStringLiteral(" buffer-count-adapted from=(\\d+) to=(\\d+) round-trip-us=(\\d+)$"));
+    int records = 0;
+    for (int dump = 0; dump < 20; dump++) {
+        for (const QString &line : dumpAndDecode()) {
+            const QRegularExpressionMatch match = adapted.match(line);
+            if (!match.hasMatch())
+                continue;
+
+            const quint64 i = match.captured(1).toULongLong();
+            const quint64 id = match.captured(2).toULongLong();
+            QVERIFY2(id >= 1 && id <= 4 && match.captured(3).toULongLong() == i * 31 + id, qPrintable(line));
+            records++;
+        }
+    }
+
+    for (LogThread *thread : qAsConst(threads))
+        thread->stop.store(1);
+    for (LogThread *thread : qAsConst(threads))
+        QVERIFY(thread->wait(5000));
+    qDeleteAll(threads);
+
+    QVERIFY(records > 0);
+}
+
+QTEST_GUILESS_MAIN(BinaryLogTest)
+
+#include "binarylogtest.moc"
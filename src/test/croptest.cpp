@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QImage>
+
+#include "../framescaler.h"
+
+// Per frame cost of sharing a window as the monitor buffer plus crop
+// metadata, against copying the window out in the producer first
+class CropTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testCropByMetadata_data();
+    void testCropByMetadata();
+    void testCropByCopy_data();
+    void testCropByCopy();
+
+private:
+    void populate();
+    QImage monitorFrame(const QSize &size) const;
+};
+
+void CropTest::populate()
+{
+    QTest::addColumn<QSize>("monitor");
+    QTest::addColumn<QRect>("window");
+
+    QTest::newRow("1080p monitor, 720p window") << QSize(1920, 1080) << QRect(100, 100, 1280, 720);
+    QTest::newRow("4K monitor, 1080p window") << QSize(3840, 2160) << QRect(960, 540, 1920, 1080);
+    QTest::newRow("4K monitor, small window") << QSize(3840, 2160) << QRect(33, 17, 640, 480);
+}
+
+QImage CropTest::monitorFrame(const QSize &size) const
+{
+    QImage frame(size, QImage::Format_RGBA8888);
+    for (int y = 0; y < size.height(); y++) {
+        uint32_t *line = reinterpret_cast<uint32_t *>(frame.scanLine(y));
+        for (int x = 0; x < size.width(); x++)
+            line[x] = uint32_t(y << 16 | x);
+    }
+
+    return frame;
+}
+
+void CropTest::testCropByMetadata_data()
+{
+    populate();
+}
+
+void CropTest::testCropByMetadata()
+{
+    QFETCH(QSize, monitor);
+    QFETCH(QRect, window);
+
+    const QImage frame = monitorFrame(monitor);
+    QImage fb(window.size(), QImage::Format_RGBA8888);
+
+    // The producer queues the monitor buffer as it is, only the consumer copies the window out
+    QBENCHMARK {
+        FrameScaler::copyRect(frame.constBits(), frame.bytesPerLine(), window, fb.bits(), fb.bytesPerLine());
+    }
+
+    QCOMPARE(fb, frame.copy(window));
+}
+
+void CropTest::testCropByCopy_data()
+{
+    populate();
+}
+
+void CropTest::testCropByCopy()
+{
+    QFETCH(QSize, monitor);
+    QFETCH(QRect, window);
+
+    const QImage frame = monitorFrame(monitor);
+    QImage buffer(window.size(), QImage::Format_RGBA8888);
+    QImage fb(window.size(), QImage::Format_RGBA8888);
+
+    // The producer copies the window into a buffer of its own, the consumer copies that buffer
+    QBENCHMARK {
+        FrameScaler::copyRect(frame.constBits(), frame.bytesPerLine(), window, buffer.bits(), buffer.bytesPerLine());
+        FrameScaler::copyRect(buffer.constBits(), buffer.bytesPerLine(), QRect(QPoint(0, 0), window.size()), fb.bits(), fb.bytesPerLine());
+    }
+
+    QCOMPARE(fb, frame.copy(window));
+}
+
+QTEST_GUILESS_MAIN(CropTest)
+
+#include "croptest.moc"
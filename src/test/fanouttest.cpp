@@ -0,0 +1,291 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusMetaType>
+#include <QDBusReply>
+#include <QDBusUnixFileDescriptor>
+#include <QElapsedTimer>
+#include <QFile>
+
+#include "../pipewirecore.h"
+#include "../screencaststream.h"
+#include "../tracer.h"
+
+#include <QSignalSpy>
+
+#include <unistd.h>
+
+#define DBUS_SERVICE_NAME "org.freedesktop.portal.Desktop"
+#define DBUS_PATH "/org/freedesktop/portal/desktop"
+#define DBUS_SCREENCAST_INTERFACE_NAME "org.freedesktop.portal.ScreenCast"
+#define DBUS_REQUEST_INTERFACE_NAME "org.freedesktop.portal.Request"
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenCastControl"
+
+// Framerate the producer is switched to for the measurements
+#define FANOUT_FRAMERATE 30
+
+// One producer node consumed by a growing number of clients, the way a
+// conference shares one screen with all of its participants
+class FanOutTest : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        uint node_id;
+        QVariantMap map;
+    } Stream;
+    typedef QList<Stream> Streams;
+
+private Q_SLOTS:
+    void initTestCase();
+    void testFanOut_data();
+    void testFanOut();
+
+Q_SIGNALS:
+    void response(uint response, const QVariantMap &map);
+
+private:
+    QVariantMap request(const QString &method, const QList<QVariant> &arguments);
+    QVariantMap streamStatistics() const;
+    qint64 producerCpuTime() const;
+
+    int m_requestTokenCounter = 0;
+
+    QSize m_resolution;
+    QString m_sessionPath;
+    uint m_streamNodeId = 0;
+    uint m_producerPid = 0;
+};
+
+Q_DECLARE_METATYPE(FanOutTest::Stream);
+Q_DECLARE_METATYPE(FanOutTest::Streams);
+
+const QDBusArgument &operator >> (const QDBusArgument &arg, FanOutTest::Stream &stream)
+{
+    arg.beginStructure();
+    arg >> stream.node_id;
+
+    arg.beginMap();
+    while (!arg.atEnd()) {
+        QString key;
+        QVariant map;
+        arg.beginMapEntry();
+        arg >> key >> map;
+        arg.endMapEntry();
+        stream.map.insert(key, map);
+    }
+    arg.endMap();
+    arg.endStructure();
+
+    return arg;
+}
+
+QVariantMap FanOutTest::request(const QString &method, const QList<QVariant> &arguments)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_SERVICE_NAME),
+                                                          QStringLiteral(DBUS_PATH),
+                                                          QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME),
+                                                          method);
+    message.setArguments(arguments);
+
+    QDBusReply<QDBusObjectPath> reply = QDBusConnection::sessionBus().asyncCall(message);
+    if (!reply.isValid())
+        return QVariantMap();
+
+    QSignalSpy responseSpy(this, SIGNAL(response(uint,QVariantMap)));
+    QDBusConnection::sessionBus().connect(QString(), reply.value().path(), QStringLiteral(DBUS_REQUEST_INTERFACE_NAME),
+                                          QStringLiteral("Response"), this, SIGNAL(response(uint,QVariantMap)));
+    if (!responseSpy.wait())
+        return QVariantMap();
+
+    const QList<QVariant> responseArguments = responseSpy.takeFirst();
+    if (responseArguments.at(0).toUInt() != 0)
+        return QVariantMap();
+
+    return responseArguments.at(1).toMap();
+}
+
+QVariantMap FanOutTest::streamStatistics() const
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                          m_sessionPath,
+                                                          QStringLiteral(DBUS_CONTROL_INTERFACE_NAME),
+                                                          QStringLiteral("GetStatistics"));
+    QDBusReply<QVariantMap> reply = QDBusConnection::sessionBus().call(message);
+
+    return reply.value();
+}
+
+qint64 FanOutTest::producerCpuTime() const
+{
+    // utime and stime are the 14th and 15th field, the command name before them may contain spaces
+    QFile stat(QStringLiteral("/proc/%1/stat").arg(m_producerPid));
+    if (!stat.open(QIODevice::ReadOnly))
+        return -1;
+
+    const QByteArray contents = stat.readAll();
+    const QList<QByteArray> fields = contents.mid(contents.lastIndexOf(')') + 2).split(' ');
+    if (fields.count() < 13)
+        return -1;
+
+    // Milliseconds of CPU time
+    return (fields.at(11).toLongLong() + fields.at(12).toLongLong()) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+void FanOutTest::initTestCase()
+{
+    // Consumer side of the trace, the portal writes its own to XDP_TEST_TRACE
+    Tracer::initialize("XDP_TEST_FANOUT_TRACE");
+
+    qDBusRegisterMetaType<FanOutTest::Stream>();
+    qDBusRegisterMetaType<FanOutTest::Streams>();
+
+    QVariantMap results = request(QStringLiteral("CreateSession"),
+                                  { QVariantMap { { QLatin1String("session_handle_token"), QStringLiteral("fanout") },
+                                                  { QLatin1String("handle_token"), QStringLiteral("fanout%1").arg(++m_requestTokenCounter) } } });
+    m_sessionPath = results.value(QStringLiteral("session_handle")).toString();
+    QVERIFY(!m_sessionPath.isEmpty());
+
+    results = request(QStringLiteral("SelectSources"),
+                      { QVariant::fromValue(QDBusObjectPath(m_sessionPath)),
+                        QVariantMap { { QLatin1String("types"), (uint)1 },
+                                      { QLatin1String("handle_token"), QStringLiteral("fanout%1").arg(++m_requestTokenCounter) } } });
+
+    results = request(QStringLiteral("Start"),
+                      { QVariant::fromValue(QDBusObjectPath(m_sessionPath)), QString(),
+                        QVariantMap { { QLatin1String("handle_token"), QStringLiteral("fanout%1").arg(++m_requestTokenCounter) } } });
+    const Streams streams = qdbus_cast<Streams>(results.value(QStringLiteral("streams")));
+    QCOMPARE(streams.count(), 1);
+    m_streamNodeId = streams.first().node_id;
+    m_resolution = qdbus_cast<QSize>(streams.first().map.value(QStringLiteral("size")));
+
+    QDBusReply<uint> pid = QDBusConnection::sessionBus().interface()->servicePid(QStringLiteral(DBUS_BACKEND_SERVICE_NAME));
+    QVERIFY(pid.isValid());
+    m_producerPid = pid.value();
+
+    // The test pattern is slow by default, run it like a real screen
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                          m_sessionPath,
+                                                          QStringLiteral(DBUS_CONTROL_INTERFACE_NAME),
+                                                          QStringLiteral("UpdateStream"));
+    message << QVariantMap { { QLatin1String("framerate"), (uint)FANOUT_FRAMERATE } };
+    QCOMPARE(QDBusConnection::sessionBus().call(message).type(), QDBusMessage::ReplyMessage);
+}
+
+void FanOutTest::testFanOut_data()
+{
+    QTest::addColumn<int>("consumers");
+
+    // XDP_TEST_FANOUT_CONSUMERS runs a single scenario instead of the whole range
+    bool ok = false;
+    const int consumers = qEnvironmentVariableIntValue("XDP_TEST_FANOUT_CONSUMERS", &ok);
+    if (ok && consumers > 0) {
+        QTest::newRow(qPrintable(QString::number(consumers))) << consumers;
+        return;
+    }
+
+    for (int consumers = 1; consumers <= 64; consumers *= 2)
+        QTest::newRow(qPrintable(QString::number(consumers))) << consumers;
+}
+
+void FanOutTest::testFanOut()
+{
+    QFETCH(int, consumers);
+
+    bool ok = false;
+    int duration = qEnvironmentVariableIntValue("XDP_TEST_FANOUT_DURATION", &ok);
+    if (!ok || duration <= 0)
+        duration = 5;
+
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_SERVICE_NAME),
+                                                          QStringLiteral(DBUS_PATH),
+                                                          QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME),
+                                                          QStringLiteral("OpenPipeWireRemote"));
+    message << QVariant::fromValue(QDBusObjectPath(m_sessionPath)) << QVariantMap();
+
+    QDBusReply<QDBusUnixFileDescriptor> reply = QDBusConnection::sessionBus().asyncCall(message);
+    QVERIFY(reply.isValid());
+
+    // All clients share one remote and one loop, like in screencasttest
+    PipeWireCore *core = new PipeWireCore(reply.value(), this);
+    QList<ScreenCastStream *> streams;
+    for (int i = 0; i < consumers; i++) {
+        ScreenCastStream *stream = new ScreenCastStream(m_resolution, core, m_streamNodeId, this);
+        stream->init();
+        streams << stream;
+    }
+
+    // Only measure once every consumer is linked and getting frames
+    for (ScreenCastStream *stream : qAsConst(streams))
+        QTRY_VERIFY_WITH_TIMEOUT(stream->framesReceived() > 0, 10000);
+
+    QList<int> receivedBefore;
+    QList<int> droppedBefore;
+    for (ScreenCastStream *stream : qAsConst(streams)) {
+        receivedBefore << stream->framesReceived();
+        droppedBefore << stream->framesDropped();
+    }
+
+    const int producedBefore = streamStatistics().value(QStringLiteral("frames-produced")).toInt();
+    const qint64 cpuBefore = producerCpuTime();
+    QElapsedTimer timer;
+    timer.start();
+
+    QTest::qWait(duration * 1000);
+
+    const qint64 elapsed = timer.elapsed();
+    const qint64 cpuTime = producerCpuTime() - cpuBefore;
+    const int produced = streamStatistics().value(QStringLiteral("frames-produced")).toInt() - producedBefore;
+
+    int received = 0;
+    int dropped = 0;
+    qint64 worstMedian = 0;
+    qint64 worstTail = 0;
+    for (int i = 0; i < streams.count(); i++) {
+        const ScreenCastStream *stream = streams.at(i);
+        received += stream->framesReceived() - receivedBefore.at(i);
+        dropped += stream->framesDropped() - droppedBefore.at(i);
+        worstMedian = qMax(worstMedian, stream->frameLatency().percentile(50));
+        worstTail = qMax(worstTail, stream->frameLatency().percentile(99));
+
+        QVERIFY(stream->framesReceived() > receivedBefore.at(i));
+    }
+
+    qInfo("consumers: %d, produced: %d frames, producer cpu: %.1f%%, received: %d frames, dropped: %d frames, "
+          "latency p50: %lld us, p99: %lld us",
+          consumers, produced, 100.0 * cpuTime / elapsed, received, dropped, worstMedian, worstTail);
+
+    // Every frame is produced once for all consumers, not once per consumer
+    QVERIFY(produced <= elapsed * FANOUT_FRAMERATE / 1000 * 1.2 + 1);
+
+    qDeleteAll(streams);
+    delete core;
+}
+
+QTEST_GUILESS_MAIN(FanOutTest)
+
+#include "fanouttest.moc"
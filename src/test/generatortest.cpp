@@ -0,0 +1,312 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QThread>
+
+#include "../scenariocontent.h"
+#include "../tilecontent.h"
+#include "../tiledgenerator.h"
+#include "../tilepool.h"
+
+// Renders on its own, like the worker thread of a stream
+class FunctionThread : public QThread
+{
+public:
+    explicit FunctionThread(const std::function<void()> &function)
+        : m_function(function)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        m_function();
+    }
+
+private:
+    std::function<void()> m_function;
+};
+
+class GeneratorTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testIncremental();
+    void testConcurrentRuns();
+    void testConcurrentFrames();
+    void testScenarioParse();
+    void testScenarioDamage();
+    void testScenarioRepeatable();
+    void testFullFrame_data();
+    void testFullFrame();
+};
+
+void GeneratorTest::testIncremental()
+{
+    const QSize size(1000, 600);
+    TilePool pool(4);
+    TiledGenerator generator(new DesktopContent(size), &pool);
+    DesktopContent reference(size);
+
+    // Like a stream cycling through its buffers
+    QVector<QImage> buffers;
+    for (int i = 0; i < 3; i++)
+        buffers << QImage(size, QImage::Format_RGBX8888);
+
+    QImage expected(size, QImage::Format_RGBX8888);
+    QVector<QRect> damage;
+
+    for (int frame = 0; frame < 30; frame++) {
+        QImage &buffer = buffers[frame % buffers.count()];
+        QVERIFY(generator.renderFrame(buffer.bits(), buffer.bytesPerLine()));
+
+        reference.advance(&damage);
+        reference.render(QRect(QPoint(0, 0), size), expected.bits(), expected.bytesPerLine());
+
+        QCOMPARE(buffer, expected);
+        if (frame >= buffers.count())
+            QVERIFY(generator.renderedTiles() < generator.tileCount());
+    }
+
+    // Lost buffer contents get everything drawn again
+    generator.invalidate();
+    buffers[0].fill(Qt::black);
+    QVERIFY(generator.renderFrame(buffers[0].bits(), buffers[0].bytesPerLine()));
+    QCOMPARE(generator.renderedTiles(), generator.tileCount());
+
+    reference.advance(&damage);
+    reference.render(QRect(QPoint(0, 0), size), expected.bits(), expected.bytesPerLine());
+    QCOMPARE(buffers[0], expected);
+}
+
+void GeneratorTest::testConcurrentRuns()
+{
+    // Every tile waits for a tile of the other frame, which only works out
+    // when both frames are rendered at the same time
+    TilePool pool(2);
+    QAtomicInt started[2];
+    QAtomicInt overlapping;
+
+    auto renderFrame = [&pool, &started, &overlapping] (int frame) {
+        pool.run(4, [&started, &overlapping, frame] (int) {
+            started[frame].ref();
+
+            QElapsedTimer timer;
+            timer.start();
+            while (!started[1 - frame].load() && timer.elapsed() < 5000)
+                QThread::usleep(100);
+
+            if (started[1 - frame].load())
+                overlapping.ref();
+        });
+    };
+
+    FunctionThread other([&renderFrame] () {
+        renderFrame(1);
+    });
+    other.start();
+    renderFrame(0);
+    QVERIFY(other.wait(30000));
+
+    QCOMPARE(overlapping.load(), 8);
+}
+
+void GeneratorTest::testConcurrentFrames()
+{
+    const QSize size(640, 360);
+    TilePool pool(4);
+
+    // Streams of different worker threads sharing the pool
+    const int streamCount = 4;
+    QVector<bool> matched(streamCount, true);
+    bool *results = matched.data();
+    QList<FunctionThread *> threads;
+
+    for (int i = 0; i < streamCount; i++) {
+        threads << new FunctionThread([&pool, results, size, i] () {
+            TiledGenerator generator(new DesktopContent(size), &pool);
+            DesktopContent reference(size);
+            QImage buffer(size, QImage::Format_RGBX8888);
+            QImage expected(size, QImage::Format_RGBX8888);
+            QVector<QRect> damage;
+
+            for (int frame = 0; frame < 20; frame++) {
+                generator.renderFrame(buffer.bits(), buffer.bytesPerLine());
+                reference.advance(&damage);
+                reference.render(QRect(QPoint(0, 0), size), expected.bits(), expected.bytesPerLine());
+                if (buffer != expected)
+                    results[i] = false;
+            }
+        });
+        threads.last()->start();
+    }
+
+    for (FunctionThread *thread : qAsConst(threads))
+        QVERIFY(thread->wait(60000));
+    qDeleteAll(threads);
+
+    QCOMPARE(matched, QVector<bool>(streamCount, true));
+}
+
+void GeneratorTest::testScenarioParse()
+{
+    ScenarioContent scenario(QSize(640, 480));
+
+    QVERIFY(scenario.parse("# comment\nseed 7\ntyping 10 interval=2 size=6x12\nnoise 5 size=full\n\nidle 3\n"));
+    const QVector<ScenarioContent::Phase> phases = scenario.phases();
+    QCOMPARE(phases.count(), 3);
+    QCOMPARE(phases.at(0).type, ScenarioContent::Typing);
+    QCOMPARE(phases.at(0).frames, 10);
+    QCOMPARE(phases.at(0).interval, 2);
+    QCOMPARE(phases.at(0).size, QSize(6, 12));
+    QCOMPARE(phases.at(1).size, QSize(640, 480));
+    QCOMPARE(phases.at(2).type, ScenarioContent::Idle);
+
+    QVERIFY(!scenario.parse(""));
+    QVERIFY(!scenario.parse("sleep 10\n"));
+    QVERIFY(!scenario.parse("typing\n"));
+    QVERIFY(!scenario.parse("typing 10 interval=0\n"));
+    QVERIFY(!scenario.parse("drag 10 size=big\n"));
+    // A failed parse keeps the previous scenario
+    QCOMPARE(scenario.phases().count(), 3);
+}
+
+void GeneratorTest::testScenarioDamage()
+{
+    const QSize size(640, 480);
+    ScenarioContent scenario(size);
+    QVERIFY(scenario.parse("typing 8 interval=2 size=8x16\nidle 4\nnoise 2 size=100x100\nstatic 2\n"));
+
+    QVector<QRect> damage;
+
+    // The first frame is new as a whole
+    scenario.advance(&damage);
+    QCOMPARE(scenario.currentPhase(), 0);
+    QVERIFY(damage.contains(QRect(QPoint(0, 0), size)));
+
+    // One character every other frame
+    for (int frame = 1; frame < 8; frame++) {
+        damage.clear();
+        scenario.advance(&damage);
+        QCOMPARE(damage.count(), frame % 2 ? 0 : 1);
+        if (!damage.isEmpty())
+            QCOMPARE(damage.first().size(), QSize(8, 16));
+    }
+
+    for (int frame = 0; frame < 4; frame++) {
+        damage.clear();
+        scenario.advance(&damage);
+        QCOMPARE(scenario.currentPhase(), 1);
+        QVERIFY(damage.isEmpty());
+    }
+
+    // The video shows up and changes every frame
+    damage.clear();
+    scenario.advance(&damage);
+    QCOMPARE(scenario.currentPhase(), 2);
+    QVERIFY(!damage.isEmpty());
+    for (const QRect &rect : qAsConst(damage))
+        QCOMPARE(rect.size(), QSize(100, 100));
+
+    // And leaves its area damaged once it's closed
+    const QRect video = damage.first();
+    damage.clear();
+    scenario.advance(&damage);
+    damage.clear();
+    scenario.advance(&damage);
+    QCOMPARE(scenario.currentPhase(), 3);
+    QVERIFY(damage.contains(video));
+}
+
+void GeneratorTest::testScenarioRepeatable()
+{
+    const QSize size(320, 240);
+    const QByteArray timeline = "seed 3\nstatic 5 interval=2\ntyping 20 interval=1\ndrag 20 speed=24\nnoise 5 size=400x300\nidle 5\n";
+
+    ScenarioContent *content = new ScenarioContent(size);
+    QVERIFY(content->parse(timeline));
+    TilePool pool(4);
+    TiledGenerator generator(content, &pool);
+
+    ScenarioContent reference(size);
+    QVERIFY(reference.parse(timeline));
+
+    QVector<QImage> buffers;
+    for (int i = 0; i < 3; i++)
+        buffers << QImage(size, QImage::Format_RGBX8888);
+
+    QImage expected(size, QImage::Format_RGBX8888);
+    QVector<QImage> firstRun;
+    QVector<QRect> damage;
+
+    // Twice through the timeline, the second time has to look just like the first
+    for (int frame = 0; frame < 110; frame++) {
+        QImage &buffer = buffers[frame % buffers.count()];
+        QVERIFY(generator.renderFrame(buffer.bits(), buffer.bytesPerLine()));
+
+        reference.advance(&damage);
+        reference.render(QRect(QPoint(0, 0), size), expected.bits(), expected.bytesPerLine());
+        QCOMPARE(buffer, expected);
+
+        if (frame < 55)
+            firstRun << expected.copy();
+        else
+            QCOMPARE(expected, firstRun.at(frame - 55));
+    }
+}
+
+void GeneratorTest::testFullFrame_data()
+{
+    QTest::addColumn<int>("threads");
+
+    QTest::newRow("1 thread") << 1;
+    QTest::newRow("2 threads") << 2;
+    QTest::newRow("4 threads") << 4;
+
+    const int cores = QThread::idealThreadCount();
+    if (cores > 4)
+        QTest::newRow(qPrintable(QStringLiteral("%1 threads").arg(cores))) << cores;
+}
+
+void GeneratorTest::testFullFrame()
+{
+    QFETCH(int, threads);
+
+    const QSize size(3840, 2160);
+    TilePool pool(threads);
+    TiledGenerator generator(new DesktopContent(size), &pool);
+    QImage buffer(size, QImage::Format_RGBX8888);
+
+    // Every frame is drawn in full, as if the buffer was a new one
+    QBENCHMARK {
+        generator.invalidate();
+        generator.renderFrame(buffer.bits(), buffer.bytesPerLine());
+    }
+
+    QCOMPARE(generator.renderedTiles(), generator.tileCount());
+}
+
+QTEST_GUILESS_MAIN(GeneratorTest)
+
+#include "generatortest.moc"
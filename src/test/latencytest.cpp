@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusObjectPath>
+#include <QElapsedTimer>
+#include <QSignalSpy>
+
+#include "../pipewirecore.h"
+#include "../screencaststream.h"
+
+#include <algorithm>
+
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_PATH "/org/freedesktop/portal/desktop"
+#define DBUS_SCREENCAST_INTERFACE_NAME "org.freedesktop.impl.portal.ScreenCast"
+#define DBUS_SESSION_INTERFACE_NAME "org.freedesktop.impl.portal.Session"
+#define DBUS_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenCastControl"
+
+// Sessions streaming at once, each with a consumer at 60 fps
+#define STREAM_COUNT 50
+// Calls timed for each percentile
+#define SAMPLE_COUNT 200
+
+// Measures how quickly the backend answers D-Bus calls while many streams
+// are running, which only holds up when nothing blocks the D-Bus thread
+class LatencyTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testManyStreams();
+
+private:
+    QDBusMessage call(const QString &path, const QString &interface, const QString &method, const QVariantList &arguments);
+    QString startSession(uint &nodeId, QSize &size);
+    // Round trips of a property read in microseconds, sorted
+    QVector<qint64> sampleRoundTrips();
+
+    int m_tokenCounter = 0;
+};
+
+static qint64 percentile(const QVector<qint64> &sorted, int percent)
+{
+    return sorted.at(qMin(sorted.count() - 1, sorted.count() * percent / 100));
+}
+
+QDBusMessage LatencyTest::call(const QString &path, const QString &interface, const QString &method, const QVariantList &arguments)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME), path, interface, method);
+    message.setArguments(arguments);
+    return QDBusConnection::sessionBus().call(message);
+}
+
+QString LatencyTest::startSession(uint &nodeId, QSize &size)
+{
+    m_tokenCounter += 1;
+    const QString sessionPath = QStringLiteral("/org/freedesktop/portal/desktop/session/latency/test%1").arg(m_tokenCounter);
+    auto request = [this] (const char *method) {
+        return QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/latency/%1%2").arg(QLatin1String(method)).arg(m_tokenCounter)));
+    };
+
+    QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("CreateSession"),
+                              { request("create"), QVariant::fromValue(QDBusObjectPath(sessionPath)), QStringLiteral("org.freedesktop.test"), QVariantMap() });
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("Start"),
+                 { request("start"), QVariant::fromValue(QDBusObjectPath(sessionPath)), QStringLiteral("org.freedesktop.test"), QString(), QVariantMap() });
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    const QVariantMap results = qdbus_cast<QVariantMap>(reply.arguments().at(1));
+    const QDBusArgument streams = results.value(QStringLiteral("streams")).value<QDBusArgument>();
+    nodeId = 0;
+    streams.beginArray();
+    if (!streams.atEnd()) {
+        QVariantMap properties;
+        streams.beginStructure();
+        streams >> nodeId >> properties;
+        streams.endStructure();
+        size = qdbus_cast<QSize>(properties.value(QStringLiteral("size")));
+    }
+
+    reply = call(sessionPath, QStringLiteral(DBUS_CONTROL_INTERFACE_NAME), QStringLiteral("UpdateStream"),
+                 { QVariantMap { { QStringLiteral("framerate"), 60u } } });
+    if (reply.type() != QDBusMessage::ReplyMessage)
+        return QString();
+
+    return sessionPath;
+}
+
+QVector<qint64> LatencyTest::sampleRoundTrips()
+{
+    QVector<qint64> roundTrips;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        timer.start();
+        const QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral("org.freedesktop.DBus.Properties"), QStringLiteral("Get"),
+                                        { QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("version") });
+        if (reply.type() == QDBusMessage::ReplyMessage)
+            roundTrips << timer.nsecsElapsed() / 1000;
+    }
+
+    std::sort(roundTrips.begin(), roundTrips.end());
+    return roundTrips;
+}
+
+void LatencyTest::testManyStreams()
+{
+    const QVector<qint64> idle = sampleRoundTrips();
+    QCOMPARE(idle.count(), SAMPLE_COUNT);
+
+    PipeWireCore *core = new PipeWireCore(this);
+    QStringList sessionPaths;
+    QList<ScreenCastStream *> consumers;
+    QList<QSignalSpy *> spies;
+    QVector<qint64> startLatencies;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < STREAM_COUNT; i++) {
+        uint nodeId = 0;
+        QSize size;
+        timer.start();
+        const QString sessionPath = startSession(nodeId, size);
+        startLatencies << timer.nsecsElapsed() / 1000;
+        QVERIFY2(!sessionPath.isEmpty() && nodeId, qPrintable(QStringLiteral("Failed to start session %1").arg(i)));
+        sessionPaths << sessionPath;
+
+        ScreenCastStream *consumer = new ScreenCastStream(size, core, nodeId, this);
+        spies << new QSignalSpy(consumer, &ScreenCastStream::framebufferUpdated);
+        consumer->init();
+        consumers << consumer;
+    }
+
+    // Every stream is producing before the latency under load is taken
+    for (QSignalSpy *spy : qAsConst(spies))
+        QTRY_VERIFY_WITH_TIMEOUT(!spy->isEmpty(), 10000);
+
+    const QVector<qint64> loaded = sampleRoundTrips();
+    QCOMPARE(loaded.count(), SAMPLE_COUNT);
+
+    // The first sessions started with few streams running, the last ones with many
+    const int quarter = STREAM_COUNT / 4;
+    QVector<qint64> firstStarts = startLatencies.mid(0, quarter);
+    QVector<qint64> lastStarts = startLatencies.mid(STREAM_COUNT - quarter);
+    std::sort(firstStarts.begin(), firstStarts.end());
+    std::sort(lastStarts.begin(), lastStarts.end());
+
+    qInfo("round trip idle p50 %lld us p99 %lld us, with %d streams p50 %lld us p99 %lld us",
+          percentile(idle, 50), percentile(idle, 99), STREAM_COUNT, percentile(loaded, 50), percentile(loaded, 99));
+    qInfo("Start median of the first %d sessions %lld us, of the last %d %lld us",
+          quarter, percentile(firstStarts, 50), quarter, percentile(lastStarts, 50));
+
+    for (const QString &sessionPath : qAsConst(sessionPaths))
+        call(sessionPath, QStringLiteral(DBUS_SESSION_INTERFACE_NAME), QStringLiteral("Close"), {});
+    qDeleteAll(spies);
+    qDeleteAll(consumers);
+    delete core;
+
+    // Flat within what scheduling noise on a loaded machine accounts for
+    QVERIFY(percentile(loaded, 50) <= qMax(percentile(idle, 50) * 3, percentile(idle, 50) + 1000));
+    QVERIFY(percentile(loaded, 99) <= qMax(percentile(idle, 99) * 3, percentile(idle, 99) + 5000));
+    QVERIFY(percentile(lastStarts, 50) <= qMax(percentile(firstStarts, 50) * 3, percentile(firstStarts, 50) + 20000));
+}
+
+QTEST_GUILESS_MAIN(LatencyTest)
+
+#include "latencytest.moc"
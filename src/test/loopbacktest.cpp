@@ -0,0 +1,458 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QImage>
+#include <QSet>
+#include <QSignalSpy>
+#include <QThread>
+
+#include <functional>
+
+#include "../framebufferpool.h"
+#include "../loopbacktransport.h"
+#include "../screencaststream.h"
+
+// Writes frames on its own, like the PipeWire thread of a stream
+class FunctionThread : public QThread
+{
+public:
+    explicit FunctionThread(const std::function<void()> &function)
+        : m_function(function)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        m_function();
+    }
+
+private:
+    std::function<void()> m_function;
+};
+
+// Producer and consumer stream connected in-process, so that negotiation
+// and the copy paths can be measured without a PipeWire daemon or D-Bus
+class LoopbackTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testRoundTrip();
+    void testSwapAndScale();
+    void testCropRegion();
+    void testCopyPath_data();
+    void testCopyPath();
+    void testRenegotiation();
+    void testFormatRenegotiationKeepsBuffers();
+    void testCoalescedNotifications();
+    void testFramebufferReuse();
+    void testSuspendResume();
+
+private:
+    QImage pattern(const QSize &size) const;
+};
+
+QImage LoopbackTest::pattern(const QSize &size) const
+{
+    QImage frame(size, QImage::Format_RGBA8888);
+    for (int y = 0; y < size.height(); y++) {
+        uint32_t *line = reinterpret_cast<uint32_t *>(frame.scanLine(y));
+        for (int x = 0; x < size.width(); x++)
+            line[x] = 0xff000000 | uint32_t((y & 0xff) << 8 | (x & 0xff));
+    }
+
+    return frame;
+}
+
+void LoopbackTest::testRoundTrip()
+{
+    const QSize size(320, 240);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+    QCOMPARE(output.negotiatedSize(), size);
+    QCOMPARE(input.negotiatedSize(), size);
+    QVERIFY(transport.bufferCount() > 0);
+    QCOMPARE(output.bufferCount(), transport.bufferCount());
+
+    const QImage frame = pattern(size);
+    for (int i = 0; i < 3; i++)
+        QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+
+    QCOMPARE(output.framesProduced(), 3);
+    QCOMPARE(input.framesReceived(), 3);
+    QCOMPARE(input.framesDropped(), 0);
+    QCOMPARE(input.framebuffer(), frame);
+
+    // Only the crop region ends up in the consumer's framebuffer
+    const QRect crop(10, 20, 100, 50);
+    output.setCropRegion(crop);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.cropRegion(), crop);
+    QCOMPARE(input.framebuffer(), frame.copy(crop));
+}
+
+void LoopbackTest::testSwapAndScale()
+{
+    const QSize size(320, 240);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    const QImage frame = pattern(size);
+
+    // Bytes of the pixel at @point in memory order, the pattern has x in red
+    // and y in green
+    auto bytes = [] (const QImage &image, const QPoint &point) {
+        const uchar *pixel = image.constScanLine(point.y()) + point.x() * 4;
+        return QByteArray(reinterpret_cast<const char *>(pixel), 3);
+    };
+    auto bgr = [] (int blue, int green, int red) {
+        const char pixel[] = { char(blue), char(green), char(red) };
+        return QByteArray(pixel, sizeof(pixel));
+    };
+    const QList<QPoint> points = { QPoint(0, 0), QPoint(159, 0), QPoint(0, 119), QPoint(37, 91), QPoint(159, 119) };
+
+    // Same size in the other byte order, the consumer ends up with BGRx
+    QVERIFY(output.renegotiate(QSize(), 0, ScreenCastStream::FormatBGRx));
+    QCOMPARE(input.negotiatedFormat(), ScreenCastStream::FormatBGRx);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.framebuffer().convertToFormat(QImage::Format_RGBA8888), frame);
+    for (const QPoint &point : { QPoint(0, 0), QPoint(255, 0), QPoint(3, 239), QPoint(200, 100) })
+        QCOMPARE(bytes(input.framebuffer(), point), bgr(0, point.y(), point.x()));
+
+    // Half the size, frames get scaled down on the way, averaging 2x2 pixels
+    QVERIFY(output.renegotiate(QSize(160, 120), 0, ScreenCastStream::FormatRGBx));
+    QCOMPARE(input.negotiatedSize(), QSize(160, 120));
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.framebuffer().size(), QSize(160, 120));
+    for (const QPoint &point : points) {
+        const QRgb pixel = input.framebuffer().pixel(point);
+        QCOMPARE(qRed(pixel), (2 * point.x() + 1) & 0xff);
+        QCOMPARE(qGreen(pixel), 2 * point.y() + 1);
+        QCOMPARE(qBlue(pixel), 0);
+    }
+
+    // Both at once
+    QVERIFY(output.renegotiate(QSize(160, 120), 0, ScreenCastStream::FormatBGRx));
+    QCOMPARE(input.negotiatedFormat(), ScreenCastStream::FormatBGRx);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    for (const QPoint &point : points)
+        QCOMPARE(bytes(input.framebuffer(), point), bgr(0, 2 * point.y() + 1, (2 * point.x() + 1) & 0xff));
+}
+
+void LoopbackTest::testCropRegion()
+{
+    const QSize size(320, 240);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    const QImage frame = pattern(size);
+
+    // Regions reaching out of the frame are clipped to it
+    output.setCropRegion(QRect(300, 200, 100, 100));
+    QCOMPARE(output.cropRegion(), QRect(300, 200, 20, 40));
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.cropRegion(), QRect(300, 200, 20, 40));
+    QCOMPARE(input.framebuffer(), frame.copy(QRect(300, 200, 20, 40)));
+
+    // The region follows the consumer's scaling, pixels are averaged 2x2 and
+    // the pattern has x in red and y in green
+    output.setCropRegion(QRect(10, 20, 100, 50));
+    QVERIFY(output.renegotiate(QSize(160, 120), 0, ScreenCastStream::FormatRGBx));
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.cropRegion(), QRect(5, 10, 50, 25));
+    const QImage scaled = input.framebuffer();
+    QCOMPARE(scaled.size(), QSize(50, 25));
+    for (const QPoint &point : { QPoint(0, 0), QPoint(49, 0), QPoint(0, 24), QPoint(17, 11), QPoint(49, 24) }) {
+        const QRgb pixel = scaled.pixel(point);
+        QCOMPARE(qRed(pixel), 2 * (5 + point.x()) + 1);
+        QCOMPARE(qGreen(pixel), 2 * (10 + point.y()) + 1);
+        QCOMPARE(qBlue(pixel), 0);
+    }
+
+    // A null region shares the whole frame again
+    output.setCropRegion(QRect());
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.cropRegion(), QRect(0, 0, 160, 120));
+    QCOMPARE(input.framebuffer().size(), QSize(160, 120));
+}
+
+void LoopbackTest::testCopyPath_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<bool>("bgrx");
+
+    QTest::newRow("720p RGBx") << QSize(1280, 720) << false;
+    QTest::newRow("1080p RGBx") << QSize(1920, 1080) << false;
+    QTest::newRow("1080p BGRx") << QSize(1920, 1080) << true;
+    QTest::newRow("4K RGBx") << QSize(3840, 2160) << false;
+}
+
+void LoopbackTest::testCopyPath()
+{
+    QFETCH(QSize, size);
+    QFETCH(bool, bgrx);
+
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+    if (bgrx)
+        QVERIFY(output.renegotiate(QSize(), 0, ScreenCastStream::FormatBGRx));
+
+    const QImage frame = pattern(size);
+    uint8_t *data = const_cast<uint8_t *>(frame.constBits());
+
+    // Producer copy into the buffer, metadata, and the consumer's copy out of it
+    QBENCHMARK {
+        output.writeFrame(data);
+    }
+
+    QCOMPARE(input.framesReceived(), output.framesProduced());
+}
+
+void LoopbackTest::testRenegotiation()
+{
+    const QSize size(1920, 1080);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    // Framerate changes keep the buffers, size changes replace all of them
+    const int count = output.bufferCount();
+    const int added = output.buffersAdded();
+    const int removed = output.buffersRemoved();
+    QVERIFY(output.renegotiate(QSize(), 60, ScreenCastStream::FormatRGBx));
+    QCOMPARE(input.framerate(), 60u);
+    QCOMPARE(output.buffersAdded(), added);
+    QCOMPARE(output.buffersRemoved(), removed);
+
+    QVERIFY(output.renegotiate(QSize(1280, 720), 0, ScreenCastStream::FormatRGBx));
+    QCOMPARE(output.buffersAdded(), added + count);
+    QCOMPARE(output.buffersRemoved(), removed + count);
+
+    bool small = true;
+    QBENCHMARK {
+        small = !small;
+        output.renegotiate(small ? QSize(1280, 720) : size, 0, ScreenCastStream::FormatRGBx);
+    }
+
+    // Every buffer that went away was replaced, none is left over
+    QVERIFY(output.buffersAdded() > added + count);
+    QCOMPARE(output.buffersAdded() - output.buffersRemoved(), output.bufferCount());
+    QCOMPARE(output.bufferCount(), count);
+}
+
+void LoopbackTest::testFormatRenegotiationKeepsBuffers()
+{
+    const QSize size(640, 480);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    const int count = output.bufferCount();
+    QVERIFY(count > 0);
+    QCOMPARE(output.buffersAdded(), count);
+    QCOMPARE(output.buffersRemoved(), 0);
+
+    // Neither the framerate nor the byte order changes the buffers
+    QVERIFY(output.renegotiate(QSize(), 60, ScreenCastStream::FormatRGBx));
+    QVERIFY(output.renegotiate(QSize(), 0, ScreenCastStream::FormatBGRx));
+    QCOMPARE(input.negotiatedFormat(), ScreenCastStream::FormatBGRx);
+    QCOMPARE(input.framerate(), 60u);
+    QCOMPARE(output.buffersAdded(), count);
+    QCOMPARE(output.buffersRemoved(), 0);
+    QCOMPARE(input.buffersAdded(), count);
+    QCOMPARE(input.buffersRemoved(), 0);
+
+    // Frames still go through the buffers we kept
+    const QImage frame = pattern(size);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.framesReceived(), 1);
+
+    // A new size needs new buffers
+    QVERIFY(output.renegotiate(QSize(320, 240), 0, ScreenCastStream::FormatBGRx));
+    QCOMPARE(output.buffersRemoved(), count);
+    QCOMPARE(output.buffersAdded(), 2 * count);
+    QCOMPARE(output.bufferCount(), count);
+}
+
+void LoopbackTest::testCoalescedNotifications()
+{
+    const QSize size(64, 64);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    QSignalSpy spy(&input, &ScreenCastStream::framebufferUpdated);
+
+    // The loopback transport reads every frame in the thread writing it, so
+    // frames are written from another thread, like PipeWire would deliver
+    // them, while this thread and its event loop wait for it
+    QImage frame(size, QImage::Format_RGBA8888);
+    auto writeFrames = [&output, &frame] (int count) {
+        QAtomicInt written;
+        FunctionThread writer([&output, &frame, &written, count] () {
+            for (int i = 0; i < count; i++) {
+                frame.fill(qRgba(i, 255 - i, 0, 255));
+                if (output.writeFrame(frame.bits()))
+                    written.ref();
+            }
+        });
+        writer.start();
+        writer.wait();
+        return written.load();
+    };
+
+    // A burst of frames while the receiver is busy queues a single wake-up
+    const int frameCount = 100;
+    QCOMPARE(writeFrames(frameCount), frameCount);
+
+    QCOMPARE(input.framesReceived(), frameCount);
+    QCOMPARE(spy.count(), 0);
+    QCOMPARE(input.coalescedNotifications(), frameCount - 1);
+
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(input.framebuffer(), frame);
+
+    // Once handled, the next frame wakes the receiver again
+    const QImage held = input.framebuffer();
+    QCOMPARE(writeFrames(1), 1);
+    QCoreApplication::processEvents();
+    QCOMPARE(spy.count(), 2);
+    QCOMPARE(input.framebuffer(), frame);
+    // A frame the receiver still holds is never written to
+    QVERIFY(held != frame);
+}
+
+void LoopbackTest::testFramebufferReuse()
+{
+    const QSize size(256, 128);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    QImage frame(size, QImage::Format_RGBA8888);
+    frame.fill(Qt::red);
+    QVERIFY(output.writeFrame(frame.bits()));
+
+    // Front and back buffer take turns, as long as nobody holds on to a frame
+    // no framebuffer gets allocated or detached into a copy
+    const quint64 allocations = FramebufferPool::instance()->statistics().allocations;
+    QSet<const uchar *> framebuffers;
+    for (int i = 0; i < 20; i++) {
+        frame.fill(qRgba(i, 0, 255 - i, 255));
+        QVERIFY(output.writeFrame(frame.bits()));
+        framebuffers << input.framebuffer().constBits();
+    }
+
+    QCOMPARE(framebuffers.count(), 2);
+    QCOMPARE(FramebufferPool::instance()->statistics().allocations, allocations);
+
+    // A frame still held gets its memory back to the pool once released
+    QImage held = input.framebuffer();
+    const uchar *heldBits = held.constBits();
+    QVERIFY(output.writeFrame(frame.bits()));
+    QVERIFY(output.writeFrame(frame.bits()));
+    QCOMPARE(held.constBits(), heldBits);
+    held = QImage();
+
+    const quint64 reuses = FramebufferPool::instance()->statistics().reuses;
+    const QImage image = FramebufferPool::instance()->acquireImage(size, QImage::Format_RGBA8888);
+    QCOMPARE(FramebufferPool::instance()->statistics().reuses, reuses + 1);
+    QCOMPARE(image.constBits(), heldBits);
+}
+
+void LoopbackTest::testSuspendResume()
+{
+    const QSize size(320, 240);
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+
+    const ScreenCastStream::BufferSettings settings = output.bufferSettings();
+    const int count = output.bufferCount();
+    QCOMPARE(count, settings.buffers);
+    QCOMPARE(output.idleMemory(), qint64(0));
+
+    // A paused consumer keeps the node, format and buffers
+    output.suspend(false);
+    QVERIFY(output.isSuspended());
+    QCOMPARE(output.negotiatedSize(), size);
+    QCOMPARE(output.bufferCount(), count);
+    QCOMPARE(output.idleMemory(), output.bufferMemory());
+    const qint64 idleMemory = output.idleMemory();
+    QVERIFY(idleMemory > 0);
+
+    // The first frame after resuming is queued right away
+    output.resume();
+    QVERIFY(!output.isSuspended());
+    const QImage frame = pattern(size);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.framesReceived(), 1);
+    QVERIFY(output.resumeLatency() >= 0);
+
+    // Releasing memory shrinks the buffers to the minimal count until resumed
+    output.suspend(true);
+    QCOMPARE(output.bufferCount(), settings.minBuffers);
+    QVERIFY(output.idleMemory() < idleMemory || settings.minBuffers == count);
+    QCOMPARE(output.negotiatedSize(), size);
+
+    output.resume();
+    QCOMPARE(output.bufferCount(), count);
+    QVERIFY(output.writeFrame(const_cast<uint8_t *>(frame.constBits())));
+    QCOMPARE(input.framesReceived(), 2);
+    QCOMPARE(input.framebuffer(), frame);
+}
+
+QTEST_GUILESS_MAIN(LoopbackTest)
+
+#include "loopbacktest.moc"
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+
+#include "../latencyhistogram.h"
+#include "../loopbacktransport.h"
+#include "../screencaststream.h"
+
+#include <unistd.h>
+
+// Seconds every case of the matrix runs
+#define DEFAULT_DURATION 1
+// Percent a metric may be worse than its baseline
+#define DEFAULT_TOLERANCE 25
+
+// Frames going through a producer and consumer stream over the loopback
+// transport at fixed rates, compared against the results of an earlier run.
+// Baselines depend on the machine, record them with
+// XDP_TEST_PERF_UPDATE_BASELINE=1 before making changes.
+class PerfTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void testMatrix_data();
+    void testMatrix();
+    void cleanupTestCase();
+
+private:
+    QString m_baselineFile;
+    QString m_resultsFile;
+    QJsonObject m_baseline;
+    QJsonObject m_results;
+    int m_duration = DEFAULT_DURATION;
+    double m_tolerance = DEFAULT_TOLERANCE / 100.0;
+    bool m_updateBaseline = false;
+};
+
+static qint64 residentMemory()
+{
+    QFile statm(QStringLiteral("/proc/self/statm"));
+    if (!statm.open(QIODevice::ReadOnly))
+        return 0;
+
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.count() < 2)
+        return 0;
+
+    return fields.at(1).toLongLong() * getpagesize();
+}
+
+void PerfTest::initTestCase()
+{
+    m_baselineFile = qEnvironmentVariableIsSet("XDP_TEST_PERF_BASELINE") ? QFile::decodeName(qgetenv("XDP_TEST_PERF_BASELINE"))
+                                                                         : QStringLiteral(PERF_BASELINE_FILE);
+    m_resultsFile = qEnvironmentVariableIsSet("XDP_TEST_PERF_RESULTS") ? QFile::decodeName(qgetenv("XDP_TEST_PERF_RESULTS"))
+                                                                       : QStringLiteral(PERF_RESULTS_FILE);
+    m_updateBaseline = qgetenv("XDP_TEST_PERF_UPDATE_BASELINE") == "1";
+
+    bool ok = false;
+    const int duration = qEnvironmentVariableIntValue("XDP_TEST_PERF_DURATION", &ok);
+    if (ok && duration > 0)
+        m_duration = duration;
+    const int tolerance = qEnvironmentVariableIntValue("XDP_TEST_PERF_TOLERANCE", &ok);
+    if (ok && tolerance >= 0)
+        m_tolerance = tolerance / 100.0;
+
+    QFile baseline(m_baselineFile);
+    if (!m_updateBaseline && baseline.open(QIODevice::ReadOnly))
+        m_baseline = QJsonDocument::fromJson(baseline.readAll()).object().value(QStringLiteral("cases")).toObject();
+
+    if (m_baseline.isEmpty() && !m_updateBaseline)
+        qInfo("No baseline in %s, only the framerate is checked, record one with XDP_TEST_PERF_UPDATE_BASELINE=1", qPrintable(m_baselineFile));
+}
+
+void PerfTest::testMatrix_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<bool>("bgrx");
+    QTest::addColumn<uint>("framerate");
+
+    const QList<QPair<QString, QSize>> sizes = {
+        { QStringLiteral("720p"), QSize(1280, 720) },
+        { QStringLiteral("1080p"), QSize(1920, 1080) },
+        { QStringLiteral("4K"), QSize(3840, 2160) },
+    };
+
+    for (const QPair<QString, QSize> &size : sizes) {
+        for (bool bgrx : { false, true }) {
+            for (uint framerate : { 30u, 60u, 144u }) {
+                const QString name = QStringLiteral("%1 %2 %3").arg(size.first, bgrx ? QStringLiteral("BGRx") : QStringLiteral("RGBx")).arg(framerate);
+                QTest::newRow(qPrintable(name)) << size.second << bgrx << framerate;
+            }
+        }
+    }
+}
+
+void PerfTest::testMatrix()
+{
+    QFETCH(QSize, size);
+    QFETCH(bool, bgrx);
+    QFETCH(uint, framerate);
+
+    LoopbackTransport transport;
+    ScreenCastStream output(size);
+    ScreenCastStream input(size, QDBusUnixFileDescriptor(), 0);
+
+    QVERIFY(output.initLoopback(&transport));
+    QVERIFY(input.initLoopback(&transport));
+    QVERIFY(output.renegotiate(QSize(), framerate, bgrx ? ScreenCastStream::FormatBGRx : ScreenCastStream::FormatRGBx));
+
+    QImage frame(size, QImage::Format_RGBA8888);
+    frame.fill(Qt::darkCyan);
+
+    // Frames are paced at the framerate, each one copied into a buffer by
+    // the producer and out of it by the consumer
+    const qint64 interval = 1000000000LL / framerate;
+    LatencyHistogram latency;
+    qint64 copyTime = 0;
+    QElapsedTimer clock;
+    clock.start();
+    int frames = 0;
+    while (clock.nsecsElapsed() < m_duration * 1000000000LL) {
+        const qint64 due = frames * interval;
+        const qint64 wait = due - clock.nsecsElapsed();
+        if (wait > 0)
+            QThread::usleep(wait / 1000);
+
+        const qint64 start = clock.nsecsElapsed();
+        QVERIFY(output.writeFrame(frame.bits()));
+        const qint64 took = clock.nsecsElapsed() - start;
+        latency.record(took / 1000);
+        copyTime += took;
+        frames++;
+    }
+    const qint64 elapsed = clock.nsecsElapsed();
+
+    QCOMPARE(input.framesReceived(), frames);
+
+    QJsonObject result;
+    result.insert(QStringLiteral("fps"), frames * 1000000000.0 / elapsed);
+    result.insert(QStringLiteral("latency-p99"), latency.percentile(99));
+    result.insert(QStringLiteral("copy-gbps"), 2.0 * frames * size.width() * size.height() * 4 / qMax<qint64>(1, copyTime));
+    result.insert(QStringLiteral("rss"), residentMemory());
+
+    const QString name = QString::fromLatin1(QTest::currentDataTag());
+    m_results.insert(name, result);
+
+    qInfo("%s: %.1f fps, latency p99: %lld us, copy: %.2f GB/s, rss: %lld kB", QTest::currentDataTag(),
+          result.value(QStringLiteral("fps")).toDouble(), latency.percentile(99),
+          result.value(QStringLiteral("copy-gbps")).toDouble(), residentMemory() / 1024);
+
+    // The rate the consumer asked for has to be kept up regardless of any baseline
+    QVERIFY2(result.value(QStringLiteral("fps")).toDouble() >= framerate * (1.0 - m_tolerance),
+             qPrintable(QStringLiteral("Sustained %1 fps of %2").arg(result.value(QStringLiteral("fps")).toDouble()).arg(framerate)));
+
+    // Without a baseline there is nothing to find regressions against
+    if (!m_baseline.contains(name)) {
+        if (!m_updateBaseline)
+            QSKIP("No baseline for this case, only the framerate was checked");
+        return;
+    }
+
+    const QJsonObject baseline = m_baseline.value(name).toObject();
+    auto check = [&] (const QString &metric, bool higherIsBetter) {
+        if (!baseline.contains(metric))
+            return true;
+
+        const double expected = baseline.value(metric).toDouble();
+        const double actual = result.value(metric).toDouble();
+        const bool passed = higherIsBetter ? actual >= expected * (1.0 - m_tolerance) : actual <= expected * (1.0 + m_tolerance);
+        if (!passed)
+            qWarning("%s regressed: %g, baseline %g", qPrintable(metric), actual, expected);
+        return passed;
+    };
+
+    const bool latencyPassed = check(QStringLiteral("latency-p99"), false);
+    const bool copyPassed = check(QStringLiteral("copy-gbps"), true);
+    const bool memoryPassed = check(QStringLiteral("rss"), false);
+    QVERIFY(latencyPassed && copyPassed && memoryPassed);
+}
+
+void PerfTest::cleanupTestCase()
+{
+    QJsonObject document;
+    document.insert(QStringLiteral("duration"), m_duration);
+    document.insert(QStringLiteral("cases"), m_results);
+    const QByteArray json = QJsonDocument(document).toJson();
+
+    QFile results(m_resultsFile);
+    if (results.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        results.write(json);
+    else
+        qWarning("Failed to write results to %s", qPrintable(m_resultsFile));
+
+    if (m_updateBaseline) {
+        QFile baseline(m_baselineFile);
+        if (baseline.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            baseline.write(json);
+        else
+            qWarning("Failed to write baseline to %s", qPrintable(m_baselineFile));
+    }
+}
+
+QTEST_GUILESS_MAIN(PerfTest)
+
+#include "perftest.moc"
@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QFile>
+#include <QTemporaryDir>
+
+#include "../replaysource.h"
+
+// Raw and Y4M files are replayed frame by frame, converted to RGBx
+class ReplayTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void testRawFrames();
+    void testLoop();
+    void testY4M();
+    void testInvalidFiles();
+
+private:
+    QString writeFile(const QString &name, const QByteArray &contents);
+
+    QTemporaryDir m_dir;
+};
+
+void ReplayTest::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+}
+
+QString ReplayTest::writeFile(const QString &name, const QByteArray &contents)
+{
+    const QString fileName = m_dir.filePath(name);
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(contents) != contents.size())
+        return QString();
+
+    return fileName;
+}
+
+// Three 4x2 frames, every byte of frame n is n + 1
+static QByteArray rawFrames()
+{
+    QByteArray contents;
+    for (int frame = 0; frame < 3; frame++)
+        contents += QByteArray(4 * 2 * 4, char(frame + 1));
+
+    return contents;
+}
+
+void ReplayTest::testRawFrames()
+{
+    const QString fileName = writeFile(QStringLiteral("raw"), rawFrames());
+    QVERIFY(!fileName.isEmpty());
+
+    ReplaySource source;
+    QVERIFY(source.open(fileName, QSize(4, 2)));
+    QCOMPARE(source.size(), QSize(4, 2));
+    QCOMPARE(source.frameRate(), 0u);
+
+    // Lines are padded, padding has to stay untouched
+    const int stride = 4 * 4 + 8;
+    QByteArray buffer(stride * 2, '\0');
+    uint8_t *data = reinterpret_cast<uint8_t *>(buffer.data());
+
+    for (int frame = 0; frame < 3; frame++) {
+        QVERIFY(!source.atEnd());
+        QVERIFY(source.renderFrame(data, stride));
+        for (int y = 0; y < 2; y++) {
+            QCOMPARE(buffer.mid(y * stride, 16), QByteArray(16, char(frame + 1)));
+            QCOMPARE(buffer.mid(y * stride + 16, 8), QByteArray(8, '\0'));
+        }
+    }
+
+    QVERIFY(!source.renderFrame(data, stride));
+    QVERIFY(source.atEnd());
+}
+
+void ReplayTest::testLoop()
+{
+    const QString fileName = writeFile(QStringLiteral("loop"), rawFrames());
+    QVERIFY(!fileName.isEmpty());
+
+    ReplaySource source;
+    source.setLoop(true);
+    QVERIFY(source.open(fileName, QSize(4, 2)));
+
+    QByteArray buffer(4 * 4 * 2, '\0');
+    uint8_t *data = reinterpret_cast<uint8_t *>(buffer.data());
+
+    for (int frame = 0; frame < 7; frame++) {
+        QVERIFY(source.renderFrame(data, 4 * 4));
+        QCOMPARE(buffer, QByteArray(buffer.size(), char(frame % 3 + 1)));
+    }
+    QVERIFY(!source.atEnd());
+}
+
+void ReplayTest::testY4M()
+{
+    // 2x2 4:4:4 frames, white then black, BT.601 limited range
+    QByteArray contents("YUV4MPEG2 W2 H2 F30000:1001 Ip C444\n");
+    contents += "FRAME\n";
+    contents += QByteArray(4, char(235)) + QByteArray(8, char(128));
+    contents += "FRAME Ixyz\n";
+    contents += QByteArray(4, char(16)) + QByteArray(8, char(128));
+
+    const QString fileName = writeFile(QStringLiteral("replay.y4m"), contents);
+    QVERIFY(!fileName.isEmpty());
+
+    ReplaySource source;
+    QVERIFY(source.open(fileName));
+    QCOMPARE(source.size(), QSize(2, 2));
+    QCOMPARE(source.frameRate(), 30u);
+
+    QByteArray buffer(2 * 4 * 2, '\0');
+    uint8_t *data = reinterpret_cast<uint8_t *>(buffer.data());
+
+    QVERIFY(source.renderFrame(data, 2 * 4));
+    for (int pixel = 0; pixel < 4; pixel++)
+        QCOMPARE(buffer.mid(pixel * 4, 4), QByteArray("\xff\xff\xff\xff", 4));
+
+    QVERIFY(source.renderFrame(data, 2 * 4));
+    for (int pixel = 0; pixel < 4; pixel++)
+        QCOMPARE(buffer.mid(pixel * 4, 4), QByteArray("\x00\x00\x00\xff", 4));
+
+    QVERIFY(!source.renderFrame(data, 2 * 4));
+    QVERIFY(source.atEnd());
+}
+
+void ReplayTest::testInvalidFiles()
+{
+    ReplaySource source;
+
+    QVERIFY(!source.open(m_dir.filePath(QStringLiteral("missing"))));
+
+    // Raw files need a size, and at least one frame of it
+    const QString raw = writeFile(QStringLiteral("short"), QByteArray(16, '\0'));
+    QVERIFY(!raw.isEmpty());
+    QVERIFY(!source.open(raw));
+    QVERIFY(!source.open(raw, QSize(4, 2)));
+
+    const QString y4m = writeFile(QStringLiteral("bad.y4m"), QByteArray("YUV4MPEG2 W2 H2 C411\nFRAME\n"));
+    QVERIFY(!y4m.isEmpty());
+    QVERIFY(!source.open(y4m));
+    QVERIFY(source.atEnd());
+}
+
+QTEST_GUILESS_MAIN(ReplayTest)
+
+#include "replaytest.moc"
@@ -0,0 +1,220 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusObjectPath>
+#include <QElapsedTimer>
+
+#include <algorithm>
+
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_PATH "/org/freedesktop/portal/desktop"
+#define DBUS_SCREENCAST_INTERFACE_NAME "org.freedesktop.impl.portal.ScreenCast"
+#define DBUS_SESSION_INTERFACE_NAME "org.freedesktop.impl.portal.Session"
+
+// Sessions started in each scenario
+#define ROUND_COUNT 10
+
+class RestoreTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testVersion();
+    void testRestore();
+    void testOtherApplication();
+
+private:
+    // Talks to the backend directly, measuring it without the frontend
+    QDBusMessage call(const QString &path, const QString &interface, const QString &method, const QVariantList &arguments);
+    QString createSession(const QString &appId = QStringLiteral("org.freedesktop.test"));
+    bool selectSources(const QString &sessionPath, const QVariantMap &options);
+    bool start(const QString &sessionPath, QVariantMap &results);
+    void closeSession(const QString &sessionPath);
+
+    int m_tokenCounter = 0;
+};
+
+static uint firstNodeId(const QVariantMap &results)
+{
+    const QDBusArgument streams = results.value(QStringLiteral("streams")).value<QDBusArgument>();
+    uint nodeId = 0;
+
+    streams.beginArray();
+    if (!streams.atEnd()) {
+        streams.beginStructure();
+        streams >> nodeId;
+        streams.endStructure();
+    }
+
+    return nodeId;
+}
+
+static qint64 median(QVector<qint64> values)
+{
+    std::sort(values.begin(), values.end());
+    return values.at(values.count() / 2);
+}
+
+QDBusMessage RestoreTest::call(const QString &path, const QString &interface, const QString &method, const QVariantList &arguments)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME), path, interface, method);
+    message.setArguments(arguments);
+    return QDBusConnection::sessionBus().call(message);
+}
+
+QString RestoreTest::createSession(const QString &appId)
+{
+    m_tokenCounter += 1;
+    const QString sessionPath = QStringLiteral("/org/freedesktop/portal/desktop/session/restore/test%1").arg(m_tokenCounter);
+    const QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("CreateSession"),
+                                    { QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/restore/create%1").arg(m_tokenCounter))),
+                                      QVariant::fromValue(QDBusObjectPath(sessionPath)),
+                                      appId,
+                                      QVariantMap() });
+
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    return sessionPath;
+}
+
+bool RestoreTest::selectSources(const QString &sessionPath, const QVariantMap &options)
+{
+    const QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("SelectSources"),
+                                    { QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/restore/select%1").arg(m_tokenCounter))),
+                                      QVariant::fromValue(QDBusObjectPath(sessionPath)),
+                                      QStringLiteral("org.freedesktop.test"),
+                                      options });
+
+    return reply.type() == QDBusMessage::ReplyMessage && reply.arguments().at(0).toUInt() == 0;
+}
+
+bool RestoreTest::start(const QString &sessionPath, QVariantMap &results)
+{
+    const QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("Start"),
+                                    { QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/restore/start%1").arg(m_tokenCounter))),
+                                      QVariant::fromValue(QDBusObjectPath(sessionPath)),
+                                      QStringLiteral("org.freedesktop.test"),
+                                      QString(),
+                                      QVariantMap() });
+
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return false;
+
+    results = qdbus_cast<QVariantMap>(reply.arguments().at(1));
+    return true;
+}
+
+void RestoreTest::closeSession(const QString &sessionPath)
+{
+    call(sessionPath, QStringLiteral(DBUS_SESSION_INTERFACE_NAME), QStringLiteral("Close"), {});
+}
+
+void RestoreTest::testVersion()
+{
+    const QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral("org.freedesktop.DBus.Properties"), QStringLiteral("Get"),
+                                    { QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("version") });
+    QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(qvariant_cast<QDBusVariant>(reply.arguments().at(0)).variant().toUInt(), 4u);
+}
+
+void RestoreTest::testRestore()
+{
+    QVector<qint64> coldTimes;
+    QVector<qint64> restoreTimes;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < ROUND_COUNT; i++) {
+        // A first start runs the whole selection and creates the stream
+        timer.start();
+        QString sessionPath = createSession();
+        QVERIFY(!sessionPath.isEmpty());
+        QVERIFY(selectSources(sessionPath, { { QStringLiteral("types"), 1u }, { QStringLiteral("persist_mode"), 2u } }));
+        QVariantMap results;
+        QVERIFY(start(sessionPath, results));
+        coldTimes << timer.nsecsElapsed() / 1000;
+
+        QCOMPARE(results.value(QStringLiteral("persist_mode")).toUInt(), 2u);
+        QVERIFY(results.contains(QStringLiteral("restore_data")));
+        const QVariant restoreData = results.value(QStringLiteral("restore_data"));
+        const uint coldNodeId = firstNodeId(results);
+        QVERIFY(coldNodeId);
+        closeSession(sessionPath);
+
+        // Reconnecting with the restore data gets the very same stream back
+        timer.start();
+        sessionPath = createSession();
+        QVERIFY(!sessionPath.isEmpty());
+        QVERIFY(selectSources(sessionPath, { { QStringLiteral("persist_mode"), 2u }, { QStringLiteral("restore_data"), restoreData } }));
+        QVERIFY(start(sessionPath, results));
+        restoreTimes << timer.nsecsElapsed() / 1000;
+
+        QCOMPARE(firstNodeId(results), coldNodeId);
+
+        // Not persisted again, the stream goes away with the session
+        closeSession(sessionPath);
+        sessionPath = createSession();
+        QVERIFY(selectSources(sessionPath, { { QStringLiteral("persist_mode"), 0u }, { QStringLiteral("restore_data"), restoreData } }));
+        QVERIFY(start(sessionPath, results));
+        QVERIFY(!results.contains(QStringLiteral("restore_data")));
+        closeSession(sessionPath);
+    }
+
+    qInfo("cold start: %lld us, restored: %lld us (medians of %d sessions)",
+          median(coldTimes), median(restoreTimes), ROUND_COUNT);
+    QVERIFY(median(restoreTimes) < median(coldTimes));
+}
+
+void RestoreTest::testOtherApplication()
+{
+    QString sessionPath = createSession();
+    QVERIFY(!sessionPath.isEmpty());
+    QVERIFY(selectSources(sessionPath, { { QStringLiteral("types"), 1u }, { QStringLiteral("persist_mode"), 2u } }));
+    QVariantMap results;
+    QVERIFY(start(sessionPath, results));
+    const QVariant restoreData = results.value(QStringLiteral("restore_data"));
+    const uint nodeId = firstNodeId(results);
+    QVERIFY(nodeId);
+    closeSession(sessionPath);
+
+    // Another application with the same token gets a stream of its own
+    sessionPath = createSession(QStringLiteral("org.freedesktop.other"));
+    QVERIFY(!sessionPath.isEmpty());
+    QVERIFY(selectSources(sessionPath, { { QStringLiteral("persist_mode"), 2u }, { QStringLiteral("restore_data"), restoreData } }));
+    QVERIFY(start(sessionPath, results));
+    QVERIFY(firstNodeId(results) != nodeId);
+    closeSession(sessionPath);
+
+    // Neither did it take the stream away from the application it belongs to
+    sessionPath = createSession();
+    QVERIFY(!sessionPath.isEmpty());
+    QVERIFY(selectSources(sessionPath, { { QStringLiteral("persist_mode"), 0u }, { QStringLiteral("restore_data"), restoreData } }));
+    QVERIFY(start(sessionPath, results));
+    QCOMPARE(firstNodeId(results), nodeId);
+    closeSession(sessionPath);
+}
+
+QTEST_GUILESS_MAIN(RestoreTest)
+
+#include "restoretest.moc"
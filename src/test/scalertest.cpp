@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QImage>
+
+#include "../framescaler.h"
+
+#include <string.h>
+
+// The vectorized loops have to give the very same frames as the scalar
+// ones handling the pixels left over at the end of a line
+class ScalerTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testBox_data();
+    void testBox();
+    void testBilinear_data();
+    void testBilinear();
+    void benchmarkBilinear_data();
+    void benchmarkBilinear();
+    void testSwapRedBlue_data();
+    void testSwapRedBlue();
+
+private:
+    QImage noise(const QSize &size) const;
+};
+
+QImage ScalerTest::noise(const QSize &size) const
+{
+    QImage frame(size, QImage::Format_RGBA8888);
+    uint32_t state = 0x12345678;
+
+    for (int y = 0; y < size.height(); y++) {
+        uint32_t *line = reinterpret_cast<uint32_t *>(frame.scanLine(y));
+        for (int x = 0; x < size.width(); x++) {
+            // xorshift, every rounding case shows up on a few lines
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            line[x] = state;
+        }
+    }
+
+    return frame;
+}
+
+void ScalerTest::testBox_data()
+{
+    QTest::addColumn<int>("width");
+
+    // Vectorized only, scalar only and both in the same line
+    QTest::newRow("4") << 4;
+    QTest::newRow("3") << 3;
+    QTest::newRow("7") << 7;
+    QTest::newRow("13") << 13;
+    QTest::newRow("960") << 960;
+}
+
+void ScalerTest::testBox()
+{
+    QFETCH(int, width);
+
+    const QSize target(width, 5);
+    const QImage source = noise(target * 2);
+    QImage result(target, QImage::Format_RGBA8888);
+
+    FrameScaler scaler;
+    QVERIFY(scaler.configure(source.size(), target));
+    QCOMPARE(scaler.method(), FrameScaler::MethodBox);
+    scaler.scale(source.constBits(), source.bytesPerLine(), result.bits(), result.bytesPerLine());
+
+    for (int y = 0; y < target.height(); y++) {
+        const uint8_t *row0 = source.constScanLine(2 * y);
+        const uint8_t *row1 = source.constScanLine(2 * y + 1);
+        const uint8_t *out = result.constScanLine(y);
+
+        for (int x = 0; x < target.width(); x++) {
+            for (int c = 0; c < 4; c++) {
+                const int expected = (row0[x * 8 + c] + row0[x * 8 + 4 + c] + row1[x * 8 + c] + row1[x * 8 + 4 + c] + 2) >> 2;
+                if (out[x * 4 + c] != expected)
+                    QFAIL(qPrintable(QStringLiteral("Pixel %1,%2 channel %3 is %4, expected %5").arg(x).arg(y).arg(c).arg(out[x * 4 + c]).arg(expected)));
+            }
+        }
+    }
+}
+
+void ScalerTest::testBilinear_data()
+{
+    QTest::addColumn<QSize>("source");
+    QTest::addColumn<QSize>("target");
+
+    // Four target pixels per iteration, so vectorized only, scalar only and both
+    QTest::newRow("upscale 4") << QSize(3, 3) << QSize(4, 7);
+    QTest::newRow("upscale 3") << QSize(2, 2) << QSize(3, 5);
+    QTest::newRow("upscale 13") << QSize(7, 5) << QSize(13, 9);
+    QTest::newRow("downscale 5") << QSize(13, 9) << QSize(5, 3);
+    QTest::newRow("single column") << QSize(1, 4) << QSize(6, 6);
+    QTest::newRow("1080p to 720p") << QSize(1920, 1080) << QSize(1280, 720);
+}
+
+void ScalerTest::testBilinear()
+{
+    QFETCH(QSize, source);
+    QFETCH(QSize, target);
+
+    const QImage frame = noise(source);
+    QImage vectorized(target, QImage::Format_RGBA8888);
+    QImage scalar(target, QImage::Format_RGBA8888);
+
+    FrameScaler scaler;
+    QVERIFY(scaler.configure(source, target));
+    QCOMPARE(scaler.method(), FrameScaler::MethodBilinear);
+    scaler.scale(frame.constBits(), frame.bytesPerLine(), vectorized.bits(), vectorized.bytesPerLine());
+    scaler.setVectorized(false);
+    scaler.scale(frame.constBits(), frame.bytesPerLine(), scalar.bits(), scalar.bytesPerLine());
+
+    for (int y = 0; y < target.height(); y++) {
+        if (memcmp(vectorized.constScanLine(y), scalar.constScanLine(y), target.width() * 4) != 0)
+            QFAIL(qPrintable(QStringLiteral("Line %1 differs from the scalar one").arg(y)));
+    }
+}
+
+void ScalerTest::benchmarkBilinear_data()
+{
+    QTest::addColumn<bool>("vectorized");
+
+    QTest::newRow("scalar") << false;
+    QTest::newRow("vectorized") << true;
+}
+
+void ScalerTest::benchmarkBilinear()
+{
+    QFETCH(bool, vectorized);
+
+    const QImage frame = noise(QSize(1920, 1080));
+    QImage result(QSize(1280, 720), QImage::Format_RGBA8888);
+
+    FrameScaler scaler;
+    QVERIFY(scaler.configure(frame.size(), result.size()));
+    scaler.setVectorized(vectorized);
+
+    QBENCHMARK {
+        scaler.scale(frame.constBits(), frame.bytesPerLine(), result.bits(), result.bytesPerLine());
+    }
+}
+
+void ScalerTest::testSwapRedBlue_data()
+{
+    QTest::addColumn<int>("width");
+
+    QTest::newRow("4") << 4;
+    QTest::newRow("3") << 3;
+    QTest::newRow("13") << 13;
+}
+
+void ScalerTest::testSwapRedBlue()
+{
+    QFETCH(int, width);
+
+    const QImage source = noise(QSize(width, 3));
+    QImage result = source.copy();
+
+    FrameScaler::swapRedBlue(result.bits(), result.bytesPerLine(), result.size());
+
+    for (int y = 0; y < source.height(); y++) {
+        const uint8_t *in = source.constScanLine(y);
+        const uint8_t *out = result.constScanLine(y);
+
+        for (int x = 0; x < width; x++) {
+            QCOMPARE(out[x * 4], in[x * 4 + 2]);
+            QCOMPARE(out[x * 4 + 1], in[x * 4 + 1]);
+            QCOMPARE(out[x * 4 + 2], in[x * 4]);
+            QCOMPARE(out[x * 4 + 3], in[x * 4 + 3]);
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(ScalerTest)
+
+#include "scalertest.moc"
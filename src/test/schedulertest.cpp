@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QElapsedTimer>
+#include <QThread>
+
+#include "../framescheduler.h"
+
+class SchedulerTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testSpreadReleases();
+    void testOverrun();
+    void testManyStreams();
+};
+
+void SchedulerTest::testSpreadReleases()
+{
+    // Streams of the same rate started together must not fire together
+    const int jobCount = 4;
+    const qint64 interval = 40 * 1000 * 1000;
+    FrameScheduler *scheduler = FrameScheduler::instance();
+
+    QElapsedTimer clock;
+    clock.start();
+    QVector<QVector<qint64>> releases(jobCount);
+    QVector<int> jobs;
+    for (int i = 0; i < jobCount; i++) {
+        const int job = scheduler->addJob([&clock, &releases, i] () {
+            releases[i] << clock.nsecsElapsed();
+        });
+        scheduler->setInterval(job, interval);
+        scheduler->start(job);
+        jobs << job;
+    }
+
+    QTest::qWait(500);
+    for (int job : qAsConst(jobs))
+        scheduler->removeJob(job);
+
+    // Compare where in the interval the last frames of all jobs were produced
+    QVector<qint64> offsets;
+    for (const QVector<qint64> &jobReleases : qAsConst(releases)) {
+        QVERIFY(jobReleases.count() >= 8);
+        offsets << jobReleases.last() % interval;
+    }
+    std::sort(offsets.begin(), offsets.end());
+    for (int i = 1; i < offsets.count(); i++)
+        QVERIFY2(offsets.at(i) - offsets.at(i - 1) >= interval / (jobCount * 2), "Releases are bunched up");
+}
+
+void SchedulerTest::testOverrun()
+{
+    // A job taking longer than its interval misses deadlines and skips frames
+    FrameScheduler *scheduler = FrameScheduler::instance();
+    const int job = scheduler->addJob([] () {
+        QThread::msleep(25);
+    });
+    scheduler->setInterval(job, 10 * 1000 * 1000);
+    scheduler->start(job);
+
+    QTest::qWait(500);
+    const FrameScheduler::Statistics statistics = scheduler->statistics(job);
+    scheduler->removeJob(job);
+
+    QVERIFY(statistics.frames > 0);
+    QCOMPARE(statistics.missedDeadlines, statistics.frames);
+    QVERIFY(statistics.skippedFrames >= statistics.frames);
+    QVERIFY(statistics.maximumLateness >= 10000);
+}
+
+void SchedulerTest::testManyStreams()
+{
+    // 32 streams at 60 Hz, each frame taking 200 microseconds to produce
+    const int jobCount = 32;
+    FrameScheduler *scheduler = FrameScheduler::instance();
+
+    QVector<int> jobs;
+    for (int i = 0; i < jobCount; i++) {
+        const int job = scheduler->addJob([] () {
+            QElapsedTimer busy;
+            busy.start();
+            while (busy.nsecsElapsed() < 200 * 1000) {
+            }
+        });
+        scheduler->setInterval(job, 1000 * 1000 * 1000 / 60);
+        scheduler->start(job);
+        jobs << job;
+    }
+
+    QTest::qWait(2000);
+
+    FrameScheduler::Statistics total;
+    for (int job : qAsConst(jobs)) {
+        const FrameScheduler::Statistics statistics = scheduler->statistics(job);
+        total.frames += statistics.frames;
+        total.missedDeadlines += statistics.missedDeadlines;
+        total.skippedFrames += statistics.skippedFrames;
+        total.maximumLateness = qMax(total.maximumLateness, statistics.maximumLateness);
+        scheduler->removeJob(job);
+    }
+
+    qInfo("streams: %d, frames: %lld, missed deadlines: %lld, skipped: %lld, maximum lateness: %lld us",
+          jobCount, total.frames, total.missedDeadlines, total.skippedFrames, total.maximumLateness);
+
+    // Under 40% of the thread's time is busy, every frame fits before its
+    // deadline. Only the odd preemption of a loaded test machine may delay one.
+    const qint64 expectedFrames = jobCount * 2 * 60;
+    QVERIFY2(total.frames >= expectedFrames * 9 / 10, qPrintable(QStringLiteral("Only %1 of %2 frames").arg(total.frames).arg(expectedFrames)));
+    QVERIFY2(total.missedDeadlines <= total.frames / 100, qPrintable(QStringLiteral("%1 missed deadlines").arg(total.missedDeadlines)));
+    QVERIFY2(total.skippedFrames <= total.frames / 100, qPrintable(QStringLiteral("%1 skipped frames").arg(total.skippedFrames)));
+}
+
+QTEST_GUILESS_MAIN(SchedulerTest)
+
+#include "schedulertest.moc"
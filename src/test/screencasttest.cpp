@@ -27,15 +27,22 @@
 #include <QDBusVariant>
 #include <QDBusUnixFileDescriptor>
 
+#include "../pipewirecore.h"
 #include "../screencaststream.h"
 
+#include <QHash>
 #include <QSignalSpy>
+#include <QTimer>
 
 #define DBUS_SERVICE_NAME "org.freedesktop.portal.Desktop"
 #define DBUS_PATH "/org/freedesktop/portal/desktop"
 #define DBUS_SCREENCAST_INTERFACE_NAME "org.freedesktop.portal.ScreenCast"
 #define DBUS_REQUEST_INTERFACE_NAME "org.freedesktop.portal.Request"
 #define DBUS_PROPERTIES_INTERFACE_NAME "org.freedesktop.DBus.Properties"
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_BACKEND_SCREENCAST_INTERFACE_NAME "org.freedesktop.impl.portal.ScreenCast"
+#define DBUS_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenCastControl"
+#define DBUS_PORTAL_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenCastPortalControl"
 
 class ScreenCastTest : public QObject
 {
@@ -55,6 +62,9 @@ private Q_SLOTS:
     void testSelectSources();
     void testStart();
     void testOpenPipeWireRemote();
+    void testSharedRemote();
+    void testOrphanedSessions();
+    void testOrphanedStreams();
 
 Q_SIGNALS:
     void createSessionResponse(uint response, const QVariantMap &map);
@@ -123,7 +133,8 @@ void ScreenCastTest::testPortalRunning()
     QDBusVariant dbusVariant = qvariant_cast<QDBusVariant>(reply.arguments().at(0));
     // retrieve the actual value stored in the D-Bus variant
     QVariant result = dbusVariant.variant();
-    QCOMPARE(result.toUInt(), 0);
+    // The default source catalog has a monitor and a window
+    QCOMPARE(result.toUInt(), 3);
 }
 
 void ScreenCastTest::testCreateSession()
@@ -234,6 +245,168 @@ void ScreenCastTest::testOpenPipeWireRemote()
     delete stream;
 }
 
+void ScreenCastTest::testSharedRemote()
+{
+    // Several nodes, each of them with a consumer, all served by one remote and one loop
+    const QSize resolution(8, 8);
+    const QList<QColor> colors = { QColor("red"), QColor("green"), QColor("blue"), QColor("yellow") };
+    const int consumerCount = colors.count();
+
+    QList<ScreenCastStream *> producers;
+    QHash<ScreenCastStream *, uint> nodeIds;
+    for (int i = 0; i < consumerCount; i++) {
+        ScreenCastStream *producer = new ScreenCastStream(resolution, this);
+        // Queued from the loop thread of the producer
+        connect(producer, &ScreenCastStream::streamReady, this, [&nodeIds, producer] (uint nodeId) {
+            nodeIds.insert(producer, nodeId);
+        });
+        producer->init();
+        producers << producer;
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(nodeIds.count(), consumerCount, 10000);
+
+    // Every producer keeps sending a color of its own
+    QList<QImage> frames;
+    for (const QColor &color : colors) {
+        QImage frame(resolution, QImage::Format_RGBA8888);
+        frame.fill(color);
+        frames << frame;
+    }
+    QTimer frameTimer;
+    connect(&frameTimer, &QTimer::timeout, this, [&producers, &frames] () {
+        for (int i = 0; i < producers.count(); i++)
+            producers.at(i)->writeFrame(frames[i].bits());
+    });
+    frameTimer.start(20);
+
+    PipeWireCore *core = new PipeWireCore(this);
+    QList<ScreenCastStream *> consumers;
+    QList<QSignalSpy *> spies;
+    for (int i = 0; i < consumerCount; i++) {
+        ScreenCastStream *stream = new ScreenCastStream(resolution, core, nodeIds.value(producers.at(i)), this);
+        spies << new QSignalSpy(stream, SIGNAL(framebufferUpdated()));
+        stream->init();
+        consumers << stream;
+    }
+    QVERIFY(core->waitForStreams(10));
+    QCOMPARE(core->streamCount(), consumerCount);
+
+    for (int i = 0; i < consumerCount; i++) {
+        QTRY_VERIFY_WITH_TIMEOUT(!spies.at(i)->isEmpty(), 10000);
+        QCOMPARE(consumers.at(i)->framebuffer(), frames.at(i));
+    }
+
+    frameTimer.stop();
+    qDeleteAll(spies);
+    qDeleteAll(consumers);
+    QCOMPARE(core->streamCount(), 0);
+    delete core;
+    qDeleteAll(producers);
+}
+
+void ScreenCastTest::testOrphanedSessions()
+{
+    // A client of the backend with sessions it never closes
+    const QString connectionName = QStringLiteral("orphaned-sessions");
+    QDBusConnection client = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    QVERIFY(client.isConnected());
+
+    const int sessionCount = 8;
+    QStringList sessionPaths;
+    for (int i = 0; i < sessionCount; i++) {
+        const QString sessionPath = QStringLiteral("/org/freedesktop/portal/desktop/session/orphaned/%1").arg(getSessionToken());
+        QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                              QStringLiteral(DBUS_PATH),
+                                                              QStringLiteral(DBUS_BACKEND_SCREENCAST_INTERFACE_NAME),
+                                                              QStringLiteral("CreateSession"));
+        message << QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/orphaned/%1").arg(getRequestToken())))
+                << QVariant::fromValue(QDBusObjectPath(sessionPath))
+                << QStringLiteral("org.freedesktop.test")
+                << QVariantMap();
+        QDBusMessage reply = client.call(message);
+        QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+        QCOMPARE(reply.arguments().at(0).toUInt(), 0u);
+        sessionPaths << sessionPath;
+    }
+
+    auto sessionExists = [] (const QString &sessionPath) {
+        QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                              sessionPath,
+                                                              QStringLiteral(DBUS_CONTROL_INTERFACE_NAME),
+                                                              QStringLiteral("GetStatistics"));
+        return QDBusConnection::sessionBus().call(message).type() == QDBusMessage::ReplyMessage;
+    };
+
+    for (const QString &sessionPath : sessionPaths)
+        QVERIFY(sessionExists(sessionPath));
+
+    // Like a crash, the backend has to notice the client going away by itself
+    QDBusConnection::disconnectFromBus(connectionName);
+
+    for (const QString &sessionPath : sessionPaths)
+        QTRY_VERIFY(!sessionExists(sessionPath));
+}
+
+void ScreenCastTest::testOrphanedStreams()
+{
+    // Producers, their streams and worker slots of the whole backend
+    auto backendStatistics = [] () {
+        QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                              QStringLiteral(DBUS_PATH),
+                                                              QStringLiteral(DBUS_PORTAL_CONTROL_INTERFACE_NAME),
+                                                              QStringLiteral("GetStatistics"));
+        QDBusReply<QVariantMap> reply = QDBusConnection::sessionBus().call(message);
+        return reply.value();
+    };
+
+    const QVariantMap before = backendStatistics();
+    QVERIFY(before.contains(QStringLiteral("producers")));
+
+    // A client which started its sessions and then went away without closing them
+    const QString connectionName = QStringLiteral("orphaned-streams");
+    QDBusConnection client = QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName);
+    QVERIFY(client.isConnected());
+
+    const int sessionCount = 4;
+    for (int i = 0; i < sessionCount; i++) {
+        const QString sessionPath = QStringLiteral("/org/freedesktop/portal/desktop/session/orphaned/%1").arg(getSessionToken());
+        QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                              QStringLiteral(DBUS_PATH),
+                                                              QStringLiteral(DBUS_BACKEND_SCREENCAST_INTERFACE_NAME),
+                                                              QStringLiteral("CreateSession"));
+        message << QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/orphaned/%1").arg(getRequestToken())))
+                << QVariant::fromValue(QDBusObjectPath(sessionPath))
+                << QStringLiteral("org.freedesktop.test")
+                << QVariantMap();
+        QDBusMessage reply = client.call(message);
+        QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+        QCOMPARE(reply.arguments().at(0).toUInt(), 0u);
+
+        message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                 QStringLiteral(DBUS_PATH),
+                                                 QStringLiteral(DBUS_BACKEND_SCREENCAST_INTERFACE_NAME),
+                                                 QStringLiteral("Start"));
+        message << QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/orphaned/%1").arg(getRequestToken())))
+                << QVariant::fromValue(QDBusObjectPath(sessionPath))
+                << QStringLiteral("org.freedesktop.test")
+                << QString()
+                << QVariantMap();
+        reply = client.call(message);
+        QCOMPARE(reply.type(), QDBusMessage::ReplyMessage);
+        QCOMPARE(reply.arguments().at(0).toUInt(), 0u);
+    }
+
+    const QVariantMap started = backendStatistics();
+    for (const QString &key : { QStringLiteral("producers"), QStringLiteral("streams"), QStringLiteral("worker-load") })
+        QCOMPARE(started.value(key).toInt(), before.value(key).toInt() + sessionCount);
+
+    // Like a crash, nothing of the client's sessions may be left behind
+    QDBusConnection::disconnectFromBus(connectionName);
+
+    for (const QString &key : { QStringLiteral("producers"), QStringLiteral("streams"), QStringLiteral("worker-load") })
+        QTRY_COMPARE(backendStatistics().value(key).toInt(), before.value(key).toInt());
+}
+
 QTEST_GUILESS_MAIN(ScreenCastTest)
 
 #include "screencasttest.moc"
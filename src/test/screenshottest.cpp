@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusObjectPath>
+#include <QDBusPendingCall>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QSet>
+#include <QUrl>
+
+#include <functional>
+
+#include "../latencyhistogram.h"
+
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_PATH "/org/freedesktop/portal/desktop"
+#define DBUS_SCREENSHOT_INTERFACE_NAME "org.freedesktop.impl.portal.Screenshot"
+#define DBUS_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenshotControl"
+
+// Requests taken by each scenario
+#define SCREENSHOT_COUNT 256
+
+class ScreenshotTest : public QObject
+{
+    Q_OBJECT
+public:
+    ScreenshotTest();
+
+private Q_SLOTS:
+    void testScreenshot();
+    void testUniqueFiles();
+    void testConcurrent_data();
+    void testConcurrent();
+
+private:
+    // Talks to the backend directly, the frontend would ask for permission first
+    QDBusPendingCall requestScreenshot();
+    QVariantMap statistics();
+
+    int m_requestCounter = 0;
+};
+
+ScreenshotTest::ScreenshotTest()
+{
+}
+
+QDBusPendingCall ScreenshotTest::requestScreenshot()
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                          QStringLiteral(DBUS_PATH),
+                                                          QStringLiteral(DBUS_SCREENSHOT_INTERFACE_NAME),
+                                                          QStringLiteral("Screenshot"));
+    m_requestCounter += 1;
+    message << QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/test/screenshot%1").arg(m_requestCounter)))
+            << QStringLiteral("org.freedesktop.test")
+            << QString()
+            << QVariantMap();
+
+    return QDBusConnection::sessionBus().asyncCall(message);
+}
+
+QVariantMap ScreenshotTest::statistics()
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                          QStringLiteral(DBUS_PATH),
+                                                          QStringLiteral(DBUS_CONTROL_INTERFACE_NAME),
+                                                          QStringLiteral("GetStatistics"));
+    QDBusPendingReply<QVariantMap> reply = QDBusConnection::sessionBus().asyncCall(message);
+    reply.waitForFinished();
+    return reply.value();
+}
+
+void ScreenshotTest::testScreenshot()
+{
+    QDBusPendingReply<uint, QVariantMap> reply = requestScreenshot();
+    reply.waitForFinished();
+    QVERIFY(reply.isValid());
+    QCOMPARE(reply.argumentAt<0>(), 0u);
+
+    const QUrl uri(reply.argumentAt<1>().value(QStringLiteral("uri")).toString());
+    QVERIFY(uri.isLocalFile());
+
+    // The default catalog's 8x8 monitor
+    QImage image(uri.toLocalFile());
+    QVERIFY(!image.isNull());
+    QCOMPARE(image.size(), QSize(8, 8));
+}
+
+void ScreenshotTest::testUniqueFiles()
+{
+    // More screenshots at once than there are encoder threads, none of them
+    // may replace the file of another
+    QList<QDBusPendingCall> calls;
+    for (int i = 0; i < 100; i++)
+        calls << requestScreenshot();
+
+    QSet<QString> fileNames;
+    for (const QDBusPendingCall &call : qAsConst(calls)) {
+        QDBusPendingReply<uint, QVariantMap> reply = call;
+        reply.waitForFinished();
+        QVERIFY(reply.isValid());
+        QCOMPARE(reply.argumentAt<0>(), 0u);
+        fileNames << QUrl(reply.argumentAt<1>().value(QStringLiteral("uri")).toString()).toLocalFile();
+    }
+
+    QCOMPARE(fileNames.count(), calls.count());
+    for (const QString &fileName : qAsConst(fileNames))
+        QVERIFY2(QFile::exists(fileName), qPrintable(fileName));
+}
+
+void ScreenshotTest::testConcurrent_data()
+{
+    QTest::addColumn<int>("concurrency");
+
+    QTest::newRow("1") << 1;
+    QTest::newRow("16") << 16;
+    QTest::newRow("64") << 64;
+}
+
+void ScreenshotTest::testConcurrent()
+{
+    QFETCH(int, concurrency);
+
+    QDBusMessage reset = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME),
+                                                        QStringLiteral(DBUS_PATH),
+                                                        QStringLiteral(DBUS_CONTROL_INTERFACE_NAME),
+                                                        QStringLiteral("ResetStatistics"));
+    QDBusConnection::sessionBus().call(reset);
+
+    // Keeps @concurrency requests in flight until all are answered
+    LatencyHistogram latency;
+    QElapsedTimer clock;
+    clock.start();
+    int started = 0;
+    int finished = 0;
+    int failed = 0;
+
+    std::function<void()> startRequest = [&]() {
+        const qint64 sent = clock.nsecsElapsed();
+        started++;
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(requestScreenshot(), this);
+        connect(watcher, &QDBusPendingCallWatcher::finished, this, [&, sent, watcher]() {
+            latency.record((clock.nsecsElapsed() - sent) / 1000);
+            QDBusPendingReply<uint, QVariantMap> reply = *watcher;
+            if (reply.isError() || reply.argumentAt<0>() != 0)
+                failed++;
+            finished++;
+            watcher->deleteLater();
+            if (started < SCREENSHOT_COUNT)
+                startRequest();
+        });
+    };
+
+    for (int i = 0; i < concurrency; i++)
+        startRequest();
+
+    QTRY_COMPARE_WITH_TIMEOUT(finished, SCREENSHOT_COUNT, 60000);
+    const qint64 elapsed = clock.elapsed();
+    QCOMPARE(failed, 0);
+
+    qInfo("concurrency: %d, screenshots: %d, %.1f per second, latency p50: %lld us, p90: %lld us, p99: %lld us, max: %lld us",
+          concurrency, finished, finished * 1000.0 / qMax<qint64>(1, elapsed),
+          latency.percentile(50), latency.percentile(90), latency.percentile(99), latency.maximum());
+
+    // The backend measured every request as well, without the bus in between
+    const QVariantMap backend = statistics();
+    QCOMPARE(backend.value(QStringLiteral("screenshots")).toLongLong(), qint64(SCREENSHOT_COUNT));
+    QCOMPARE(backend.value(QStringLiteral("pending")).toInt(), 0);
+    QVERIFY(backend.value(QStringLiteral("latency-p99")).toLongLong() <= latency.maximum());
+    qInfo("backend latency p50: %lld us, p90: %lld us, p99: %lld us",
+          backend.value(QStringLiteral("latency-p50")).toLongLong(),
+          backend.value(QStringLiteral("latency-p90")).toLongLong(),
+          backend.value(QStringLiteral("latency-p99")).toLongLong());
+}
+
+QTEST_GUILESS_MAIN(ScreenshotTest)
+
+#include "screenshottest.moc"
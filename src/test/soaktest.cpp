@@ -0,0 +1,343 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusObjectPath>
+#include <QDBusReply>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QSignalSpy>
+#include <QStandardPaths>
+
+#include "../screencaststream.h"
+
+#include <algorithm>
+
+#define DBUS_BACKEND_SERVICE_NAME "org.freedesktop.impl.portal.desktop.test"
+#define DBUS_PATH "/org/freedesktop/portal/desktop"
+#define DBUS_SCREENCAST_INTERFACE_NAME "org.freedesktop.impl.portal.ScreenCast"
+#define DBUS_SESSION_INTERFACE_NAME "org.freedesktop.impl.portal.Session"
+#define DBUS_CONTROL_INTERFACE_NAME "org.freedesktop.impl.portal.desktop.test.ScreenCastControl"
+
+// Seconds the soak runs, hours are fine too
+#define DEFAULT_DURATION 60
+// Cycles between two samples of the resources
+#define DEFAULT_SAMPLE_CYCLES 10
+// Every so many cycles the client disconnects instead of closing its session
+#define ORPHAN_INTERVAL 5
+
+// Resources of a process, -1 when they can't be read
+struct Sample {
+    qint64 rss = -1;
+    qint64 fds = -1;
+    qint64 threads = -1;
+    qint64 mappedBuffers = -1;
+};
+
+// Repeatedly creates sessions in the portal, consumes a few frames of their
+// streams from the local PipeWire daemon and tears everything down again,
+// while watching the resources of both processes and the daemon's nodes
+class SoakTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void testSoak();
+
+private:
+    bool runCycle(bool orphan);
+    QString startSession(const QDBusConnection &connection, uint &nodeId, QSize &size);
+
+    Sample sample(qint64 pid) const;
+    qint64 pipewireNodes() const;
+
+    qint64 m_portalPid = 0;
+    int m_duration = DEFAULT_DURATION;
+    int m_sampleCycles = DEFAULT_SAMPLE_CYCLES;
+    int m_cycle = 0;
+};
+
+static qint64 statusValue(const QByteArray &status, const QByteArray &key)
+{
+    for (const QByteArray &line : status.split('\n')) {
+        if (line.startsWith(key + ':'))
+            return line.mid(key.size() + 1).trimmed().split(' ').first().toLongLong();
+    }
+
+    return -1;
+}
+
+Sample SoakTest::sample(qint64 pid) const
+{
+    Sample sample;
+    const QString proc = QStringLiteral("/proc/%1").arg(pid);
+
+    QFile status(proc + QStringLiteral("/status"));
+    if (status.open(QIODevice::ReadOnly)) {
+        const QByteArray contents = status.readAll();
+        sample.rss = statusValue(contents, "VmRSS") * 1024;
+        sample.threads = statusValue(contents, "Threads");
+    }
+
+    const QDir fds(proc + QStringLiteral("/fd"));
+    if (fds.exists())
+        sample.fds = fds.entryList(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot).count();
+
+    // PipeWire buffers are memfd mappings
+    QFile maps(proc + QStringLiteral("/maps"));
+    if (maps.open(QIODevice::ReadOnly)) {
+        sample.mappedBuffers = 0;
+        for (const QByteArray &line : maps.readAll().split('\n')) {
+            if (!line.contains("memfd:"))
+                continue;
+            const QList<QByteArray> range = line.split(' ').first().split('-');
+            if (range.count() == 2)
+                sample.mappedBuffers += range.at(1).toLongLong(nullptr, 16) - range.at(0).toLongLong(nullptr, 16);
+        }
+    }
+
+    return sample;
+}
+
+qint64 SoakTest::pipewireNodes() const
+{
+    // The registry API differs between PipeWire versions, pw-cli knows them all
+    QProcess cli;
+    cli.start(QStringLiteral("pw-cli"), { QStringLiteral("list-objects") });
+    if (!cli.waitForFinished(5000) || cli.exitStatus() != QProcess::NormalExit || cli.exitCode() != 0)
+        return -1;
+
+    qint64 nodes = 0;
+    for (const QByteArray &line : cli.readAllStandardOutput().split('\n')) {
+        if (line.contains("Interface:Node"))
+            nodes++;
+    }
+
+    return nodes;
+}
+
+void SoakTest::initTestCase()
+{
+    bool ok = false;
+    const int duration = qEnvironmentVariableIntValue("XDP_TEST_SOAK_DURATION", &ok);
+    if (ok && duration > 0)
+        m_duration = duration;
+    const int sampleCycles = qEnvironmentVariableIntValue("XDP_TEST_SOAK_SAMPLE_CYCLES", &ok);
+    if (ok && sampleCycles > 0)
+        m_sampleCycles = sampleCycles;
+
+    const QDBusReply<uint> pid = QDBusConnection::sessionBus().interface()->servicePid(QStringLiteral(DBUS_BACKEND_SERVICE_NAME));
+    if (!pid.isValid())
+        QSKIP("The portal backend is not running");
+    m_portalPid = pid.value();
+
+    if (QStandardPaths::findExecutable(QStringLiteral("pw-cli")).isEmpty())
+        QSKIP("pw-cli is not installed");
+    if (pipewireNodes() < 0)
+        QSKIP("pw-cli cannot reach the PipeWire daemon");
+}
+
+QString SoakTest::startSession(const QDBusConnection &connection, uint &nodeId, QSize &size)
+{
+    m_cycle++;
+    const QString sessionPath = QStringLiteral("/org/freedesktop/portal/desktop/session/soak/test%1").arg(m_cycle);
+    auto call = [&connection] (const QString &path, const QString &interface, const QString &method, const QVariantList &arguments) {
+        QDBusMessage message = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME), path, interface, method);
+        message.setArguments(arguments);
+        return connection.call(message);
+    };
+    auto request = [this] (const char *method) {
+        return QVariant::fromValue(QDBusObjectPath(QStringLiteral("/org/freedesktop/portal/desktop/request/soak/%1%2").arg(QLatin1String(method)).arg(m_cycle)));
+    };
+
+    QDBusMessage reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("CreateSession"),
+                              { request("create"), QVariant::fromValue(QDBusObjectPath(sessionPath)), QStringLiteral("org.freedesktop.test"), QVariantMap() });
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("SelectSources"),
+                 { request("select"), QVariant::fromValue(QDBusObjectPath(sessionPath)), QStringLiteral("org.freedesktop.test"),
+                   QVariantMap { { QStringLiteral("types"), 1u } } });
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    reply = call(QStringLiteral(DBUS_PATH), QStringLiteral(DBUS_SCREENCAST_INTERFACE_NAME), QStringLiteral("Start"),
+                 { request("start"), QVariant::fromValue(QDBusObjectPath(sessionPath)), QStringLiteral("org.freedesktop.test"), QString(), QVariantMap() });
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().at(0).toUInt() != 0)
+        return QString();
+
+    const QVariantMap results = qdbus_cast<QVariantMap>(reply.arguments().at(1));
+    const QDBusArgument streams = results.value(QStringLiteral("streams")).value<QDBusArgument>();
+    nodeId = 0;
+    streams.beginArray();
+    if (!streams.atEnd()) {
+        QVariantMap properties;
+        streams.beginStructure();
+        streams >> nodeId >> properties;
+        streams.endStructure();
+        size = qdbus_cast<QSize>(properties.value(QStringLiteral("size")));
+    }
+
+    // The test pattern is slow unless a framerate was asked for
+    reply = call(sessionPath, QStringLiteral(DBUS_CONTROL_INTERFACE_NAME), QStringLiteral("UpdateStream"),
+                 { QVariantMap { { QStringLiteral("framerate"), 30u } } });
+    if (reply.type() != QDBusMessage::ReplyMessage)
+        return QString();
+
+    return sessionPath;
+}
+
+bool SoakTest::runCycle(bool orphan)
+{
+    // Orphaned sessions come from a connection which goes away without closing them
+    const QString connectionName = QStringLiteral("soak-%1").arg(m_cycle);
+    QDBusConnection connection = orphan ? QDBusConnection::connectToBus(QDBusConnection::SessionBus, connectionName)
+                                        : QDBusConnection::sessionBus();
+
+    uint nodeId = 0;
+    QSize size;
+    const QString sessionPath = startSession(connection, nodeId, size);
+    if (sessionPath.isEmpty() || !nodeId || !size.isValid()) {
+        qWarning("Failed to start session %d", m_cycle);
+        return false;
+    }
+
+    // Consumes from the local daemon directly, the backend can't open remotes
+    ScreenCastStream *consumer = new ScreenCastStream(size, QDBusUnixFileDescriptor(), nodeId);
+    QSignalSpy spy(consumer, &ScreenCastStream::framebufferUpdated);
+    consumer->init();
+    const bool gotFrame = spy.wait(5000);
+    delete consumer;
+
+    if (orphan) {
+        QDBusConnection::disconnectFromBus(connectionName);
+    } else {
+        QDBusMessage close = QDBusMessage::createMethodCall(QStringLiteral(DBUS_BACKEND_SERVICE_NAME), sessionPath,
+                                                            QStringLiteral(DBUS_SESSION_INTERFACE_NAME), QStringLiteral("Close"));
+        QDBusConnection::sessionBus().call(close);
+    }
+
+    if (!gotFrame)
+        qWarning("No frame from node %u in session %d", nodeId, m_cycle);
+    return gotFrame;
+}
+
+// Growth is only flagged when every sample of the last quarter lies above all
+// samples of the second one, the first quarter being warm-up, and the
+// difference exceeds what allocator caches and pools account for
+static bool grows(const QVector<qint64> &values, qint64 slack)
+{
+    if (values.count() < 8 || values.contains(-1))
+        return false;
+
+    const int quarter = values.count() / 4;
+    const qint64 settledMax = *std::max_element(values.begin() + quarter, values.begin() + 2 * quarter);
+    const qint64 lateMin = *std::min_element(values.end() - quarter, values.end());
+
+    return lateMin > settledMax + slack;
+}
+
+void SoakTest::testSoak()
+{
+    struct Metric {
+        const char *name;
+        qint64 slack;
+        QVector<qint64> values;
+    };
+    QVector<Metric> metrics = {
+        { "portal-rss", 8 * 1024 * 1024, {} },
+        { "portal-fds", 4, {} },
+        { "portal-threads", 2, {} },
+        { "portal-mapped-buffers", 1024 * 1024, {} },
+        { "consumer-rss", 8 * 1024 * 1024, {} },
+        { "consumer-fds", 4, {} },
+        { "consumer-threads", 2, {} },
+        { "consumer-mapped-buffers", 1024 * 1024, {} },
+        { "pipewire-nodes", 2, {} },
+    };
+
+    auto takeSample = [&] () {
+        const Sample portal = sample(m_portalPid);
+        const Sample consumer = sample(QCoreApplication::applicationPid());
+        const qint64 values[] = { portal.rss, portal.fds, portal.threads, portal.mappedBuffers,
+                                  consumer.rss, consumer.fds, consumer.threads, consumer.mappedBuffers,
+                                  pipewireNodes() };
+        for (int i = 0; i < metrics.count(); i++)
+            metrics[i].values << values[i];
+
+        qInfo("cycle %d: portal rss %lld kB, %lld fds, %lld threads, %lld kB buffers, consumer rss %lld kB, %lld fds, %lld threads, "
+              "%lld kB buffers, %lld nodes", m_cycle, portal.rss / 1024, portal.fds, portal.threads, portal.mappedBuffers / 1024,
+              consumer.rss / 1024, consumer.fds, consumer.threads, consumer.mappedBuffers / 1024, values[8]);
+    };
+
+    QElapsedTimer clock;
+    clock.start();
+    int failures = 0;
+    int cycles = 0;
+    while (clock.elapsed() < m_duration * 1000LL) {
+        if (!runCycle(cycles % ORPHAN_INTERVAL == ORPHAN_INTERVAL - 1))
+            failures++;
+        cycles++;
+
+        // Deferred deletes of the consumer's stream
+        QCoreApplication::processEvents();
+
+        if (cycles % m_sampleCycles == 0)
+            takeSample();
+    }
+
+    QJsonObject results;
+    results.insert(QStringLiteral("cycles"), cycles);
+    results.insert(QStringLiteral("failures"), failures);
+    QStringList leaking;
+    for (const Metric &metric : qAsConst(metrics)) {
+        QJsonArray values;
+        for (qint64 value : metric.values)
+            values.append(value);
+        results.insert(QLatin1String(metric.name), values);
+
+        if (grows(metric.values, metric.slack))
+            leaking << QLatin1String(metric.name);
+    }
+
+    const QString resultsFile = qEnvironmentVariableIsSet("XDP_TEST_SOAK_RESULTS") ? QFile::decodeName(qgetenv("XDP_TEST_SOAK_RESULTS"))
+                                                                                   : QStringLiteral(SOAK_RESULTS_FILE);
+    QFile file(resultsFile);
+    if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        file.write(QJsonDocument(results).toJson());
+
+    qInfo("%d cycles, %d failed, samples in %s", cycles, failures, qPrintable(resultsFile));
+    QCOMPARE(failures, 0);
+    QVERIFY2(leaking.isEmpty(), qPrintable(QStringLiteral("Growing without bound: ") + leaking.join(QStringLiteral(", "))));
+}
+
+QTEST_GUILESS_MAIN(SoakTest)
+
+#include "soaktest.moc"
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include "../threadtuning.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+typedef QVector<int> CpuList;
+Q_DECLARE_METATYPE(CpuList)
+
+class ThreadTuningTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void testParseCpuList_data();
+    void testParseCpuList();
+    void testMissingCpus();
+    void testApplyMissingCpu();
+};
+
+void ThreadTuningTest::testParseCpuList_data()
+{
+    QTest::addColumn<QByteArray>("list");
+    QTest::addColumn<CpuList>("cpus");
+
+    // Every machine has CPU 0
+    QTest::newRow("empty") << QByteArray() << CpuList();
+    QTest::newRow("single") << QByteArray("0") << CpuList({ 0 });
+    QTest::newRow("range") << QByteArray("0-0") << CpuList({ 0 });
+    QTest::newRow("spaces") << QByteArray(" 0 , 0-0 ") << CpuList({ 0, 0 });
+    QTest::newRow("empty entries") << QByteArray(",0,,") << CpuList({ 0 });
+    QTest::newRow("text") << QByteArray("zero") << CpuList();
+    QTest::newRow("negative") << QByteArray("-1") << CpuList();
+    QTest::newRow("reversed") << QByteArray("3-1") << CpuList();
+    QTest::newRow("open range") << QByteArray("0-") << CpuList();
+    QTest::newRow("two dashes") << QByteArray("0-1-2") << CpuList();
+    QTest::newRow("valid and invalid") << QByteArray("x,0,1-a") << CpuList({ 0 });
+}
+
+void ThreadTuningTest::testParseCpuList()
+{
+    QFETCH(QByteArray, list);
+    QFETCH(CpuList, cpus);
+
+    QCOMPARE(ThreadTuning::parseCpuList(list), cpus);
+}
+
+void ThreadTuningTest::testMissingCpus()
+{
+    const int count = sysconf(_SC_NPROCESSORS_CONF);
+    QVERIFY(count > 0);
+
+    CpuList all;
+    for (int cpu = 0; cpu < count && cpu < CPU_SETSIZE; cpu++)
+        all << cpu;
+
+    // Ranges reaching past the last CPU end there, CPUs past it are dropped
+    QCOMPARE(ThreadTuning::parseCpuList("0-" + QByteArray::number(count + 2)), all);
+    QCOMPARE(ThreadTuning::parseCpuList(QByteArray::number(count) + "," + QByteArray::number(count + 7)), CpuList());
+    QCOMPARE(ThreadTuning::parseCpuList("100000"), CpuList());
+    QCOMPARE(ThreadTuning::parseCpuList("0," + QByteArray::number(count)), CpuList({ 0 }));
+}
+
+void ThreadTuningTest::testApplyMissingCpu()
+{
+    // Settings built by hand aren't checked, pinning fails without harm
+    ThreadTuning::Settings settings;
+    settings.cpus = { int(sysconf(_SC_NPROCESSORS_CONF)) };
+
+    const ThreadTuning::Result result = ThreadTuning::apply(settings, 0);
+    QCOMPARE(result.cpu, -1);
+    QCOMPARE(result.policy, ThreadTuning::PolicyDefault);
+}
+
+QTEST_GUILESS_MAIN(ThreadTuningTest)
+
+#include "threadtuningtest.moc"
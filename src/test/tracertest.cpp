@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include <QTest>
+
+#include <QBuffer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+
+#include "../tracer.h"
+
+class WorkerThread : public QThread
+{
+protected:
+    void run() override
+    {
+        TraceScope trace("worker");
+        trace.setArgument(42);
+    }
+};
+
+class TracerTest : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void testDump();
+
+private:
+    // Events of the dump, without the thread metadata
+    QJsonArray dump(QJsonArray *threads = nullptr);
+};
+
+void TracerTest::initTestCase()
+{
+    // Whatever is left is written there when the test quits
+    qputenv("XDP_TEST_TRACERTEST_TRACE", "/dev/null");
+    Tracer::initialize("XDP_TEST_TRACERTEST_TRACE");
+    QVERIFY(Tracer::isEnabled());
+}
+
+QJsonArray TracerTest::dump(QJsonArray *threads)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    if (!Tracer::dump(&buffer))
+        return QJsonArray();
+
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(buffer.data(), &error);
+    if (error.error != QJsonParseError::NoError) {
+        qWarning() << "Trace is no valid JSON:" << error.errorString();
+        return QJsonArray();
+    }
+
+    QJsonArray events;
+    for (const QJsonValue &value : document.object().value(QStringLiteral("traceEvents")).toArray()) {
+        const QJsonObject event = value.toObject();
+        if (event.value(QStringLiteral("ph")).toString() == QLatin1String("M")) {
+            if (threads)
+                threads->append(event);
+        } else {
+            events.append(event);
+        }
+    }
+
+    return events;
+}
+
+void TracerTest::testDump()
+{
+    // Events of a thread which already finished are still in the dump
+    WorkerThread thread;
+    thread.setObjectName(QStringLiteral("tracer-worker"));
+    thread.start();
+    QVERIFY(thread.wait(5000));
+
+    {
+        TraceScope trace("main");
+        QThread::usleep(1000);
+    }
+
+    QJsonArray threads;
+    const QJsonArray events = dump(&threads);
+    QCOMPARE(events.count(), 2);
+
+    QJsonObject worker;
+    QJsonObject main;
+    for (const QJsonValue &value : events) {
+        const QJsonObject event = value.toObject();
+        QCOMPARE(event.value(QStringLiteral("ph")).toString(), QStringLiteral("X"));
+        if (event.value(QStringLiteral("name")).toString() == QLatin1String("worker"))
+            worker = event;
+        else if (event.value(QStringLiteral("name")).toString() == QLatin1String("main"))
+            main = event;
+    }
+
+    QVERIFY(!worker.isEmpty());
+    QVERIFY(!main.isEmpty());
+    QCOMPARE(worker.value(QStringLiteral("args")).toObject().value(QStringLiteral("arg")).toInt(), 42);
+    QVERIFY(!main.contains(QStringLiteral("args")));
+    QVERIFY(worker.value(QStringLiteral("tid")).toInt() != main.value(QStringLiteral("tid")).toInt());
+    // Microseconds, the main scope slept for a millisecond
+    QVERIFY(main.value(QStringLiteral("dur")).toDouble() >= 1000);
+    QVERIFY(main.value(QStringLiteral("ts")).toDouble() >= worker.value(QStringLiteral("ts")).toDouble());
+
+    bool namedWorker = false;
+    for (const QJsonValue &value : threads) {
+        const QJsonObject args = value.toObject().value(QStringLiteral("args")).toObject();
+        namedWorker |= args.value(QStringLiteral("name")).toString() == QLatin1String("tracer-worker");
+        QCOMPARE(args.value(QStringLiteral("dropped")).toInt(), 0);
+    }
+    QVERIFY(namedWorker);
+
+    // Dumped events are dropped
+    QCOMPARE(dump().count(), 0);
+}
+
+QTEST_GUILESS_MAIN(TracerTest)
+
+#include "tracertest.moc"
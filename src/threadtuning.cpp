@@ -0,0 +1,191 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "threadtuning.h"
+
+#include <QAtomicInt>
+#include <QLoggingCategory>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestThreadTuning, "xdp-test-thread-tuning")
+
+// From linux/mempolicy.h, which we don't want to depend on
+#define XDP_MPOL_LOCAL 4
+
+#define DEFAULT_PRIORITY 10
+
+// Only warn about missing permissions once, not for every thread
+static QAtomicInt warnedAboutPriority;
+
+static const char *policyName(ThreadTuning::Policy policy)
+{
+    switch (policy) {
+    case ThreadTuning::PolicyFifo:
+        return "SCHED_FIFO";
+    case ThreadTuning::PolicyRoundRobin:
+        return "SCHED_RR";
+    default:
+        return "SCHED_OTHER";
+    }
+}
+
+QVector<int> ThreadTuning::parseCpuList(const QByteArray &list)
+{
+    QVector<int> cpus;
+    // Pinning to CPUs the system doesn't have would only fail later
+    const int cpuCount = qBound(1, int(sysconf(_SC_NPROCESSORS_CONF)), CPU_SETSIZE);
+
+    for (const QByteArray &part : list.split(',')) {
+        const QList<QByteArray> range = part.trimmed().split('-');
+        bool firstOk = false;
+        bool lastOk = false;
+        const int first = range.first().toInt(&firstOk);
+        const int last = range.count() == 2 ? range.last().toInt(&lastOk) : first;
+        if (!firstOk || (range.count() == 2 && !lastOk) || range.count() > 2 || first < 0 || last < first) {
+            if (!part.trimmed().isEmpty())
+                qCWarning(XdgDesktopPortalTestThreadTuning) << "Ignoring invalid CPU list entry" << part;
+            continue;
+        }
+
+        if (last >= cpuCount)
+            qCWarning(XdgDesktopPortalTestThreadTuning) << "Ignoring CPUs from" << qMax(first, cpuCount) << "on, there are only" << cpuCount;
+
+        for (int cpu = first; cpu <= last && cpu < cpuCount; cpu++)
+            cpus << cpu;
+    }
+
+    return cpus;
+}
+
+ThreadTuning::Settings ThreadTuning::Settings::fromEnvironment(Role role)
+{
+    Settings settings;
+
+    const QByteArray policy = qgetenv("XDP_TEST_RT_POLICY").toLower();
+    if (policy == "fifo")
+        settings.policy = PolicyFifo;
+    else if (policy == "rr")
+        settings.policy = PolicyRoundRobin;
+    else if (!policy.isEmpty() && policy != "other")
+        qCWarning(XdgDesktopPortalTestThreadTuning) << "Unknown XDP_TEST_RT_POLICY" << policy;
+
+    bool ok = false;
+    int priority = qEnvironmentVariableIntValue("XDP_TEST_RT_PRIORITY", &ok);
+    if (!ok)
+        priority = DEFAULT_PRIORITY;
+    if (role == Worker)
+        priority--;
+    settings.priority = qBound(1, priority, 99);
+
+    settings.cpus = parseCpuList(qgetenv(role == PipeWireLoop ? "XDP_TEST_RT_LOOP_CPUS" : "XDP_TEST_RT_WORKER_CPUS"));
+    settings.numaLocal = numaLocal();
+
+    return settings;
+}
+
+ThreadTuning::Result ThreadTuning::apply(Role role, int index)
+{
+    return apply(Settings::fromEnvironment(role), index);
+}
+
+ThreadTuning::Result ThreadTuning::apply(const Settings &settings, int index)
+{
+    Result result;
+
+    if (settings.policy != PolicyDefault) {
+        const int policy = settings.policy == PolicyFifo ? SCHED_FIFO : SCHED_RR;
+        sched_param parameters = {};
+        parameters.sched_priority = settings.priority;
+
+        int error = pthread_setschedparam(pthread_self(), policy, &parameters);
+
+        // Unprivileged users may still get realtime priorities up to RLIMIT_RTPRIO
+        rlimit limit = {};
+        if (error == EPERM && getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_cur > 0 &&
+            (rlim_t) settings.priority > limit.rlim_cur) {
+            parameters.sched_priority = (int) limit.rlim_cur;
+            error = pthread_setschedparam(pthread_self(), policy, &parameters);
+        }
+
+        if (error == 0) {
+            result.policy = settings.policy;
+            result.priority = parameters.sched_priority;
+        } else {
+            // At least get ahead of other normal threads, if we are allowed to
+            const bool niced = setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), -10) == 0;
+            if (warnedAboutPriority.testAndSetRelaxed(0, 1)) {
+                qCWarning(XdgDesktopPortalTestThreadTuning) << "Not permitted to use" << policyName(settings.policy)
+                                                            << "priority" << settings.priority << "(" << strerror(error) << "),"
+                                                            << (niced ? "using nice -10 instead" : "keeping the default policy");
+            }
+        }
+    }
+
+    if (!settings.cpus.isEmpty()) {
+        const int cpu = settings.cpus.at(index % settings.cpus.count());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+
+        // An empty set fails with EINVAL like an offline CPU does
+        const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error == 0)
+            result.cpu = cpu;
+        else
+            qCWarning(XdgDesktopPortalTestThreadTuning) << "Failed to pin thread to CPU" << cpu << ":" << strerror(error);
+    }
+
+    if (settings.numaLocal) {
+        // New pages of this thread come from the node it runs on, even when the
+        // process was started with another policy, e.g. by numactl
+        if (syscall(SYS_set_mempolicy, XDP_MPOL_LOCAL, nullptr, 0) == 0)
+            result.numaLocal = true;
+        else
+            qCDebug(XdgDesktopPortalTestThreadTuning) << "Failed to set local memory policy:" << strerror(errno);
+    }
+
+    qCDebug(XdgDesktopPortalTestThreadTuning) << "Tuned thread" << index << policyName(result.policy) << result.priority
+                                              << "cpu" << result.cpu << "numa local" << result.numaLocal;
+
+    return result;
+}
+
+int ThreadTuning::currentNode()
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return -1;
+
+    return (int) node;
+}
+
+bool ThreadTuning::numaLocal()
+{
+    return qgetenv("XDP_TEST_NUMA_LOCAL") == "1";
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_THREAD_TUNING_H
+#define XDG_DESKTOP_PORTAL_TEST_THREAD_TUNING_H
+
+#include <QByteArray>
+#include <QVector>
+
+// Scheduling policy, CPU affinity and memory policy for the threads frames
+// pass through, PipeWire loops and stream workers. Everything is off unless
+// asked for with the XDP_TEST_RT_* variables, see README.
+class ThreadTuning
+{
+public:
+    enum Role {
+        PipeWireLoop = 0,
+        Worker = 1
+    };
+
+    enum Policy {
+        PolicyDefault = 0,
+        PolicyFifo,
+        PolicyRoundRobin
+    };
+
+    struct Settings {
+        Policy policy = PolicyDefault;
+        // 1 - 99, loops get this, workers one less so frames are consumed first
+        int priority = 0;
+        // Threads of a role are pinned round robin to these, all CPUs when empty
+        QVector<int> cpus;
+        // Allocate memory on the NUMA node the thread runs on. Of the frame
+        // memory only consumer framebuffers are pooled per node, buffers of
+        // output streams are allocated by PipeWire and not affected.
+        bool numaLocal = false;
+
+        bool isDefault() const { return policy == PolicyDefault && cpus.isEmpty() && !numaLocal; }
+
+        static Settings fromEnvironment(Role role);
+    };
+
+    // What apply() ended up with
+    struct Result {
+        Policy policy = PolicyDefault;
+        int priority = 0;
+        int cpu = -1;
+        bool numaLocal = false;
+    };
+
+    // Tunes the calling thread as the @index-th thread of @role
+    static Result apply(Role role, int index);
+    static Result apply(const Settings &settings, int index);
+
+    // Node of the CPU the calling thread runs on, -1 if unknown
+    static int currentNode();
+    // Whether XDP_TEST_NUMA_LOCAL is set
+    static bool numaLocal();
+
+    // "0,2,4-7" as used by the variables, invalid entries and CPUs the
+    // system doesn't have are left out
+    static QVector<int> parseCpuList(const QByteArray &list);
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_THREAD_TUNING_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "tilecontent.h"
+
+#define SPRITE_COUNT 8
+// Pixels the text moves each frame
+#define TEXT_SPEED 4
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 12
+
+// RGBx as it is laid out in memory on little endian
+static inline uint32_t rgbx(uint32_t red, uint32_t green, uint32_t blue)
+{
+    return 0xff000000 | blue << 16 | green << 8 | red;
+}
+
+DesktopContent::DesktopContent(const QSize &size)
+    : m_size(size)
+{
+    // Everything derives from the size, so every run draws the very same frames
+    const int spriteSize = qMax(1, qMin(size.width(), size.height()) / 8);
+    for (int i = 0; i < SPRITE_COUNT; i++) {
+        Sprite sprite;
+        sprite.geometry = QRect((size.width() - spriteSize) * i / SPRITE_COUNT, (size.height() - spriteSize) * ((i * 3) % SPRITE_COUNT) / SPRITE_COUNT,
+                                spriteSize, spriteSize);
+        sprite.velocity = QPoint(i % 2 ? 3 + i : -3 - i, i % 3 ? 2 + i : -2 - i);
+        sprite.color = rgbx(64 * (i % 4), 255 - 32 * i, 128 + 16 * i);
+        m_sprites << sprite;
+    }
+
+    const int bandHeight = qMax(1, size.height() / 10);
+    m_textBand = QRect(0, size.height() - bandHeight, size.width(), bandHeight);
+}
+
+QSize DesktopContent::size() const
+{
+    return m_size;
+}
+
+void DesktopContent::advance(QVector<QRect> *damage)
+{
+    const QRect screen(QPoint(0, 0), m_size);
+
+    for (Sprite &sprite : m_sprites) {
+        const QRect previous = sprite.geometry;
+
+        QRect next = previous.translated(sprite.velocity);
+        if (next.left() < 0 || next.right() >= m_size.width())
+            sprite.velocity.rx() = -sprite.velocity.x();
+        if (next.top() < 0 || next.bottom() >= m_size.height())
+            sprite.velocity.ry() = -sprite.velocity.y();
+        sprite.geometry = previous.translated(sprite.velocity).intersected(screen);
+        if (sprite.geometry.size() != previous.size())
+            sprite.geometry = previous;
+
+        *damage << previous << sprite.geometry;
+    }
+
+    m_textOffset += TEXT_SPEED;
+    *damage << m_textBand;
+}
+
+void DesktopContent::render(const QRect &rect, uint8_t *dst, int stride) const
+{
+    // Only the sprites touching this rect are of any interest
+    const Sprite *sprites[SPRITE_COUNT];
+    int spriteCount = 0;
+    for (const Sprite &sprite : m_sprites) {
+        if (sprite.geometry.intersects(rect))
+            sprites[spriteCount++] = &sprite;
+    }
+
+    const int width = qMax(1, m_size.width() - 1);
+    const int height = qMax(1, m_size.height() - 1);
+
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        uint32_t *line = reinterpret_cast<uint32_t *>(dst + (size_t) (y - rect.top()) * stride);
+        const uint32_t green = y * 255 / height;
+        const bool textLine = m_textBand.contains(0, y) && ((y - m_textBand.top()) / GLYPH_HEIGHT) % 2 == 0;
+
+        for (int x = rect.left(); x <= rect.right(); x++)
+            line[x - rect.left()] = rgbx(x * 255 / width, green, 96);
+
+        for (int i = 0; i < spriteCount; i++) {
+            const QRect &geometry = sprites[i]->geometry;
+            if (y < geometry.top() || y > geometry.bottom())
+                continue;
+
+            const int left = qMax(rect.left(), geometry.left());
+            const int right = qMin(rect.right(), geometry.right());
+            for (int x = left; x <= right; x++)
+                line[x - rect.left()] = sprites[i]->color;
+        }
+
+        if (!textLine)
+            continue;
+
+        // Glyphs are blocks with a gap, every third one is a space
+        for (int x = rect.left(); x <= rect.right(); x++) {
+            const int column = x + m_textOffset;
+            const int glyph = column / GLYPH_WIDTH;
+            if (column % GLYPH_WIDTH != 0 && glyph % 3 != 2 && ((glyph * 7 + y) & 3))
+                line[x - rect.left()] = rgbx(16, 16, 16);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_TILE_CONTENT_H
+#define XDG_DESKTOP_PORTAL_TEST_TILE_CONTENT_H
+
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+#include <stdint.h>
+
+// Content drawn by a TiledGenerator. advance() moves to the next frame and
+// tells which parts changed, render() then draws any part of that frame and
+// is called from several threads at once.
+class TileContent
+{
+public:
+    virtual ~TileContent() = default;
+
+    virtual QSize size() const = 0;
+
+    // Appends the areas that differ from the previous frame to @damage
+    virtual void advance(QVector<QRect> *damage) = 0;
+
+    // Draws @rect as RGBx, @dst points to its top left pixel
+    virtual void render(const QRect &rect, uint8_t *dst, int stride) const = 0;
+};
+
+// A busy desktop: gradient wallpaper, windows moving around and a band of
+// scrolling text
+class DesktopContent : public TileContent
+{
+public:
+    explicit DesktopContent(const QSize &size);
+
+    QSize size() const override;
+    void advance(QVector<QRect> *damage) override;
+    void render(const QRect &rect, uint8_t *dst, int stride) const override;
+
+private:
+    struct Sprite {
+        QRect geometry;
+        QPoint velocity;
+        uint32_t color;
+    };
+
+    QSize m_size;
+    QVector<Sprite> m_sprites;
+    QRect m_textBand;
+    int m_textOffset = 0;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_TILE_CONTENT_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "tiledgenerator.h"
+#include "framescaler.h"
+#include "tilecontent.h"
+#include "tilepool.h"
+
+#define TILE_SIZE 64
+// Streams cycle through a handful of buffers, anything beyond that means
+// the pool was reallocated without us being told
+#define MAX_TRACKED_BUFFERS 64
+
+TiledGenerator::TiledGenerator(TileContent *content, TilePool *pool)
+    : m_content(content)
+    , m_pool(pool ? pool : TilePool::instance())
+    , m_size(content->size())
+{
+    m_columns = (m_size.width() + TILE_SIZE - 1) / TILE_SIZE;
+    m_rows = (m_size.height() + TILE_SIZE - 1) / TILE_SIZE;
+    m_tileFrames.fill(0, m_columns * m_rows);
+    m_dirtyTiles.reserve(m_columns * m_rows);
+}
+
+TiledGenerator::~TiledGenerator()
+{
+    delete m_content;
+}
+
+QSize TiledGenerator::size() const
+{
+    return m_size;
+}
+
+bool TiledGenerator::renderFrame(uint8_t *dst, int stride)
+{
+    m_frame++;
+
+    m_damage.resize(0);
+    m_content->advance(&m_damage);
+    for (const QRect &rect : qAsConst(m_damage))
+        markDamaged(rect);
+
+    if (stride != m_bufferStride || m_bufferFrames.count() > MAX_TRACKED_BUFFERS) {
+        m_bufferStride = stride;
+        m_bufferFrames.clear();
+    }
+
+    // Tiles which changed after the frame the buffer shows have to be drawn again
+    const quint64 bufferFrame = m_bufferFrames.value(dst, 0);
+    m_dirtyTiles.resize(0);
+    for (int tile = 0; tile < m_tileFrames.count(); tile++) {
+        if (!bufferFrame || m_tileFrames.at(tile) > bufferFrame)
+            m_dirtyTiles << tile;
+    }
+
+    m_pool->run(m_dirtyTiles.count(), [this, dst, stride] (int index) {
+        const QRect rect = tileRect(m_dirtyTiles.at(index));
+        uint8_t *tile = dst + (size_t) rect.y() * stride + rect.x() * FrameScaler::BytesPerPixel;
+
+        m_content->render(rect, tile, stride);
+        if (m_swapRedBlue)
+            FrameScaler::swapRedBlue(tile, stride, rect.size());
+    });
+
+    m_bufferFrames.insert(dst, m_frame);
+    return true;
+}
+
+bool TiledGenerator::setSwapRedBlue(bool swap)
+{
+    // Buffers hold the other channel order, nothing in them can be reused
+    if (swap != m_swapRedBlue) {
+        m_swapRedBlue = swap;
+        m_bufferFrames.clear();
+    }
+
+    return true;
+}
+
+void TiledGenerator::invalidate()
+{
+    m_bufferFrames.clear();
+}
+
+int TiledGenerator::tileCount() const
+{
+    return m_tileFrames.count();
+}
+
+int TiledGenerator::renderedTiles() const
+{
+    return m_dirtyTiles.count();
+}
+
+void TiledGenerator::markDamaged(const QRect &rect)
+{
+    const QRect damaged = rect.intersected(QRect(QPoint(0, 0), m_size));
+    if (damaged.isEmpty())
+        return;
+
+    for (int row = damaged.top() / TILE_SIZE; row <= damaged.bottom() / TILE_SIZE; row++) {
+        for (int column = damaged.left() / TILE_SIZE; column <= damaged.right() / TILE_SIZE; column++)
+            m_tileFrames[row * m_columns + column] = m_frame;
+    }
+}
+
+QRect TiledGenerator::tileRect(int tile) const
+{
+    const int x = (tile % m_columns) * TILE_SIZE;
+    const int y = (tile / m_columns) * TILE_SIZE;
+
+    return QRect(x, y, qMin(TILE_SIZE, m_size.width() - x), qMin(TILE_SIZE, m_size.height() - y));
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_TILED_GENERATOR_H
+#define XDG_DESKTOP_PORTAL_TEST_TILED_GENERATOR_H
+
+#include "framesource.h"
+
+#include <QHash>
+#include <QRect>
+#include <QVector>
+
+class TileContent;
+class TilePool;
+
+// Renders TileContent in 64x64 tiles spread over a TilePool. Every buffer
+// remembers the frame it last showed, so only tiles which changed since
+// then are drawn again.
+class TiledGenerator : public FrameSource
+{
+public:
+    // Takes ownership of @content, @pool defaults to the shared one
+    explicit TiledGenerator(TileContent *content, TilePool *pool = nullptr);
+    ~TiledGenerator() override;
+
+    QSize size() const override;
+    bool renderFrame(uint8_t *dst, int stride) override;
+    bool setSwapRedBlue(bool swap) override;
+    void invalidate() override;
+
+    int tileCount() const;
+    // Tiles drawn by the last renderFrame()
+    int renderedTiles() const;
+
+private:
+    void markDamaged(const QRect &rect);
+    QRect tileRect(int tile) const;
+
+    TileContent *m_content;
+    TilePool *m_pool;
+    QSize m_size;
+    int m_columns = 0;
+    int m_rows = 0;
+
+    quint64 m_frame = 0;
+    // Frame in which each tile changed last
+    QVector<quint64> m_tileFrames;
+    // Frame each buffer we rendered into shows, 0 means unknown
+    QHash<uint8_t *, quint64> m_bufferFrames;
+    int m_bufferStride = 0;
+    bool m_swapRedBlue = false;
+
+    // Kept around so that frames don't allocate
+    QVector<QRect> m_damage;
+    QVector<int> m_dirtyTiles;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_TILED_GENERATOR_H
@@ -0,0 +1,182 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "tilepool.h"
+
+#include <new>
+#include <stdlib.h>
+
+#include <QLoggingCategory>
+#include <QThread>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestTilePool, "xdp-test-tile-pool")
+
+Q_GLOBAL_STATIC(TilePool, tilePool)
+
+class TileWorker : public QThread
+{
+public:
+    TileWorker(TilePool *pool, int worker)
+        : m_pool(pool)
+        , m_worker(worker)
+    {
+        setObjectName(QStringLiteral("xdp-test-tiles-%1").arg(worker));
+    }
+
+protected:
+    void run() override
+    {
+        m_pool->workerLoop(m_worker);
+    }
+
+private:
+    TilePool *m_pool;
+    int m_worker;
+};
+
+TilePool::TilePool(int threads)
+{
+    if (threads <= 0) {
+        bool ok = false;
+        threads = qEnvironmentVariableIntValue("XDP_TEST_GENERATOR_THREADS", &ok);
+        if (!ok || threads <= 0)
+            threads = qMax(1, QThread::idealThreadCount());
+    }
+
+    // The calling thread is the first worker
+    m_threadCount = threads;
+    for (int i = 1; i < threads; i++) {
+        QThread *thread = new TileWorker(this, i);
+        thread->start();
+        m_threads << thread;
+    }
+
+    qCDebug(XdgDesktopPortalTestTilePool) << "Rendering tiles with" << threads << "threads";
+}
+
+TilePool::~TilePool()
+{
+    m_mutex.lock();
+    m_quit = true;
+    m_start.wakeAll();
+    m_mutex.unlock();
+
+    for (QThread *thread : qAsConst(m_threads)) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+TilePool *TilePool::instance()
+{
+    return tilePool();
+}
+
+int TilePool::threadCount() const
+{
+    return m_threadCount;
+}
+
+void TilePool::run(int count, const std::function<void(int)> &task)
+{
+    if (count <= 0)
+        return;
+
+    void *memory = nullptr;
+
+    // Not worth waking anybody up, or no memory for the slices
+    if (m_threads.isEmpty() || count == 1 || posix_memalign(&memory, alignof(Slice), m_threadCount * sizeof(Slice)) != 0) {
+        for (int i = 0; i < count; i++)
+            task(i);
+        return;
+    }
+
+    Job job;
+    job.task = &task;
+    job.slices = static_cast<Slice *>(memory);
+    for (int i = 0; i < m_threadCount; i++) {
+        Slice *slice = new (&job.slices[i]) Slice();
+        slice->next.store(count * i / m_threadCount);
+        slice->end = count * (i + 1) / m_threadCount;
+    }
+
+    m_mutex.lock();
+    m_jobs << &job;
+    m_start.wakeAll();
+    m_mutex.unlock();
+
+    work(&job, 0);
+
+    // Every tile was picked up, wait for the ones still being rendered
+    m_mutex.lock();
+    m_jobs.removeOne(&job);
+    while (job.active)
+        m_done.wait(&m_mutex);
+    m_mutex.unlock();
+
+    free(memory);
+}
+
+void TilePool::workerLoop(int worker)
+{
+    forever {
+        m_mutex.lock();
+        while (!m_quit && m_jobs.isEmpty())
+            m_start.wait(&m_mutex);
+
+        if (m_quit) {
+            m_mutex.unlock();
+            return;
+        }
+
+        // Help the frame with the fewest threads on it, so that frames
+        // rendered at the same time get a fair share of the pool
+        Job *job = m_jobs.first();
+        for (Job *candidate : qAsConst(m_jobs)) {
+            if (candidate->active < job->active)
+                job = candidate;
+        }
+        job->active++;
+        m_mutex.unlock();
+
+        work(job, worker);
+
+        // Having gone through all slices nothing is left to pick up
+        m_mutex.lock();
+        m_jobs.removeOne(job);
+        if (--job->active == 0)
+            m_done.wakeAll();
+        m_mutex.unlock();
+    }
+}
+
+void TilePool::work(Job *job, int worker)
+{
+    const std::function<void(int)> &task = *job->task;
+
+    // Our own slice first, then whatever the others didn't get to yet
+    for (int i = 0; i < m_threadCount; i++) {
+        Slice &slice = job->slices[(worker + i) % m_threadCount];
+
+        int index;
+        while ((index = slice.next.fetchAndAddRelaxed(1)) < slice.end)
+            task(index);
+    }
+}
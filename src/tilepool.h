@@ -0,0 +1,89 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_TILE_POOL_H
+#define XDG_DESKTOP_PORTAL_TEST_TILE_POOL_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <functional>
+
+class QThread;
+
+// Runs the tiles of frames in parallel. Every frame is a job of its own, so
+// frames of different streams are rendered at the same time. Every thread,
+// including the one calling run(), starts on its own slice of the tiles of a
+// job and steals from the other slices once its own is done, so uneven tiles
+// don't leave cores idle.
+class TilePool
+{
+public:
+    // @threads <= 0 uses XDP_TEST_GENERATOR_THREADS or the number of cores
+    explicit TilePool(int threads = 0);
+    ~TilePool();
+
+    // Shared by all generators, frames of different streams share the threads
+    static TilePool *instance();
+
+    // Threads working on a frame, including the calling one
+    int threadCount() const;
+
+    // Calls @task for every index below @count and returns once all are done,
+    // any number of threads may run frames at once
+    void run(int count, const std::function<void(int)> &task);
+
+    // Public because the worker threads need access
+    void workerLoop(int worker);
+
+private:
+    // Slice of the tile indices, a cache line of its own so that threads
+    // working on different slices don't share one
+    struct alignas(64) Slice {
+        QAtomicInt next;
+        int end = 0;
+    };
+
+    // A frame being rendered, lives on the stack of the thread calling run()
+    struct Job {
+        const std::function<void(int)> *task = nullptr;
+        // One per thread, allocated cache line aligned
+        Slice *slices = nullptr;
+        // Pool threads working on the job, guarded by m_mutex
+        int active = 0;
+    };
+
+    void work(Job *job, int worker);
+
+    QVector<QThread *> m_threads;
+    int m_threadCount = 0;
+
+    QMutex m_mutex;
+    QWaitCondition m_start;
+    QWaitCondition m_done;
+    // Jobs with tiles nobody picked up yet
+    QList<Job *> m_jobs;
+    bool m_quit = false;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_TILE_POOL_H
@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#include "tracer.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(XdgDesktopPortalTestTracer, "xdp-test-tracer")
+
+// Events each thread keeps until the next dump, has to be a power of two
+#define RING_SIZE (1 << 15)
+
+struct TraceEvent {
+    const char *name;
+    quint64 start;
+    quint64 end;
+    qint64 argument;
+};
+
+// Written by the thread it belongs to, read by whoever dumps the trace
+struct TraceRing {
+    TraceEvent events[RING_SIZE];
+    QAtomicInteger<quint32> head;
+    QAtomicInteger<quint32> tail;
+    QAtomicInteger<quint32> dropped;
+    qint64 threadId = 0;
+    QByteArray threadName;
+};
+
+bool Tracer::s_enabled = false;
+
+// Rings stay around after their thread is gone, their events still have to be dumped
+static QMutex ringsMutex;
+static QVector<TraceRing *> rings;
+static thread_local TraceRing *threadRing = nullptr;
+static QString traceFileName;
+
+static TraceRing *currentRing()
+{
+    if (Q_LIKELY(threadRing))
+        return threadRing;
+
+    TraceRing *ring = new TraceRing();
+    ring->threadId = syscall(SYS_gettid);
+    ring->threadName = QThread::currentThread()->objectName().toUtf8();
+
+    // Threads Qt didn't start, like the PipeWire loop, may still have a name
+    char name[16] = { 0 };
+    if (ring->threadName.isEmpty() && pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+        ring->threadName = name;
+    if (ring->threadName.isEmpty())
+        ring->threadName = QByteArray::number(ring->threadId);
+
+    QMutexLocker locker(&ringsMutex);
+    rings << ring;
+    threadRing = ring;
+
+    return ring;
+}
+
+static QByteArray escaped(const QByteArray &string)
+{
+    QByteArray result = string;
+    return result.replace('\\', "\\\\").replace('"', "\\\"");
+}
+
+static void dumpAtExit()
+{
+    Tracer::dump(traceFileName);
+}
+
+void Tracer::initialize(const char *variable)
+{
+    if (s_enabled || !qEnvironmentVariableIsSet(variable))
+        return;
+
+    traceFileName = QFile::decodeName(qgetenv(variable));
+    s_enabled = true;
+    qAddPostRoutine(dumpAtExit);
+
+    qCDebug(XdgDesktopPortalTestTracer) << "Tracing to" << traceFileName;
+}
+
+quint64 Tracer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return quint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Tracer::record(const char *name, quint64 start, quint64 end, qint64 argument)
+{
+    TraceRing *ring = currentRing();
+
+    const quint32 head = ring->head.load();
+    // Rather lose new events than overwrite ones a dump may be reading
+    if (head - ring->tail.loadAcquire() >= RING_SIZE) {
+        ring->dropped.ref();
+        return;
+    }
+
+    TraceEvent &event = ring->events[head & (RING_SIZE - 1)];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.argument = argument;
+
+    ring->head.storeRelease(head + 1);
+}
+
+bool Tracer::dump(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(XdgDesktopPortalTestTracer) << "Failed to write trace to" << fileName << file.errorString();
+        return false;
+    }
+
+    return dump(&file) && file.flush() && file.error() == QFileDevice::NoError;
+}
+
+bool Tracer::dump(QIODevice *device)
+{
+    bool ok = true;
+    auto write = [device, &ok] (const QByteArray &data) {
+        ok = device->write(data) == data.size() && ok;
+    };
+
+    const QByteArray pid = QByteArray::number(getpid());
+    bool first = true;
+    int events = 0;
+
+    write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    QMutexLocker locker(&ringsMutex);
+    for (TraceRing *ring : qAsConst(rings)) {
+        const QByteArray tid = QByteArray::number(ring->threadId);
+        const quint32 dropped = ring->dropped.fetchAndStoreRelaxed(0);
+
+        QByteArray line;
+        line += first ? "" : ",\n";
+        line += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid + ",\"tid\":" + tid
+              + ",\"args\":{\"name\":\"" + escaped(ring->threadName) + "\",\"dropped\":" + QByteArray::number(dropped) + "}}";
+        write(line);
+        first = false;
+
+        const quint32 head = ring->head.loadAcquire();
+        quint32 tail = ring->tail.load();
+        for (; tail != head; tail++) {
+            const TraceEvent &event = ring->events[tail & (RING_SIZE - 1)];
+
+            // Chrome wants microseconds
+            line = ",\n{\"name\":\"" + escaped(event.name) + "\",\"ph\":\"X\",\"pid\":" + pid + ",\"tid\":" + tid
+                 + ",\"ts\":" + QByteArray::number(event.start / 1000.0, 'f', 3)
+                 + ",\"dur\":" + QByteArray::number((event.end - event.start) / 1000.0, 'f', 3);
+            if (event.argument >= 0)
+                line += ",\"args\":{\"arg\":" + QByteArray::number(event.argument) + "}";
+            line += "}";
+            write(line);
+            events++;
+        }
+        ring->tail.storeRelease(head);
+    }
+
+    write("\n]}\n");
+
+    qCDebug(XdgDesktopPortalTestTracer) << "Wrote" << events << "trace events";
+    return ok;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2019 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Jan Grulich <jgrulich@redhat.com>
+ */
+
+#ifndef XDG_DESKTOP_PORTAL_TEST_TRACER_H
+#define XDG_DESKTOP_PORTAL_TEST_TRACER_H
+
+#include <QString>
+
+class QIODevice;
+
+// Records how long parts of the frame lifecycle took, into a lock-free ring
+// per thread, and writes them out as Chrome trace JSON, which can be opened
+// in chrome://tracing or Perfetto. Set XDP_TEST_TRACE to the file the trace
+// is written to when the application quits.
+class Tracer
+{
+public:
+    // Enables tracing when @variable names a file, has to be called once the
+    // application object exists
+    static void initialize(const char *variable = "XDP_TEST_TRACE");
+
+    // The only thing trace points do while tracing is off
+    static inline bool isEnabled() { return s_enabled; }
+
+    static quint64 now();
+    // @name has to outlive the tracer, a string literal that is
+    static void record(const char *name, quint64 start, quint64 end, qint64 argument = -1);
+
+    // Writes the events recorded since the previous dump and drops them
+    static bool dump(const QString &fileName);
+    // Same into an already open device
+    static bool dump(QIODevice *device);
+
+private:
+    static bool s_enabled;
+};
+
+// Records the time until the end of the scope
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *name)
+        : m_name(name)
+    {
+        if (Q_UNLIKELY(Tracer::isEnabled()))
+            m_start = Tracer::now();
+    }
+
+    ~TraceScope()
+    {
+        if (Q_UNLIKELY(m_start))
+            Tracer::record(m_name, m_start, Tracer::now(), m_argument);
+    }
+
+    // Shows up as "arg" in the trace, frame sequence numbers for example
+    void setArgument(qint64 argument)
+    {
+        m_argument = argument;
+    }
+
+private:
+    const char *m_name;
+    quint64 m_start = 0;
+    qint64 m_argument = -1;
+};
+
+#endif // XDG_DESKTOP_PORTAL_TEST_TRACER_H
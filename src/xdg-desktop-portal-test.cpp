@@ -22,13 +22,17 @@
 #include <QDBusConnection>
 #include <QLoggingCategory>
 
+#include "binarylog.h"
 #include "desktopportal.h"
+#include "tracer.h"
 
 Q_LOGGING_CATEGORY(XdgDesktopPortalTest, "xdp-test")
 
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
+    BinaryLog::initialize();
+    Tracer::initialize();
 
     QDBusConnection sessionBus = QDBusConnection::sessionBus();
 